@@ -0,0 +1,518 @@
+/* Throughput benchmarks for the kernel redis client, run on module load */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/vmalloc.h>
+
+#include "redisclient.h"
+#include "redispubsub.h"
+#include "redisshared.h"
+#include "redishash.h"
+#include "redischain.h"
+#include "redisload.h"
+
+#define SERVER_IP "127.0.0.1"
+
+/* 6380 is the default port of the in-kernel server (serverredis.c) */
+static int port = 6379;
+module_param(port, int, 0444);
+MODULE_PARM_DESC(port, "port of the server to benchmark");
+
+/* Number of requests kept in flight by the pipelined publishers */
+#define BENCH_WINDOW 1000
+
+static int requests = 100000;
+module_param(requests, int, 0444);
+MODULE_PARM_DESC(requests, "requests sent by the SET/GET benchmarks");
+
+static int pool_nodes = 64;
+module_param(pool_nodes, int, 0444);
+MODULE_PARM_DESC(pool_nodes, "reply nodes preallocated for the connection (0: no pool)");
+
+static int pool_strings = 64;
+module_param(pool_strings, int, 0444);
+MODULE_PARM_DESC(pool_strings, "short reply strings preallocated for the connection");
+
+static int sndbuf;
+module_param(sndbuf, int, 0444);
+MODULE_PARM_DESC(sndbuf, "SO_SNDBUF of the benchmark connection (0: default)");
+
+static int rcvbuf;
+module_param(rcvbuf, int, 0444);
+MODULE_PARM_DESC(rcvbuf, "SO_RCVBUF of the benchmark connection (0: default)");
+
+static int busy_poll;
+module_param(busy_poll, int, 0444);
+MODULE_PARM_DESC(busy_poll, "SO_BUSY_POLL microseconds (0: no busy polling)");
+
+static int quickack;
+module_param(quickack, int, 0444);
+MODULE_PARM_DESC(quickack, "keep TCP_QUICKACK set on the benchmark connection");
+
+static char *unixsocket;
+module_param(unixsocket, charp, 0444);
+MODULE_PARM_DESC(unixsocket, "unix socket of the same server, to compare its latency with loopback TCP");
+
+static int pubsub_messages = 100000;
+module_param(pubsub_messages, int, 0444);
+MODULE_PARM_DESC(pubsub_messages, "messages published by the Pub/Sub benchmark");
+
+static int shared_threads = 8;
+module_param(shared_threads, int, 0444);
+MODULE_PARM_DESC(shared_threads, "threads sending GETs on one shared connection (0: skip)");
+
+static int shared_budget = 20;
+module_param(shared_budget, int, 0444);
+MODULE_PARM_DESC(shared_budget, "microseconds the shared connection waits to batch more commands");
+
+static int hash_ops = 1000000;
+module_param(hash_ops, int, 0444);
+MODULE_PARM_DESC(hash_ops, "keys and pages hashed by the hashing benchmarks (0: skip)");
+
+static int chain_value = 65536;
+module_param(chain_value, int, 0444);
+MODULE_PARM_DESC(chain_value, "bytes of the values SET by the large pipeline benchmarks (0: skip)");
+
+static int load_window = 1024 * 1024;
+module_param(load_window, int, 0444);
+MODULE_PARM_DESC(load_window, "bytes in flight during the bulk load benchmark (0: skip)");
+
+/* Commands per pipeline of the large pipeline benchmarks */
+#define BENCH_CHAIN_BATCH 64
+
+/* Print 'ops' operations done in 'ns' nanoseconds as a rate */
+static void bench_report(const char *name, unsigned long ops, s64 ns)
+{
+        u64 rate = (u64)ops * USEC_PER_SEC;
+        u64 us = ns > 0 ? ns : 0;
+
+        /* do_div() as 64 bit divisions are not available on 32 bit */
+        do_div(us, NSEC_PER_USEC);
+        if (us == 0)
+                us = 1;
+        do_div(rate, (u32)us);
+        printk(KERN_INFO "%s: %lu ops in %llu us, %llu ops/sec\n",
+               name, ops, (unsigned long long)us, (unsigned long long)rate);
+}
+
+/* Allocator calls made by the client since 'before' */
+static void bench_allocs(redisContext *c, const char *name,
+                         unsigned long before)
+{
+        printk(KERN_INFO "%s: %lu allocations\n", name,
+               redisAllocCount(c) - before);
+}
+
+/* Send 'n' times the command in 'argv', keeping BENCH_WINDOW requests in
+ * flight, and report the rate. */
+static void bench_pipelined(redisContext *c, const char *name, int argc,
+                            const char **argv, int n)
+{
+        unsigned long allocs = redisAllocCount(c);
+        ktime_t start = ktime_get();
+        int sent, j;
+
+        for (sent = 0; sent < n; sent += j) {
+                for (j = 0; j < BENCH_WINDOW && sent + j < n; j++)
+                        redisSendCommandArgv(c, argc, argv, NULL);
+                for (j = 0; j < BENCH_WINDOW && sent + j < n; j++) {
+                        redisReply *r = redisReadReply(c);
+
+                        if (r == NULL) {
+                                printk(KERN_INFO "%s: protocol error\n",
+                                       name);
+                                return;
+                        }
+                        freeReplyObject(r);
+                }
+        }
+        bench_report(name, n, ktime_to_ns(ktime_sub(ktime_get(), start)));
+        bench_allocs(c, name, allocs);
+}
+
+/* SET and GET of a small value, one round trip per request and
+ * pipelined */
+static void bench_setget(redisContext *c)
+{
+        const char *set[3] = { "SET", "benchkey", "xxxxxxxxxxxxxxxx" };
+        const char *get[2] = { "GET", "benchkey" };
+        unsigned long allocs;
+        ktime_t start;
+        int j;
+
+        allocs = redisAllocCount(c);
+        start = ktime_get();
+        for (j = 0; j < requests; j++)
+                freeReplyObject(redisCommandArgv(c, 3, set, NULL));
+        bench_report("SET", requests,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+        bench_allocs(c, "SET", allocs);
+
+        allocs = redisAllocCount(c);
+        start = ktime_get();
+        for (j = 0; j < requests; j++)
+                freeReplyObject(redisCommandArgv(c, 2, get, NULL));
+        bench_report("GET", requests,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+        bench_allocs(c, "GET", allocs);
+
+        bench_pipelined(c, "SET (pipelined)", 3, set, requests);
+        bench_pipelined(c, "GET (pipelined)", 2, get, requests);
+}
+
+/* Read and free 'n' replies. Returns -1 on protocol or I/O error. */
+static int bench_replies(redisContext *c, const char *name, int n)
+{
+        redisReply *r;
+
+        while (n--) {
+                r = redisReadReply(c);
+                if (r == NULL || c->err) {
+                        printk(KERN_INFO "%s: protocol error\n", name);
+                        if (r)
+                                freeReplyObject(r);
+                        return -1;
+                }
+                freeReplyObject(r);
+        }
+        return 0;
+}
+
+/* Pipelines of SETs of large values, first encoded into one buffer, then
+ * into a chain of pages that references the value (redischain.h) */
+static void bench_chain(redisContext *c)
+{
+        const char *argv[3] = { "SET", "benchkey", NULL };
+        size_t argvlen[3] = { 3, 8, chain_value };
+        int npages = PAGE_ALIGN(chain_value) >> PAGE_SHIFT;
+        int batches = max(requests / 100 / BENCH_CHAIN_BATCH, 1);
+        struct page **pages = NULL;
+        redisChain *ch = NULL;
+        char *val;
+        ktime_t start;
+        sds out;
+        int b, j;
+
+        val = vmalloc(npages * PAGE_SIZE);
+        if (val == NULL)
+                return;
+        memset(val, 'x', chain_value);
+        argv[2] = val;
+        pages = kmalloc(sizeof(*pages) * npages, GFP_KERNEL);
+        ch = redisChainCreate(GFP_KERNEL);
+        if (pages == NULL || ch == NULL)
+                goto out;
+        for (j = 0; j < npages; j++)
+                pages[j] = vmalloc_to_page(val + j * PAGE_SIZE);
+
+        start = ktime_get();
+        for (b = 0; b < batches; b++) {
+                out = sdsempty();
+                for (j = 0; j < BENCH_CHAIN_BATCH; j++)
+                        out = redisCatCommandArgv(out, 3, argv, argvlen,
+                                                  GFP_KERNEL | __GFP_NOWARN);
+                if (out == NULL) {
+                        printk(KERN_INFO "SET large (copied): cannot "
+                               "allocate a %d byte pipeline\n",
+                               BENCH_CHAIN_BATCH * chain_value);
+                        break;
+                }
+                redisSendFormatted(c, out, sdslen(out));
+                sdsfree(out);
+                if (bench_replies(c, "SET large (copied)", BENCH_CHAIN_BATCH))
+                        goto out;
+        }
+        if (b == batches)
+                bench_report("SET large (copied)", b * BENCH_CHAIN_BATCH,
+                             ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+        start = ktime_get();
+        for (b = 0; b < batches; b++) {
+                redisChainReset(ch);
+                for (j = 0; j < BENCH_CHAIN_BATCH; j++)
+                        redisChainAppendCommandPages(ch, 2, argv, argvlen,
+                                                     pages, 0, chain_value);
+                if (redisChainSend(c, ch)) {
+                        printk(KERN_INFO "SET large (sendpage): cannot "
+                               "send the pipeline\n");
+                        goto out;
+                }
+                if (bench_replies(c, "SET large (sendpage)",
+                                  BENCH_CHAIN_BATCH))
+                        goto out;
+        }
+        bench_report("SET large (sendpage)", b * BENCH_CHAIN_BATCH,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+out:
+        if (ch)
+                redisChainFree(ch);
+        kfree(pages);
+        vfree(val);
+}
+
+struct bench_load_iter {
+        int next;
+        char key[32];
+};
+
+static int bench_load_next(void *privdata, const char **key, size_t *keylen,
+                           const char **val, size_t *vallen)
+{
+        struct bench_load_iter *it = privdata;
+
+        if (it->next == requests)
+                return 0;
+        *keylen = snprintf(it->key, sizeof(it->key), "benchload:%d",
+                           it->next++);
+        *key = it->key;
+        *val = "xxxxxxxxxxxxxxxx";
+        *vallen = 16;
+        return 1;
+}
+
+/* SET of 'requests' distinct keys with redisBulkLoad() */
+static void bench_load(redisContext *c)
+{
+        struct bench_load_iter it = { 0 };
+        redisLoadStats st;
+        ktime_t start = ktime_get();
+        int rc;
+
+        rc = redisBulkLoad(c, bench_load_next, &it, load_window, &st);
+        bench_report("SET (bulk load)", st.replies,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+        printk(KERN_INFO "SET (bulk load): %llu bytes, %lu errors%s\n",
+               (unsigned long long)st.bytes, st.errors,
+               rc ? ", load failed" : "");
+}
+
+/* Slots of a short key, and CRC16 and redisHash64() over a page, which
+ * is ops/sec * 4 KB/sec */
+static void bench_hash(void)
+{
+        static char page[PAGE_SIZE];
+        const char *key = "{user:1000}:profile";
+        u64 sum = 0;
+        ktime_t start;
+        int j;
+
+        for (j = 0; j < PAGE_SIZE; j++)
+                page[j] = j * 31;
+
+        start = ktime_get();
+        for (j = 0; j < hash_ops; j++)
+                sum += redisKeySlot(key, 19);
+        bench_report("key slot", hash_ops,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+        start = ktime_get();
+        for (j = 0; j < hash_ops / 16; j++)
+                sum += redisCrc16(page, PAGE_SIZE);
+        bench_report("CRC16 of a page", hash_ops / 16,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+        start = ktime_get();
+        for (j = 0; j < hash_ops / 16; j++)
+                sum += redisHash64(page, PAGE_SIZE, j);
+        bench_report("redisHash64 of a page", hash_ops / 16,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+        /* keep the loops from being optimized out */
+        if (sum == 42)
+                printk(KERN_DEBUG "bench_hash: %llu\n",
+                       (unsigned long long)sum);
+}
+
+static redisShared *bench_shared_conn;
+static atomic_t bench_shared_left;
+static DECLARE_COMPLETION(bench_shared_done);
+
+static int bench_shared_thread(void *data)
+{
+        const char *get[2] = { "GET", "benchkey" };
+        int j, n = (long)data;
+
+        for (j = 0; j < n; j++)
+                freeReplyObject(redisSharedCommandArgv(bench_shared_conn, 2,
+                                                       get, NULL));
+        if (atomic_dec_and_test(&bench_shared_left))
+                complete(&bench_shared_done);
+        return 0;
+}
+
+/* GETs from shared_threads threads at once on a single connection, whose
+ * commands are batched into as few writes as possible */
+static void bench_shared(const redisAddress *addr)
+{
+        redisContext *c;
+        redisReply *reply;
+        ktime_t start;
+        int j, n = requests / shared_threads;
+
+        reply = redisConnectAddress(&c, addr, NULL);
+        if (reply != NULL) {
+                printk(KERN_INFO "shared: %s\n", reply->reply);
+                freeReplyObject(reply);
+                return;
+        }
+        bench_shared_conn = redisSharedCreate(c, shared_budget, 64 * 1024);
+        if (bench_shared_conn == NULL) {
+                redisFree(c);
+                return;
+        }
+        atomic_set(&bench_shared_left, shared_threads);
+        start = ktime_get();
+        for (j = 0; j < shared_threads; j++) {
+                if (IS_ERR(kthread_run(bench_shared_thread, (void *)(long)n,
+                                       "benchshared%d", j)) &&
+                    atomic_dec_and_test(&bench_shared_left))
+                        complete(&bench_shared_done);
+        }
+        wait_for_completion(&bench_shared_done);
+        bench_report("GET (shared)", bench_shared_conn->commands,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+        printk(KERN_INFO "GET (shared): %lu commands in %lu writes\n",
+               bench_shared_conn->commands, bench_shared_conn->writes);
+        redisSharedFree(bench_shared_conn);
+}
+
+/* Average round trip of a PING over a new connection to 'addr' */
+static void bench_latency(const char *addr)
+{
+        const char *ping[1] = { "PING" };
+        redisContext *c;
+        redisReply *reply;
+        ktime_t start;
+        u64 ns;
+        int j;
+
+        reply = redisConnect(&c, addr, port);
+        if (reply != NULL) {
+                printk(KERN_INFO "%s: %s\n", addr, reply->reply);
+                freeReplyObject(reply);
+                return;
+        }
+        start = ktime_get();
+        for (j = 0; j < requests; j++)
+                freeReplyObject(redisCommandArgv(c, 1, ping, NULL));
+        ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+        do_div(ns, requests > 0 ? requests : 1);
+        printk(KERN_INFO "PING latency over %s: %llu ns\n", addr,
+               (unsigned long long)ns);
+        redisFree(c);
+}
+
+static void bench_pubsub_handler(void *privdata, const char *channel,
+                                 size_t channellen, const char *msg,
+                                 size_t msglen)
+{
+}
+
+/* Messages per second delivered to a handler, with a second connection of
+ * this module publishing to a local server as fast as it can. */
+static void bench_pubsub(redisContext *c)
+{
+        redisSubscriber *sub;
+        const char *argv[3] = { "PUBLISH", "benchchan", "payload" };
+        ktime_t start;
+        int sent, j, idle;
+
+        sub = redisSubscriberCreate(SERVER_IP, port);
+        if (sub == NULL ||
+            redisSubscribe(sub, "benchchan", bench_pubsub_handler, NULL) ||
+            redisSubscriberSync(sub, HZ)) {
+                printk(KERN_INFO "pubsub: cannot subscribe\n");
+                goto out;
+        }
+
+        start = ktime_get();
+        for (sent = 0; sent < pubsub_messages; sent += j) {
+                for (j = 0; j < BENCH_WINDOW && sent + j < pubsub_messages;
+                     j++)
+                        redisSendCommandArgv(c, 3, argv, NULL);
+                for (j = 0; j < BENCH_WINDOW && sent + j < pubsub_messages;
+                     j++) {
+                        redisReply *r = redisReadReply(c);
+
+                        if (r == NULL)
+                                goto out;
+                        freeReplyObject(r);
+                }
+        }
+        /* wait for the subscriber to catch up, giving up after 1s idle */
+        for (idle = 0; sub->messages < sent && idle < 1000; idle++) {
+                unsigned long before = sub->messages;
+
+                msleep(1);
+                if (sub->messages != before)
+                        idle = 0;
+        }
+        bench_report("pubsub delivered", sub->messages,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)));
+out:
+        if (sub)
+                redisSubscriberFree(sub);
+}
+
+static int __init benchredis_init(void)
+{
+        redisSocketOptions opts = {
+                .sndbuf = sndbuf,
+                .rcvbuf = rcvbuf,
+                .busypoll = busy_poll,
+                .quickack = quickack,
+        };
+        redisAddress addr;
+        redisContext *c;
+        redisReply *reply;
+
+        if (hash_ops > 0)
+                bench_hash();
+
+        redisParseAddress(&addr, SERVER_IP, port);
+        reply = redisConnectAddress(&c, &addr, &opts);
+        if (reply != NULL) {
+                printk(KERN_INFO "Connection error: %s", reply->reply);
+                freeReplyObject(reply);
+                return 1;
+        }
+        if ((pool_nodes || pool_strings) &&
+            redisContextSetPool(c, pool_nodes, pool_strings))
+                printk(KERN_INFO "cannot preallocate the reply pool\n");
+
+        bench_setget(c);
+        bench_pubsub(c);
+        if (chain_value > 0)
+                bench_chain(c);
+        if (load_window > 0)
+                bench_load(c);
+        if (shared_threads > 0)
+                bench_shared(&addr);
+
+        bench_latency(SERVER_IP);
+        if (unixsocket) {
+                char addr[UNIX_PATH_MAX + 6];
+
+                snprintf(addr, sizeof(addr), "unix:%s", unixsocket);
+                bench_latency(addr);
+        }
+
+        redisFree(c);
+        return 0;
+}
+
+void __exit benchredis_exit(void)
+{
+}
+
+module_init(benchredis_init);
+module_exit(benchredis_exit);
+
+MODULE_AUTHOR("avr");
+MODULE_DESCRIPTION("benchredis");
+MODULE_VERSION("0.01");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,51 @@
+/* Loads the character device sharing client connections with userspace
+ * (see redisdev.h) */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+
+#include "redisdev.h"
+
+static char *name = "redis";
+module_param(name, charp, 0444);
+MODULE_PARM_DESC(name, "name of the device in /dev");
+
+static char *server = "127.0.0.1";
+module_param(server, charp, 0444);
+MODULE_PARM_DESC(server, "address of the server: IPv4, IPv6 or unix:/path");
+
+static int port = 6379;
+module_param(port, int, 0444);
+MODULE_PARM_DESC(port, "port of the server");
+
+static int conns = 4;
+module_param(conns, int, 0444);
+MODULE_PARM_DESC(conns, "connections shared by the processes using the device");
+
+static redisDev *dev;
+
+static int __init devredis_init(void)
+{
+        dev = redisDevCreate(name, server, port, conns);
+        if (dev == NULL) {
+                printk(KERN_ERR "devredis: cannot create /dev/%s\n", name);
+                return -EINVAL;
+        }
+        printk(KERN_INFO "devredis: /dev/%s to %s, %d connections\n",
+               name, server, conns);
+        return 0;
+}
+
+void __exit devredis_exit(void)
+{
+        redisDevDestroy(dev);
+}
+
+module_init(devredis_init);
+module_exit(devredis_exit);
+
+MODULE_AUTHOR("avr");
+MODULE_DESCRIPTION("devredis");
+MODULE_VERSION("0.01");
+MODULE_LICENSE("GPL");
@@ -57,6 +57,81 @@ int kernel_anetWrite(int fd, char *buf, int count)
     return totlen;
 }
 
+/* Receive whatever is available on 'sock', up to 'count' bytes, with the
+ * MSG_* 'flags'. Returns the number of bytes read, 0 on EOF or a negative
+ * errno. Unlike the fd based functions above this can be called from any
+ * thread. */
+int kernel_sockRecv(struct socket *sock, char *buf, int count, int flags)
+{
+    struct msghdr msg;
+    struct kvec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = count;
+    return kernel_recvmsg(sock, &msg, &iov, 1, count, flags);
+}
+
+/* Like kernel_anetRead() but on a struct socket */
+int kernel_sockRead(struct socket *sock, char *buf, int count)
+{
+    int nread, totlen = 0;
+
+    while(totlen != count) {
+        nread = kernel_sockRecv(sock,buf,count-totlen,0);
+        if (nread == 0)
+            break;
+        if (nread < 0)
+            return -1;
+        totlen += nread;
+        buf += nread;
+    }
+    return totlen;
+}
+
+/* Send up to 'count' bytes of 'buf' on 'sock' with the MSG_* 'flags'
+ * (MSG_NOSIGNAL is always added). Returns the number of bytes sent, which
+ * may be short, or a negative errno (-EAGAIN with MSG_DONTWAIT if there is
+ * no room in the send buffer). */
+int kernel_sockSend(struct socket *sock, char *buf, int count, int flags)
+{
+    struct msghdr msg;
+    struct kvec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_flags = MSG_NOSIGNAL | flags;
+    iov.iov_base = buf;
+    iov.iov_len = count;
+    return kernel_sendmsg(sock, &msg, &iov, 1, count);
+}
+
+/* Like kernel_anetWrite() but on a struct socket */
+int kernel_sockWrite(struct socket *sock, char *buf, int count)
+{
+    int nwritten, totlen = 0;
+
+    while(totlen != count) {
+        nwritten = kernel_sockSend(sock,buf,count-totlen,0);
+        if (nwritten == 0)
+            break;
+        if (nwritten < 0)
+            return -1;
+        totlen += nwritten;
+        buf += nwritten;
+    }
+    return totlen;
+}
+
+/* Send 'count' bytes of 'page' from 'offset' on 'sock' without copying
+ * them: the socket keeps a reference to the page until the bytes are
+ * acknowledged, so they must not change until the peer has them. Returns
+ * the number of bytes sent, which may be short, or a negative errno. */
+int kernel_sockSendPage(struct socket *sock, struct page *page, int offset,
+        size_t count, int flags)
+{
+    return kernel_sendpage(sock, page, offset, count, MSG_NOSIGNAL | flags);
+}
+
 /*
    Quicker anetTcpNoDelay (from hiredis) without calling 
    sys_setsockopt directly (which requires an fd instead of struct socket)
@@ -86,6 +161,33 @@ int kernel_setsockopt(struct socket *sock, int level, int optname,
     return err;
 }
 
+int kernel_reuseaddr(struct socket *sock)
+{
+    int yes = 1;
+    return kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, 
+            (char*)&yes, sizeof(yes));
+}
+
+int kernel_reuseport(struct socket *sock)
+{
+#ifdef SO_REUSEPORT
+    int yes = 1;
+    return kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, 
+            (char*)&yes, sizeof(yes));
+#else
+    return -ENOPROTOOPT;
+#endif
+}
+
+/* Set an integer socket option. A negative 'optname' stands for an option
+   this kernel does not have. */
+int kernel_setsockint(struct socket *sock, int level, int optname, int val)
+{
+    if (optname < 0)
+        return -ENOPROTOOPT;
+    return kernel_setsockopt(sock, level, optname, (char*)&val, sizeof(val));
+}
+
 int kernel_tcpnodelay(struct socket *sock)
 {
     int yes = 1;
@@ -186,6 +288,16 @@ size_t RecvBuffer(struct socket *sock, const char *Buffer, size_t Length)
  */
 
 struct socket* set_up_server_socket(int port_no) {
+    return set_up_listen_socket(port_no, 32, 0);
+}
+
+/*
+   Same as set_up_server_socket() with a configurable listen backlog. With
+   'reuseport' set, SO_REUSEPORT lets several sockets listen on the same
+   port, the kernel spreading new connections across them (when the
+   running kernel supports it)
+ */
+struct socket* set_up_listen_socket(int port_no, int backlog, int reuseport) {
     struct socket *sock;
     struct sockaddr_in sin;
 
@@ -193,8 +305,16 @@ struct socket* set_up_server_socket(int port_no) {
 
     /* First create a socket */
     error = sock_create(PF_INET,SOCK_STREAM,IPPROTO_TCP,&sock) ;
-    if (error<0)
+    if (error<0) {
         printk("Error during creation of socket; terminating\n");
+        return 0;
+    }
+    kernel_reuseaddr(sock); /* allow restarting on the same port at once */
+    if (reuseport && kernel_reuseport(sock) < 0) {
+        printk("SO_REUSEPORT not supported\n");
+        sock_release(sock);
+        return 0;
+    }
 
     /* Now bind the socket */
     sin.sin_family = AF_INET;
@@ -205,13 +325,17 @@ struct socket* set_up_server_socket(int port_no) {
     if (error<0)
     {
         printk("Error binding socket \n");
+        sock_release(sock);
         return 0;
     }
 
     /* Now, start listening on the socket */
-    error=sock->ops->listen(sock,32);
-    if (error!=0)
+    error=sock->ops->listen(sock,backlog);
+    if (error!=0) {
         printk("Error listening on socket \n");
+        sock_release(sock);
+        return 0;
+    }
 
     /* Now start accepting */
     // Accepting is performed by the function server_accept_connection
@@ -231,11 +355,14 @@ struct socket* server_accept_connection(struct socket *sock) {
     struct socket * newsock;
     int error;
 
-    /* Before accept: Clone the socket */
+    /* Before accept: Clone the socket. accept() grafts the sock of the
+       new connection, so the clone must not get one of its own */
 
-    error = sock_create(PF_INET,SOCK_STREAM,IPPROTO_TCP,&newsock);
-    if (error<0)
+    error = sock_create_lite(PF_INET,SOCK_STREAM,IPPROTO_TCP,&newsock);
+    if (error<0) {
         printk("Error during creation of the other socket; terminating\n");
+        return 0;
+    }
 
     newsock->type = sock->type;
     newsock->ops=sock->ops;
@@ -246,7 +373,10 @@ struct socket* server_accept_connection(struct socket *sock) {
 
 
     if (error<0) {
-        printk("Error accepting socket\n") ;
+        /* quiet when the listener is shut down */
+        if (error != -EINVAL)
+            printk("Error accepting socket\n") ;
+        sock_release(newsock);
         return 0;
     }
     return newsock;
@@ -28,9 +28,18 @@
 
 int kernel_anetRead(int fd, char *buf, int count);
 int kernel_anetWrite(int fd, char *buf, int count);
+int kernel_sockRecv(struct socket *sock, char *buf, int count, int flags);
+int kernel_sockRead(struct socket *sock, char *buf, int count);
+int kernel_sockSend(struct socket *sock, char *buf, int count, int flags);
+int kernel_sockWrite(struct socket *sock, char *buf, int count);
+int kernel_sockSendPage(struct socket *sock, struct page *page, int offset,
+        size_t count, int flags);
 int kernel_setsockopt(struct socket *sock, int level, int optname,
         char __user *optval, int optlen);
+int kernel_setsockint(struct socket *sock, int level, int optname, int val);
 int kernel_tcpnodelay(struct socket *sock);
+int kernel_reuseaddr(struct socket *sock);
+int kernel_reuseport(struct socket *sock);
 /* The following are lifted from some linuxforums article on networking
   from within the kernel */
 size_t SendBuffer(struct socket *sock, const char *Buffer, size_t
@@ -38,6 +47,7 @@ size_t SendBuffer(struct socket *sock, const char *Buffer, size_t
 size_t RecvBuffer(struct socket *sock, const char *Buffer, size_t
         Length);
 struct socket* set_up_server_socket(int port_no);
+struct socket* set_up_listen_socket(int port_no, int backlog, int reuseport);
 struct socket* server_accept_connection(struct socket *sock);
 struct socket* set_up_client_socket(unsigned int IP_addr, int port_no);
 
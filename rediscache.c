@@ -0,0 +1,180 @@
+/*
+   A per-CPU cache of the replies to read-only commands.
+
+   Every CPU has its own table and LRU list, which only that CPU touches
+   with preemption disabled: lookups and stores take no lock and share no
+   cache line with the other CPUs. The price is that a reply may be cached
+   once per CPU, and that each CPU is limited to 'maxbytes'.
+
+   Entries are keyed on the command as sent on the wire, so GET foo and
+   get foo are different entries. They expire 'ttl' after being stored:
+   the cache is meant for data that is allowed to be that stale, and does
+   not track writes. A hit returns a reference to the cached reply, which
+   the caller frees with freeReplyObject() as usual and must not modify.
+ */
+
+#include <linux/jhash.h>
+
+#include "rediscache.h"
+
+/* Create a cache keeping replies for 'ttl_ms' milliseconds, using up to
+ * 'maxbytes' bytes per CPU, for the commands named in the NULL terminated
+ * 'commands' (matched regardless of case). Returns NULL if out of
+ * memory. */
+redisCache *redisCacheCreate(unsigned int ttl_ms, size_t maxbytes,
+        const char * const *commands) {
+    redisCache *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+    int j, cpu;
+
+    if (cache == NULL) return NULL;
+    cache->ttl = msecs_to_jiffies(ttl_ms);
+    cache->maxbytes = maxbytes;
+    cache->commands = redisCommandListCreate(commands);
+    if (cache->commands == NULL) goto err;
+    cache->cpus = alloc_percpu(redisCacheCpu);
+    if (cache->cpus == NULL) goto err;
+    for_each_possible_cpu(cpu) {
+        redisCacheCpu *cc = per_cpu_ptr(cache->cpus,cpu);
+
+        for (j = 0; j < REDIS_CACHE_BUCKETS; j++)
+            INIT_HLIST_HEAD(&cc->buckets[j]);
+        INIT_LIST_HEAD(&cc->lru);
+    }
+    return cache;
+
+err:
+    redisCacheFree(cache);
+    return NULL;
+}
+
+static void redisCacheUnlink(redisCacheCpu *cc, redisCacheEntry *e) {
+    hlist_del(&e->node);
+    list_del(&e->lru);
+    cc->bytes -= e->size;
+}
+
+static void redisCacheEntryFree(redisCacheEntry *e) {
+    if (e->reply) freeReplyObject(e->reply);
+    sdsfree(e->key);
+    kfree(e);
+}
+
+static redisCacheEntry *redisCacheFind(redisCacheCpu *cc, const char *cmd,
+        size_t len, u32 hash) {
+    struct hlist_node *pos;
+    redisCacheEntry *e;
+
+    hlist_for_each_entry(e,pos,&cc->buckets[hash%REDIS_CACHE_BUCKETS],node)
+        if (e->hash == hash && sdslen(e->key) == len &&
+            !memcmp(e->key,cmd,len)) return e;
+    return NULL;
+}
+
+/* Return a reference to the cached reply to 'cmd', encoded in 'len' bytes,
+ * or NULL if it is not cached on this CPU, has expired or the command is
+ * not cached at all. Never sleeps. */
+redisReply *redisCacheLookup(redisCache *cache, const char *cmd, size_t len) {
+    redisCacheCpu *cc;
+    redisCacheEntry *e, *expired = NULL;
+    redisReply *r = NULL;
+    u32 hash;
+
+    if (!redisCommandInList(cmd,len,cache->commands)) return NULL;
+    hash = jhash(cmd,len,0);
+    cc = per_cpu_ptr(cache->cpus,get_cpu());
+    e = redisCacheFind(cc,cmd,len,hash);
+    if (e && time_after(jiffies,e->expires)) {
+        redisCacheUnlink(cc,e);
+        expired = e;
+    } else if (e) {
+        r = redisReplyGet(e->reply);
+    }
+    if (r) cc->hits++;
+    else cc->misses++;
+    put_cpu();
+    if (expired) redisCacheEntryFree(expired);
+    return r;
+}
+
+/* Cache 'r', the reply to 'cmd', on this CPU, allocating with 'gfp'. Error
+ * and nil replies are not cached, nor replies larger than the cache, and
+ * nothing is if out of memory. The oldest entries are evicted to make
+ * room. */
+void redisCacheStore(redisCache *cache, const char *cmd, size_t len,
+        const redisReply *r, gfp_t gfp) {
+    redisCacheCpu *cc;
+    redisCacheEntry *e, *old, *n;
+    LIST_HEAD(evicted);
+    size_t size;
+
+    if (r == NULL || r->type == REDIS_REPLY_ERROR ||
+        r->type == REDIS_REPLY_NIL || redisIsOOMReply((redisReply*)r) ||
+        !redisCommandInList(cmd,len,cache->commands)) return;
+
+    /* Allocate everything before disabling preemption */
+    e = kzalloc(sizeof(*e), gfp);
+    if (e == NULL) return;
+    e->key = sdsnewlenGfp(cmd,len,gfp);
+    e->reply = redisReplyCopy(r,gfp,&size);
+    if (e->key == NULL || e->reply == NULL) goto skip;
+    e->size = sizeof(*e)+len+size;
+    if (e->size > cache->maxbytes) goto skip;
+    e->hash = jhash(cmd,len,0);
+    e->expires = jiffies+cache->ttl;
+
+    cc = per_cpu_ptr(cache->cpus,get_cpu());
+    if ((old = redisCacheFind(cc,cmd,len,e->hash)) != NULL) {
+        redisCacheUnlink(cc,old);
+        list_add(&old->lru,&evicted);
+    }
+    while (cc->bytes+e->size > cache->maxbytes) {
+        old = list_first_entry(&cc->lru,redisCacheEntry,lru);
+        redisCacheUnlink(cc,old);
+        list_add(&old->lru,&evicted);
+    }
+    hlist_add_head(&e->node,&cc->buckets[e->hash%REDIS_CACHE_BUCKETS]);
+    list_add_tail(&e->lru,&cc->lru);
+    cc->bytes += e->size;
+    put_cpu();
+
+    list_for_each_entry_safe(old,n,&evicted,lru)
+        redisCacheEntryFree(old);
+    return;
+
+skip:
+    redisCacheEntryFree(e);
+}
+
+/* Hits and misses of the lookups of commands that may be cached, summed
+ * over the CPUs */
+void redisCacheStats(redisCache *cache, unsigned long *hits,
+        unsigned long *misses) {
+    int cpu;
+
+    *hits = *misses = 0;
+    for_each_possible_cpu(cpu) {
+        redisCacheCpu *cc = per_cpu_ptr(cache->cpus,cpu);
+
+        *hits += cc->hits;
+        *misses += cc->misses;
+    }
+}
+
+/* Free 'cache'. No context may use it any more; references to its
+ * replies held by callers stay valid. */
+void redisCacheFree(redisCache *cache) {
+    redisCacheEntry *e, *n;
+    int cpu;
+
+    if (cache->cpus) {
+        for_each_possible_cpu(cpu) {
+            redisCacheCpu *cc = per_cpu_ptr(cache->cpus,cpu);
+
+            list_for_each_entry_safe(e,n,&cc->lru,lru)
+                redisCacheEntryFree(e);
+        }
+        free_percpu(cache->cpus);
+    }
+    redisCommandListFree(cache->commands);
+    kfree(cache);
+}
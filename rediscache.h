@@ -0,0 +1,53 @@
+/*
+   A per-CPU cache of the replies to read-only commands, for the kernel
+   redis client.
+ */
+
+#ifndef __REDISCACHE_H
+#define __REDISCACHE_H
+
+#include <linux/list.h>
+#include <linux/percpu.h>
+
+#include "redisclient.h"
+
+#define REDIS_CACHE_BUCKETS 64
+
+/* A cached reply, keyed on the command as sent on the wire */
+typedef struct redisCacheEntry {
+    struct hlist_node node;  /* In a bucket of the CPU */
+    struct list_head lru;    /* In the LRU list of the CPU */
+    sds key;
+    u32 hash;
+    unsigned long expires;   /* jiffies */
+    redisReply *reply;       /* Shared, see redisReplyCopy() */
+    size_t size;             /* Bytes charged to the CPU */
+} redisCacheEntry;
+
+/* What one CPU caches. Only that CPU touches it, with preemption disabled,
+ * so there is no lock. */
+typedef struct redisCacheCpu {
+    struct hlist_head buckets[REDIS_CACHE_BUCKETS];
+    struct list_head lru;    /* Least recently stored first */
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+} redisCacheCpu;
+
+typedef struct redisCache {
+    redisCacheCpu *cpus;     /* alloc_percpu() */
+    unsigned long ttl;       /* jiffies */
+    size_t maxbytes;         /* Per CPU */
+    sds *commands;           /* NULL terminated, never changed */
+} redisCache;
+
+redisCache *redisCacheCreate(unsigned int ttl_ms, size_t maxbytes,
+        const char * const *commands);
+redisReply *redisCacheLookup(redisCache *cache, const char *cmd, size_t len);
+void redisCacheStore(redisCache *cache, const char *cmd, size_t len,
+        const redisReply *r, gfp_t gfp);
+void redisCacheStats(redisCache *cache, unsigned long *hits,
+        unsigned long *misses);
+void redisCacheFree(redisCache *cache);
+
+#endif /* __REDISCACHE_H */
@@ -0,0 +1,185 @@
+/*
+   Pipelines encoded into a chain of pages and sent with sendpage.
+
+   A large pipeline encoded with redisCatCommandArgv() needs one
+   contiguous buffer as large as all its commands, values included, which
+   is copied once more into the socket. Here the protocol is encoded into
+   pages allocated one at a time, and values the caller already holds in
+   pages are not copied at all: the chain references them, and the socket
+   takes its own references when they are sent with kernel_sendpage().
+
+   The socket may still read a page after redisChainSend() returned, until
+   the peer acknowledged it: the chain never writes to a page it sent, and
+   the pages of values must not change until their replies were read.
+ */
+
+#include <linux/kernel.h>
+
+#include "networking_utils.h"
+#include "redischain.h"
+
+/* Create an empty chain, whose pages and fragments are allocated with
+ * 'gfp' (without __GFP_HIGHMEM: the protocol is written through
+ * page_address()). Returns NULL if out of memory. */
+redisChain *redisChainCreate(gfp_t gfp) {
+    redisChain *ch = kzalloc(sizeof(*ch), gfp);
+
+    if (ch == NULL) return NULL;
+    ch->gfp = gfp;
+    return ch;
+}
+
+/* Add the 'len' bytes of 'page' at 'offset' to the chain, merged with the
+ * last fragment when they follow it in the same page */
+static int redisChainAddFrag(redisChain *ch, struct page *page,
+        unsigned int offset, unsigned int len) {
+    redisChainFrag *f = ch->nfrags ? &ch->frags[ch->nfrags-1] : NULL;
+    int cap;
+
+    if (f && f->page == page && f->offset+f->len == offset) {
+        f->len += len;
+    } else {
+        if (ch->nfrags == ch->cap) {
+            cap = ch->cap ? ch->cap*2 : 16;
+            f = krealloc(ch->frags, sizeof(*f)*cap, ch->gfp);
+            if (f == NULL) return -1;
+            ch->frags = f;
+            ch->cap = cap;
+        }
+        get_page(page);
+        f = &ch->frags[ch->nfrags++];
+        f->page = page;
+        f->offset = offset;
+        f->len = len;
+    }
+    ch->len += len;
+    return 0;
+}
+
+/* Copy 'len' bytes of protocol into the chain */
+static int redisChainPut(redisChain *ch, const char *buf, size_t len) {
+    size_t n;
+
+    while (len) {
+        if (ch->cur == NULL || ch->used == PAGE_SIZE) {
+            if (ch->cur) put_page(ch->cur);
+            if ((ch->cur = alloc_page(ch->gfp)) == NULL) return -1;
+            ch->used = 0;
+        }
+        n = min_t(size_t, len, PAGE_SIZE-ch->used);
+        memcpy((char*)page_address(ch->cur)+ch->used,buf,n);
+        if (redisChainAddFrag(ch,ch->cur,ch->used,n) == -1) return -1;
+        ch->used += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int redisChainPutHeader(redisChain *ch, char type, size_t n) {
+    char buf[REDIS_HEADER_MAX];
+
+    return redisChainPut(ch,buf,redisFormatHeader(buf,type,n));
+}
+
+static int redisChainAppend(redisChain *ch, int argc, const char **argv,
+        const size_t *argvlen, struct page **pages, size_t offset,
+        size_t len) {
+    size_t arglen;
+    unsigned int n;
+    int j;
+
+    if (ch->err) return -1;
+    if (redisChainPutHeader(ch,'*',argc+(pages != NULL)) == -1) goto err;
+    for (j = 0; j < argc; j++) {
+        arglen = argvlen ? argvlen[j] : strlen(argv[j]);
+        if (redisChainPutHeader(ch,'$',arglen) == -1 ||
+            redisChainPut(ch,argv[j],arglen) == -1 ||
+            redisChainPut(ch,"\r\n",2) == -1) goto err;
+    }
+    if (pages) {
+        if (redisChainPutHeader(ch,'$',len) == -1) goto err;
+        pages += offset/PAGE_SIZE;
+        offset %= PAGE_SIZE;
+        while (len) {
+            n = min_t(size_t, len, PAGE_SIZE-offset);
+            if (redisChainAddFrag(ch,*pages,offset,n) == -1) goto err;
+            pages++;
+            offset = 0;
+            len -= n;
+        }
+        if (redisChainPut(ch,"\r\n",2) == -1) goto err;
+    }
+    ch->commands++;
+    return 0;
+
+err:
+    ch->err = 1;
+    return -1;
+}
+
+/* Append a command, copying its arguments into the chain. As with
+ * redisCatCommandArgv(), 'argvlen' may be NULL for arguments that are C
+ * strings. Returns -1 if out of memory: the chain then holds part of the
+ * command, and can only be reset. */
+int redisChainAppendCommandArgv(redisChain *ch, int argc, const char **argv,
+        const size_t *argvlen) {
+    return redisChainAppend(ch,argc,argv,argvlen,NULL,0,0);
+}
+
+/* Append a command whose last argument, after the 'argc' of 'argv', is the
+ * 'len' bytes at 'offset' in the array of 'pages', e.g. the value of a SET.
+ * Those bytes are referenced, not copied: they must not change until the
+ * reply to the command was read. Returns -1 if out of memory, like
+ * redisChainAppendCommandArgv(). */
+int redisChainAppendCommandPages(redisChain *ch, int argc, const char **argv,
+        const size_t *argvlen, struct page **pages, size_t offset,
+        size_t len) {
+    return redisChainAppend(ch,argc,argv,argvlen,pages,offset,len);
+}
+
+/* Send the chain on 'c' without copying it, one fragment after the other
+ * with MSG_MORE until the last. The caller then reads one reply per
+ * command (ch->commands), and may reset the chain to append the next
+ * batch. Returns -1 if the chain is incomplete (the context is left as it
+ * is) or on I/O error. */
+int redisChainSend(redisContext *c, redisChain *ch) {
+    redisChainFrag *f;
+    unsigned int sent;
+    int j, n;
+
+    if (c->err || ch->err) return -1;
+    for (j = 0; j < ch->nfrags; j++) {
+        f = &ch->frags[j];
+        for (sent = 0; sent < f->len; sent += n) {
+            n = kernel_sockSendPage(c->sock,f->page,f->offset+sent,
+                    f->len-sent,j < ch->nfrags-1 ? MSG_MORE : 0);
+            if (n <= 0) {
+                c->err = REDIS_ERR_IO;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Empty the chain. The page being filled is dropped too, since its bytes
+ * may still be on their way. */
+void redisChainReset(redisChain *ch) {
+    int j;
+
+    for (j = 0; j < ch->nfrags; j++) put_page(ch->frags[j].page);
+    if (ch->cur) put_page(ch->cur);
+    ch->cur = NULL;
+    ch->used = 0;
+    ch->nfrags = 0;
+    ch->len = 0;
+    ch->commands = 0;
+    ch->err = 0;
+}
+
+void redisChainFree(redisChain *ch) {
+    redisChainReset(ch);
+    kfree(ch->frags);
+    kfree(ch);
+}
@@ -0,0 +1,42 @@
+/*
+   Pipelines encoded into a chain of pages and sent with sendpage, for the
+   kernel redis client.
+ */
+
+#ifndef __REDISCHAIN_H
+#define __REDISCHAIN_H
+
+#include <linux/mm.h>
+
+#include "redisclient.h"
+
+/* A run of bytes of the stream within one page. Each holds a reference to
+ * its page. */
+typedef struct redisChainFrag {
+    struct page *page;
+    unsigned int offset;
+    unsigned int len;
+} redisChainFrag;
+
+typedef struct redisChain {
+    redisChainFrag *frags;
+    int nfrags;
+    int cap;           /* Room in frags */
+    struct page *cur;  /* Page the protocol is encoded into */
+    unsigned int used; /* Bytes of cur used */
+    size_t len;        /* Bytes in the chain */
+    int commands;      /* Commands in the chain: replies to read */
+    int err;           /* Out of memory while appending */
+    gfp_t gfp;
+} redisChain;
+
+redisChain *redisChainCreate(gfp_t gfp);
+void redisChainReset(redisChain *ch);
+void redisChainFree(redisChain *ch);
+int redisChainAppendCommandArgv(redisChain *ch, int argc, const char **argv,
+        const size_t *argvlen);
+int redisChainAppendCommandPages(redisChain *ch, int argc, const char **argv,
+        const size_t *argvlen, struct page **pages, size_t offset, size_t len);
+int redisChainSend(redisContext *c, redisChain *ch);
+
+#endif /* __REDISCHAIN_H */
@@ -2,217 +2,1250 @@
    adapted from the hiredis client library by avr
  */
 
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+#include <linux/tls.h>
+#endif
+
 #include "redisclient.h"
+#include "rediscache.h"
+#include "redisflight.h"
+
+/* Options missing from older kernels, refused by kernel_setsockint() */
+#ifdef SO_BUSY_POLL
+#define REDIS_SO_BUSY_POLL SO_BUSY_POLL
+#else
+#define REDIS_SO_BUSY_POLL -1
+#endif
+#ifdef SO_MARK
+#define REDIS_SO_MARK SO_MARK
+#else
+#define REDIS_SO_MARK -1
+#endif
+
+static redisReply *createReplyObject(redisContext *c, int type, sds reply,
+        int flags);
+
+/* Returned instead of a reply when memory runs out, so that callers never
+ * get NULL. It is never freed (freeReplyObject() ignores it), and its
+ * string has the layout of an sds so that sdslen() works on it. */
+static struct {
+    long len;
+    long free;
+    char buf[14];
+} redisOOMString = { 13, 0, "Out of memory" };
 
-static redisReply *redisReadReply(int fd);
-static redisReply *createReplyObject(int type, sds reply);
+static redisReply redisOOMReply = {
+    REDIS_REPLY_ERROR, 0, redisOOMString.buf, 0, NULL, NULL, 0, 0,
+    ATOMIC_INIT(0)
+};
 
-/* We simply abort on out of memory */
-static void redisOOM(void) {
-    printk(KERN_ERR "Out of memory in redisclient.c");
+/* An allocation failed or would have exceeded the budget of 'c'. When
+ * 'fatal', part of a reply is left unread in the stream: the connection
+ * is marked as failed, as on a protocol error. */
+static redisReply *redisOOM(redisContext *c, int fatal) {
+    if (printk_ratelimit())
+        printk(KERN_ERR "redisclient: out of memory\n");
+    if (c) {
+        atomic_inc(&c->acct->failures);
+        if (fatal && !c->err) c->err = REDIS_ERR_OOM;
+    }
+    return &redisOOMReply;
 }
 
-/* Connect to a Redis instance. On success NULL is returned and *fd is set
- * to the socket file descriptor. On error a redisReply object is returned
- * with reply->type set to REDIS_REPLY_ERROR and reply->string containing
- * the error message. This replyObject must be freed with redisFreeReply(). */
-/*
-   redisReply *redisConnect(int *fd, const char *ip, int port) {
-   char err[REDIS_ERR_LEN];
-
- *fd = anetTcpConnect(err,ip,port);
- if (*fd == ANET_ERR)
- return createReplyObject(REDIS_REPLY_ERROR,sdsnew(err));
- anetTcpNoDelay(NULL,*fd);
- return NULL;
- }
- */
+/* The reply of a failed allocation made on behalf of 'c' outside of this
+ * file, for the helpers built on the client: counted like the others, and
+ * told apart by redisIsOOMReply(). The connection is left usable. */
+redisReply *redisOOMReplyFor(redisContext *c) {
+    return redisOOM(c,0);
+}
 
-redisReply* redisConnect(int *fd, const char *ip, int port)
-{
-    int rc;
-    struct socket *sock;
-    struct sockaddr_in sin;
-
-    rc = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
-    if (!rc) {  
-        /* success */
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = in_aton(ip);
-        sin.sin_port = htons(port);
-
-        rc = sock->ops->connect(sock, (struct sockaddr*)&sin, 
-                sizeof(sin), 0);
-        if (!rc) 
-            rc = kernel_tcpnodelay(sock); /* set TCP_NODELAY for socket */
-        else
-            return createReplyObject(REDIS_REPLY_ERROR, 
-                    sdsnew("Cannot connect to the IP port combo"));
+/* Tell the reply returned when out of memory from an error reply sent by
+ * the server. */
+int redisIsOOMReply(redisReply *r) {
+    return r == &redisOOMReply;
+}
+
+/* Charge 'size' bytes to the context, unless that exceeds its budget.
+ * Only the thread reading from the context charges, so checking before
+ * adding is not racy: concurrent frees can only lower 'used'. */
+static int redisCharge(redisContext *c, size_t size) {
+    redisMemAcct *a = c->acct;
+
+    if (a->budget && atomic_long_read(&a->used)+(long)size > a->budget)
+        return -1;
+    atomic_long_add(size,&a->used);
+    return 0;
+}
+
+/* Size of a pooled string: an sds of up to REDIS_POOL_STRLEN bytes */
+#define REDIS_POOL_STRSIZE (sizeof(struct sdshdr)+REDIS_POOL_STRLEN+1)
+
+/* Free objects are linked through their first word */
+static void *redisPoolGet(redisPool *p, void **list) {
+    void *obj;
+
+    spin_lock(&p->lock);
+    if ((obj = *list) != NULL) *list = *(void **)obj;
+    spin_unlock(&p->lock);
+    return obj;
+}
+
+static void redisPoolPut(redisPool *p, void **list, void *obj) {
+    spin_lock(&p->lock);
+    *(void **)obj = *list;
+    *list = obj;
+    spin_unlock(&p->lock);
+}
+
+/* Free the pool. Every object is back on its free list by then, as the
+ * pool goes with the last reference to the accounting. */
+static void redisPoolDestroy(redisPool *p) {
+    void *obj;
+
+    while ((obj = redisPoolGet(p,&p->nodes)) != NULL) kfree(obj);
+    while ((obj = redisPoolGet(p,&p->strings)) != NULL) kfree(obj);
+    kfree(p);
+}
+
+static void redisAcctPut(redisMemAcct *a, size_t size) {
+    atomic_long_sub(size,&a->used);
+    if (atomic_dec_and_test(&a->refs)) {
+        if (a->pool) redisPoolDestroy(a->pool);
+        kfree(a);
+    }
+}
+
+/* Allocate 'size' bytes for the reply being read, charged to it. */
+static void *redisReplyAlloc(redisContext *c, size_t size) {
+    void *p;
 
+    if (redisCharge(c,size) == -1) return NULL;
+    if ((p = kmalloc(size, c->gfp|__GFP_NOWARN)) == NULL) {
+        atomic_long_sub(size,&c->acct->used);
+        return NULL;
+    }
+    c->allocs++;
+    c->charged += size;
+    return p;
+}
+
+/* New reply node for the reply being read, from the pool if possible. */
+static redisReply *redisReplyNode(redisContext *c) {
+    redisPool *p = c->acct->pool;
+    redisReply *r;
+
+    if (p && (r = redisPoolGet(p,&p->nodes)) != NULL) {
+        if (redisCharge(c,sizeof(*r)) == -1) {
+            redisPoolPut(p,&p->nodes,r);
+            return NULL;
+        }
+        c->charged += sizeof(*r);
+        r->flags = REDIS_REPLY_F_POOLNODE;
+        return r;
+    }
+    if ((r = redisReplyAlloc(c,sizeof(*r))) != NULL) r->flags = 0;
+    return r;
+}
+
+/* New string of 'len' bytes for the reply being read, charged to it.
+ * Short strings come from the pool, which is recorded in *flags. */
+static sds redisReplyString(redisContext *c, const void *init, size_t len,
+        int *flags) {
+    size_t size = sizeof(struct sdshdr)+len+1;
+    redisPool *p = c->acct->pool;
+    struct sdshdr *sh;
+    sds s;
+
+    if (redisCharge(c,size) == -1) return NULL;
+    if (p && len <= REDIS_POOL_STRLEN &&
+        (sh = redisPoolGet(p,&p->strings)) != NULL) {
+        /* no free space: growing it would krealloc() pool memory */
+        sh->len = len;
+        sh->free = 0;
+        if (init) memcpy(sh->buf,init,len);
+        sh->buf[len] = '\0';
+        s = sh->buf;
+        *flags |= REDIS_REPLY_F_POOLSTR;
+    } else if ((s = sdsnewlenGfp(init,len,c->gfp|__GFP_NOWARN)) != NULL) {
+        c->allocs++;
     } else {
-        return createReplyObject(REDIS_REPLY_ERROR, 
-                sdsnew("Cannot create socket!"));
+        atomic_long_sub(size,&c->acct->used);
+        return NULL;
     }
+    c->charged += size;
+    return s;
+}
 
-    *fd = sock_map_fd(sock);
-    if (*fd < 0)
-        return createReplyObject(REDIS_REPLY_ERROR, 
-                sdsnew("Cannot do sock_map_fd!"));
+static void redisReplyStringFree(redisPool *p, sds s, int flags) {
+    if (flags & REDIS_REPLY_F_POOLSTR)
+        redisPoolPut(p,&p->strings,s-sizeof(struct sdshdr));
+    else
+        sdsfree(s);
+}
 
+static void redisReplyNodeFree(redisPool *p, redisReply *r) {
+    if (r->flags & REDIS_REPLY_F_POOLNODE)
+        redisPoolPut(p,&p->nodes,r);
+    else
+        kfree(r);
+}
+
+/* A reply made of a copy of 'len' bytes at 'buf' */
+static redisReply *redisStringReply(redisContext *c, int type,
+        const char *buf, size_t len) {
+    int flags = 0;
+    sds s = redisReplyString(c,buf,len,&flags);
+
+    return createReplyObject(c,type,s,flags);
+}
+
+/* Fill 'a' with the address of a server given as "unix:/path/to/socket",
+ * an IPv6 address ("::1" or "[::1]") or an IPv4 address ("127.0.0.1"), the
+ * last two with 'port'. Returns 0 on success, -1 if 'addr' is none of
+ * these or the path is too long. */
+int redisParseAddress(redisAddress *a, const char *addr, int port) {
+    const char *end;
+    size_t len;
+
+    memset(a,0,sizeof(*a));
+    if (!strncmp(addr,"unix:",5)) {
+        addr += 5;
+        len = strlen(addr);
+        if (len == 0 || len >= sizeof(a->u.un.sun_path)) return -1;
+        a->family = AF_UNIX;
+        a->u.un.sun_family = AF_UNIX;
+        memcpy(a->u.un.sun_path,addr,len+1);
+        a->len = offsetof(struct sockaddr_un,sun_path)+len+1;
+    } else if (strchr(addr,':') != NULL) {
+        int bracket = addr[0] == '[';
+
+        if (!in6_pton(addr+bracket,-1,a->u.in6.sin6_addr.s6_addr,
+                      bracket ? ']' : -1,&end) ||
+            (bracket && *end++ != ']') || *end != '\0')
+            return -1;
+        a->family = AF_INET6;
+        a->u.in6.sin6_family = AF_INET6;
+        a->u.in6.sin6_port = htons(port);
+        a->len = sizeof(a->u.in6);
+    } else {
+        if (!in4_pton(addr,-1,(u8*)&a->u.in.sin_addr.s_addr,-1,&end) ||
+            *end != '\0')
+            return -1;
+        a->family = AF_INET;
+        a->u.in.sin_family = AF_INET;
+        a->u.in.sin_port = htons(port);
+        a->len = sizeof(a->u.in);
+    }
+    return 0;
+}
+
+/* Connect to a Redis instance at 'addr' (see redisParseAddress()). On
+ * success NULL is returned and *c is set to a new connection context. On
+ * error a redisReply object is returned with reply->type set to
+ * REDIS_REPLY_ERROR and reply->string containing the error message. This
+ * replyObject must be freed with freeReplyObject(). */
+redisReply *redisConnect(redisContext **c, const char *addr, int port) {
+    redisAddress a;
+
+    if (redisParseAddress(&a,addr,port) == -1)
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdsnew("Invalid address"),0);
+    return redisConnectAddress(c,&a,NULL);
+}
+
+/* Set the options of 'o' on 'sock'. Returns NULL on success or the name of
+ * the option that could not be set. */
+static const char *redisSetSocketOptions(struct socket *sock, int tcp,
+        const redisSocketOptions *o) {
+    if (o->sndbuf && kernel_setsockint(sock,SOL_SOCKET,SO_SNDBUF,o->sndbuf))
+        return "SO_SNDBUF";
+    if (o->rcvbuf && kernel_setsockint(sock,SOL_SOCKET,SO_RCVBUF,o->rcvbuf))
+        return "SO_RCVBUF";
+    if (o->priority &&
+        kernel_setsockint(sock,SOL_SOCKET,SO_PRIORITY,o->priority))
+        return "SO_PRIORITY";
+    if (o->mark && kernel_setsockint(sock,SOL_SOCKET,REDIS_SO_MARK,o->mark))
+        return "SO_MARK";
+    if (!tcp) return NULL;
+
+    if (o->keepalive) {
+        if (kernel_setsockint(sock,SOL_SOCKET,SO_KEEPALIVE,1))
+            return "SO_KEEPALIVE";
+        if (o->keepidle &&
+            kernel_setsockint(sock,IPPROTO_TCP,TCP_KEEPIDLE,o->keepidle))
+            return "TCP_KEEPIDLE";
+        if (o->keepintvl &&
+            kernel_setsockint(sock,IPPROTO_TCP,TCP_KEEPINTVL,o->keepintvl))
+            return "TCP_KEEPINTVL";
+        if (o->keepcnt &&
+            kernel_setsockint(sock,IPPROTO_TCP,TCP_KEEPCNT,o->keepcnt))
+            return "TCP_KEEPCNT";
+    }
+    if (o->busypoll &&
+        kernel_setsockint(sock,SOL_SOCKET,REDIS_SO_BUSY_POLL,o->busypoll))
+        return "SO_BUSY_POLL";
+    if (o->quickack && kernel_setsockint(sock,IPPROTO_TCP,TCP_QUICKACK,1))
+        return "TCP_QUICKACK";
     return NULL;
 }
 
-/* Create a reply object */
-static redisReply *createReplyObject(int type, sds reply) {
-    redisReply *r = kmalloc(sizeof(*r), GFP_KERNEL);
+/* Like redisConnect(), with an address already parsed and the socket
+ * options 'opts' (NULL for none). A unix socket avoids the TCP/IP stack
+ * altogether when the server runs on the same host. */
+redisReply *redisConnectAddress(redisContext **c, const redisAddress *a,
+        const redisSocketOptions *opts) {
+    int tcp = a->family != AF_UNIX;
+    struct socket *sock;
+    const char *opt;
+    int rc;
+
+    rc = sock_create(a->family, SOCK_STREAM, tcp ? IPPROTO_TCP : 0, &sock);
+    if (rc)
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdsnew("Cannot create socket!"),0);
+    if (opts && (opt = redisSetSocketOptions(sock,tcp,opts)) != NULL) {
+        sock_release(sock);
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdscat(sdsnew("Cannot set socket option "),opt),0);
+    }
+
+    rc = sock->ops->connect(sock, (struct sockaddr*)&a->u.sa, a->len, 0);
+    if (rc) {
+        sock_release(sock);
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdsnew(a->family == AF_UNIX ?
+                    "Cannot connect to the unix socket" :
+                    "Cannot connect to the IP port combo"),0);
+    }
+    if (tcp)
+        kernel_tcpnodelay(sock); /* set TCP_NODELAY for socket */
+
+    if ((*c = redisContextCreate(sock)) == NULL) {
+        sock_release(sock);
+        return redisOOM(NULL,0);
+    }
+    if (tcp && opts) {
+        (*c)->quickack = opts->quickack;
+        (*c)->cork = opts->cork;
+    }
+    return NULL;
+}
+
+/* Adopt the connected socket behind the descriptor 'fd' of the calling
+ * process. This is how TLS connections are made: a userspace helper does
+ * the TLS handshake and installs the session keys with kernel TLS
+ * (TCP_ULP "tls", TLS_TX and TLS_RX, as OpenSSL does with ktls enabled)
+ * or hands them to redisTlsInstall(), then gives the descriptor to the
+ * module, which calls this from the helper's context. The kernel then
+ * encrypts and decrypts every send and receive of the context. The helper
+ * may close 'fd' afterwards. Returns NULL or an error reply, like
+ * redisConnect(). */
+redisReply *redisConnectFd(redisContext **c, int fd) {
+    struct socket *sock;
+    int err;
+
+    if ((sock = sockfd_lookup(fd,&err)) == NULL)
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdsnew("Not a socket"),0);
+    if ((*c = redisContextCreate(sock)) == NULL) {
+        sockfd_put(sock);
+        return redisOOM(NULL,0);
+    }
+    (*c)->fdsock = 1;
+    kernel_tcpnodelay(sock);
+    return NULL;
+}
+
+/* Switch the connection of 'c' to kernel TLS with the session keys of a
+ * handshake done elsewhere: 'tx' and 'rx' are the struct
+ * tls12_crypto_info_* of each direction. Must be called before anything
+ * is sent or received after the handshake. Needs Linux 4.17; returns 0 on
+ * success or a negative errno. */
+int redisTlsInstall(redisContext *c, const void *tx, int txlen,
+        const void *rx, int rxlen) {
+#if defined(TCP_ULP) && defined(TLS_TX) && defined(TLS_RX)
+    int rc;
+
+    rc = kernel_setsockopt(c->sock,SOL_TCP,TCP_ULP,"tls",sizeof("tls"));
+    if (rc == 0)
+        rc = kernel_setsockopt(c->sock,SOL_TLS,TLS_TX,(char*)tx,txlen);
+    if (rc == 0)
+        rc = kernel_setsockopt(c->sock,SOL_TLS,TLS_RX,(char*)rx,rxlen);
+    return rc;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
 
-    if (!r) redisOOM();
+/* Wrap a connected socket in a context, which takes ownership of it. The
+ * socket is used directly rather than through a file descriptor:
+ * descriptors belong to the calling process, and a context must also be
+ * usable from kernel threads. */
+redisContext *redisContextCreate(struct socket *sock) {
+    redisContext *c;
+
+    if ((c = kmalloc(sizeof(*c), GFP_KERNEL)) == NULL) return NULL;
+    if ((c->acct = kmalloc(sizeof(*c->acct), GFP_KERNEL)) == NULL ||
+        (c->ibuf = sdsempty()) == NULL) {
+        kfree(c->acct);
+        kfree(c);
+        return NULL;
+    }
+    atomic_set(&c->acct->refs,1);
+    atomic_long_set(&c->acct->used,0);
+    c->acct->budget = 0;
+    atomic_set(&c->acct->failures,0);
+    c->acct->pool = NULL;
+    c->sock = sock;
+    c->ipos = 0;
+    c->err = 0;
+    c->gfp = GFP_KERNEL;
+    c->ibufmem = sdsAllocSize(c->ibuf);
+    atomic_long_add(c->ibufmem,&c->acct->used);
+    c->depth = 0;
+    c->charged = 0;
+    c->obuf = NULL;
+    c->allocs = 0;
+    c->quickack = 0;
+    c->cork = 0;
+    c->fdsock = 0;
+    c->cache = NULL;
+    c->flight = NULL;
+    c->batchmode = REDIS_BATCH_MODE_AUTO;
+    c->batchpipe = 0;
+    return c;
+}
+
+/* Close the connection and free the context. The replies read from it may
+ * still be freed afterwards. */
+void redisFree(redisContext *c) {
+    if (c == NULL) return;
+    if (c->fdsock) sockfd_put(c->sock);
+    else sock_release(c->sock);
+    sdsfree(c->ibuf);
+    sdsfree(c->obuf);
+    redisAcctPut(c->acct,c->ibufmem);
+    kfree(c);
+}
+
+/* Hold back partial TCP segments from 'on' until !on, which sends them.
+ * Callers pipelining many commands cork around the whole batch; a TCP
+ * connection only. */
+void redisCork(redisContext *c, int on) {
+    kernel_setsockint(c->sock,IPPROTO_TCP,TCP_CORK,on);
+}
+
+/* Set the GFP flags of the allocations made on behalf of 'c' (input
+ * buffer, replies, commands). GFP_KERNEL by default; callers in memory
+ * reclaim paths pass GFP_NOIO or GFP_NOFS, and GFP_ATOMIC avoids sleeping
+ * in the allocator. A failed allocation is reported, never dereferenced:
+ * see redisIsOOMReply(). */
+void redisSetAllocFlags(redisContext *c, gfp_t gfp) {
+    c->gfp = gfp;
+}
+
+/* Serve the commands allowed by 'cache' out of it, or stop caching if
+ * 'cache' is NULL. A cache may be shared by several contexts connected to
+ * the same server and database, and must outlive them. */
+void redisSetCache(redisContext *c, struct redisCache *cache) {
+    c->cache = cache;
+}
+
+/* Share the replies to the commands allowed by 'f' with the contexts
+ * sending the same command at the same time, or stop if 'f' is NULL. Like
+ * a cache, 'f' must outlive the contexts using it. */
+void redisSetFlight(redisContext *c, struct redisFlight *f) {
+    c->flight = f;
+}
+
+/* Choose how redisGetBatch() and redisSetBatch() send the keys. MGET and
+ * MSET cost the server least, but are refused as a whole when the keys
+ * are spread over several nodes (CROSSSLOT from a cluster or proxy). The
+ * default, REDIS_BATCH_MODE_AUTO, sends them and resends the keys of a
+ * refused command as a pipeline of GET/SET, which it uses from then on;
+ * REDIS_BATCH_MODE_MULTI and REDIS_BATCH_MODE_PIPELINE force either. */
+void redisSetBatchMode(redisContext *c, int mode) {
+    c->batchmode = mode;
+    c->batchpipe = 0;
+}
+
+/* Limit the memory held by the input buffer of 'c' and the replies read
+ * from it that are not freed yet to 'bytes' (0 for no limit). A reply
+ * that would go over the budget is replaced by the out of memory reply. */
+void redisSetMemoryBudget(redisContext *c, long bytes) {
+    c->acct->budget = bytes;
+}
+
+/* Bytes currently charged to 'c' */
+long redisMemoryUsed(redisContext *c) {
+    return atomic_long_read(&c->acct->used);
+}
+
+/* Preallocate 'nodes' reply nodes and 'strings' reply strings (of up to
+ * REDIS_POOL_STRLEN bytes) for the replies read from 'c'. Replies then take
+ * their memory from the pool and give it back when freed, so that reading
+ * small replies calls the allocator only once the pool runs dry; this also
+ * lets them be read when the allocator fails. Returns 0 on success and -1
+ * if out of memory or 'c' already has a pool. */
+int redisContextSetPool(redisContext *c, int nodes, int strings) {
+    redisPool *p;
+    void *obj;
+    int j;
+
+    if (c->acct->pool) return -1;
+    if ((p = kzalloc(sizeof(*p), GFP_KERNEL)) == NULL) return -1;
+    spin_lock_init(&p->lock);
+    for (j = 0; j < nodes+strings; j++) {
+        obj = kmalloc(j < nodes ? sizeof(redisReply) : REDIS_POOL_STRSIZE,
+                GFP_KERNEL);
+        if (obj == NULL) {
+            redisPoolDestroy(p);
+            return -1;
+        }
+        redisPoolPut(p,j < nodes ? &p->nodes : &p->strings,obj);
+    }
+    c->acct->pool = p;
+    return 0;
+}
+
+/* Number of allocator calls made for 'c': input buffer, command buffer and
+ * replies. Allocating the arguments of the printf-like redisCommand() is
+ * not counted, redisCommandArgv() is the way to avoid it. */
+unsigned long redisAllocCount(redisContext *c) {
+    return c->allocs;
+}
+
+/* Create a reply object taking ownership of 'reply' (a pooled string if
+ * 'flags' says so). Replies read from 'c' are charged to it; those made up
+ * locally pass NULL. If memory runs out the out of memory reply is
+ * returned instead. */
+static redisReply *createReplyObject(redisContext *c, int type, sds reply,
+        int flags) {
+    redisReply *r;
+
+    if (reply == NULL && type != REDIS_REPLY_INTEGER &&
+        type != REDIS_REPLY_ARRAY)
+        return redisOOM(c,0);
+    if (c) {
+        r = redisReplyNode(c);
+    } else if ((r = kmalloc(sizeof(*r), GFP_KERNEL)) != NULL) {
+        r->flags = 0;
+    }
+    if (r == NULL) {
+        if (reply) redisReplyStringFree(c ? c->acct->pool : NULL,reply,flags);
+        return redisOOM(c,0);
+    }
     r->type = type;
     r->reply = reply;
+    r->elements = 0;
+    r->element = NULL;
+    r->acct = c ? c->acct : NULL;
+    r->mem = 0;
+    r->flags |= flags;
     return r;
 }
 
 /* Free a reply object */
 void freeReplyObject(redisReply *r) {
+    redisMemAcct *acct = r->acct;
+    redisPool *p;
     size_t j;
+    int top;
 
+    if (r == &redisOOMReply) return;
+    if ((r->flags & REDIS_REPLY_F_SHARED) && !atomic_dec_and_test(&r->refs))
+        return;
+    p = acct ? acct->pool : NULL;
+    top = r->flags & REDIS_REPLY_F_TOP;
     switch(r->type) {
         case REDIS_REPLY_INTEGER:
             break; /* Nothing to free */
         case REDIS_REPLY_ARRAY:
             for (j = 0; j < r->elements; j++)
-                freeReplyObject(r->element[j]);
+                if (r->element[j]) freeReplyObject(r->element[j]);
             kfree(r->element);
             break;
         default:
-            sdsfree(r->reply);
+            redisReplyStringFree(p,r->reply,r->flags);
             break;
     }
-    kfree(r);
+    if (top) {
+        size_t mem = r->mem;
+
+        /* the last reference takes the pool with it */
+        redisReplyNodeFree(p,r);
+        redisAcctPut(acct,mem);
+    } else {
+        redisReplyNodeFree(p,r);
+    }
 }
 
-static redisReply *redisIOError(void) {
-    return createReplyObject(REDIS_REPLY_ERROR,sdsnew("I/O error"));
+/* Copy 'r' into a reply of its own, not tied to any context, which can be
+ * shared: redisReplyGet() takes a reference to it and freeReplyObject()
+ * drops one. *size is set to the bytes it takes. Returns NULL if out of
+ * memory. */
+redisReply *redisReplyCopy(const redisReply *r, gfp_t gfp, size_t *size) {
+    redisReply *copy;
+    size_t j, sub;
+
+    if ((copy = kmalloc(sizeof(*copy),gfp)) == NULL) return NULL;
+    *copy = *r;
+    copy->acct = NULL;
+    copy->mem = 0;
+    copy->flags = REDIS_REPLY_F_SHARED;
+    atomic_set(&copy->refs,1);
+    *size = sizeof(*copy);
+    switch (r->type) {
+    case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_NIL:
+        copy->reply = NULL;
+        break;
+    case REDIS_REPLY_ARRAY:
+        copy->element = NULL;
+        copy->elements = 0;
+        if (r->elements &&
+            (copy->element = kzalloc(sizeof(redisReply*)*r->elements,gfp))
+            == NULL)
+            goto err;
+        copy->elements = r->elements;
+        *size += sizeof(redisReply*)*r->elements;
+        for (j = 0; j < r->elements; j++) {
+            if ((copy->element[j] = redisReplyCopy(r->element[j],gfp,&sub))
+                == NULL)
+                goto err;
+            copy->element[j]->flags = 0; /* owned by the array */
+            *size += sub;
+        }
+        break;
+    default:
+        if ((copy->reply = sdsnewlenGfp(r->reply,sdslen(r->reply),gfp))
+            == NULL)
+            goto err;
+        *size += sizeof(struct sdshdr)+sdslen(r->reply)+1;
+        break;
+    }
+    return copy;
+
+err:
+    freeReplyObject(copy);
+    return NULL;
 }
 
-/* modified by avr due to syscalls */
-/* In a real high performance C client this should be bufferized */
-static sds redisReadLine(int fd) {
-    mm_segment_t old_fs;
+/* Take a reference to a reply made by redisReplyCopy(). Shared replies
+ * must not be modified. */
+redisReply *redisReplyGet(redisReply *r) {
+    atomic_inc(&r->refs);
+    return r;
+}
 
-    sds line = sdsempty();
-    old_fs = get_fs();
-    set_fs(KERNEL_DS);
+static redisReply *redisIOError(redisContext *c) {
+    return redisStringReply(c,REDIS_REPLY_ERROR,"I/O error",9);
+}
 
-    while(1) {
-        char c;
-        ssize_t ret;
+/* Make room for a read of REDIS_IOBUF_LEN bytes in the input buffer,
+ * keeping its size charged to the context. */
+static int redisBufferGrow(redisContext *c) {
+    size_t need, len = sdslen(c->ibuf);
+    sds ibuf;
 
-        ret = sys_read(fd,&c,1);
-        if (ret == -1) {
-            sdsfree(line);
-            set_fs(old_fs);
-            return NULL;
-        } else if ((ret == 0) || (c == '\n')) {
-            break;
-        } else {
-            line = sdscatlen(line,&c,1);
-        }
+    if (sdsavail(c->ibuf) >= REDIS_IOBUF_LEN) return 0;
+    /* what sdsMakeRoomFor() allocates */
+    need = sizeof(struct sdshdr)+(len+REDIS_IOBUF_LEN)*2+1;
+    if (redisCharge(c,need-c->ibufmem) == -1) return -1;
+    ibuf = sdsMakeRoomForGfp(c->ibuf,REDIS_IOBUF_LEN,c->gfp|__GFP_NOWARN);
+    if (ibuf == NULL) {
+        atomic_long_sub(need-c->ibufmem,&c->acct->used);
+        return -1;
     }
+    c->ibuf = ibuf;
+    c->ibufmem = need;
+    c->allocs++;
+    return 0;
+}
 
-    set_fs(old_fs);
-    return sdstrim(line,"\r\n");
+/* Read whatever is available on the socket (up to REDIS_IOBUF_LEN bytes)
+ * into the input buffer, discarding the part that was already parsed.
+ * 'flags' are passed to recvmsg(). Returns the number of bytes read, 0 if
+ * MSG_DONTWAIT was given and there was nothing to read, and -1 on EOF or
+ * error (c->err is set). */
+static int redisBufferReadFlags(redisContext *c, int flags) {
+    int nread;
+
+    if (c->ipos) {
+        c->ibuf = sdsrange(c->ibuf,c->ipos,-1);
+        c->ipos = 0;
+    }
+    if (redisBufferGrow(c) == -1) {
+        redisOOM(c,1);
+        return -1;
+    }
+
+    nread = kernel_sockRecv(c->sock,c->ibuf+sdslen(c->ibuf),REDIS_IOBUF_LEN,
+            flags);
+    if (nread == -EAGAIN && (flags & MSG_DONTWAIT)) return 0;
+    if (nread <= 0) {
+        c->err = REDIS_ERR_IO;
+        return -1;
+    }
+    sdsIncrLen(c->ibuf,nread);
+    if (c->quickack)
+        kernel_setsockint(c->sock,IPPROTO_TCP,TCP_QUICKACK,1);
+    return nread;
 }
 
-static redisReply *redisReadSingleLineReply(int fd, int type) {
-    sds buf = redisReadLine(fd);
+int redisBufferRead(redisContext *c) {
+    return redisBufferReadFlags(c,0);
+}
 
-    if (buf == NULL) return redisIOError();
-    return createReplyObject(type,buf);
+/* Non blocking redisBufferRead(), for callers multiplexing many
+ * connections: returns 0 instead of waiting when nothing is available. */
+int redisBufferReadNonBlock(redisContext *c) {
+    return redisBufferReadFlags(c,MSG_DONTWAIT);
 }
 
-static redisReply *redisReadIntegerReply(int fd) {
-    sds buf = redisReadLine(fd);
-    redisReply *r = kmalloc(sizeof(*r), GFP_KERNEL);
+/* Make sure at least 'len' unparsed bytes are in the input buffer. */
+static int redisBufferFill(redisContext *c, size_t len) {
+    while (sdslen(c->ibuf)-c->ipos < len)
+        if (redisBufferRead(c) <= 0) return -1;
+    return 0;
+}
 
-    if (r == NULL) redisOOM();
-    if (buf == NULL) {
-        kfree(r);
-        return redisIOError();
+/* Find the "\r\n" terminating the line that starts at 's'. The scan is
+ * done by memchr(), which the kernel implements word at a time (or with
+ * string instructions), rather than one byte per loop iteration. */
+static char *seekNewline(char *s, size_t len) {
+    char *p = s, *end = s+len;
+
+    while (p < end && (p = memchr(p,'\r',(end-p)-1)) != NULL) {
+        if (p[1] == '\n') return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* Return a pointer to the next line in the input buffer and consume it,
+ * reading more from the socket when the buffer holds no complete line.
+ * The line is not nul terminated but always followed by "\r\n"; its
+ * length is stored in *len. Returns NULL on I/O error. */
+static char *redisReadLine(redisContext *c, size_t *len) {
+    size_t scanned = 0;
+    char *line, *nl;
+
+    while (1) {
+        line = c->ibuf+c->ipos;
+        if (sdslen(c->ibuf)-c->ipos >= 2) {
+            nl = seekNewline(line+scanned,sdslen(c->ibuf)-c->ipos-scanned);
+            if (nl != NULL) break;
+            /* a '\r' at the very end may still be followed by '\n' */
+            scanned = sdslen(c->ibuf)-c->ipos-1;
+        }
+        if (redisBufferRead(c) <= 0) return NULL;
+    }
+    *len = nl-line;
+    c->ipos += *len+2;
+    return line;
+}
+
+/* Parse the decimal number in the 'len' bytes at 's' into *value. This
+ * works directly on the input buffer, so no nul terminated copy of the line
+ * is needed. Only an optional '-' followed by digits is accepted: empty
+ * strings, stray characters and values that do not fit in a long long are
+ * rejected. Returns 0 on success and -1 on error. */
+int redisParseLongLong(const char *s, size_t len, long long *value) {
+    const char *end = s+len;
+    unsigned long long v = 0;
+    int neg = 0;
+
+    if (s < end && *s == '-') {
+        neg = 1;
+        s++;
     }
-    r->type = REDIS_REPLY_INTEGER;
-    r->integer = simple_strtoll(buf,NULL,10);
-    sdsfree(buf);
+    if (s == end) return -1;
+    while (s < end) {
+        unsigned int d = (unsigned char)*s-'0';
+
+        if (d > 9) return -1;
+        /* LLONG_MAX ends in 7, -LLONG_MIN in 8. The limits are constants,
+         * so no 64 bit division is emitted. */
+        if (v > LLONG_MAX/10 || (v == LLONG_MAX/10 && d > 7+(unsigned)neg))
+            return -1;
+        v = v*10+d;
+        s++;
+    }
+    *value = neg ? -(long long)(v-1)-1 : (long long)v;
+    return 0;
+}
+
+/* A length or integer could not be parsed. Whatever follows it can not be
+ * found in the stream, so the connection is marked as failed: every later
+ * read on it returns an error without touching the socket. */
+static redisReply *redisProtocolError(redisContext *c) {
+    c->err = REDIS_ERR_PROTOCOL;
+    return redisStringReply(c,REDIS_REPLY_ERROR,
+            "Protocol error: bad length or integer",37);
+}
+
+static redisReply *redisReadSingleLineReply(redisContext *c, int type) {
+    size_t len;
+    char *buf = redisReadLine(c,&len);
+
+    if (buf == NULL) return redisIOError(c);
+    return redisStringReply(c,type,buf,len);
+}
+
+static redisReply *redisReadIntegerReply(redisContext *c) {
+    size_t len;
+    char *buf = redisReadLine(c,&len);
+    redisReply *r;
+
+    long long value;
+
+    if (buf == NULL) return redisIOError(c);
+    if (redisParseLongLong(buf,len,&value) == -1) return redisProtocolError(c);
+    r = createReplyObject(c,REDIS_REPLY_INTEGER,NULL,0);
+    if (r != &redisOOMReply) r->integer = value;
     return r;
 }
 
-static redisReply *redisReadBulkReply(int fd) {
-    sds replylen = redisReadLine(fd);
+/* Copy the next 'len' bytes of the stream into 'dst': first whatever is
+ * already buffered, then the rest read straight from the socket, so that
+ * large payloads are not staged in the input buffer. */
+static int redisReadPayload(redisContext *c, char *dst, size_t len) {
+    size_t avail = sdslen(c->ibuf)-c->ipos;
+
+    if (avail > len) avail = len;
+    memcpy(dst,c->ibuf+c->ipos,avail);
+    c->ipos += avail;
+    dst += avail;
+    len -= avail;
+    while (len) {
+        int chunk = min_t(size_t,len,INT_MAX);
+
+        if (kernel_sockRead(c->sock,dst,chunk) != chunk) {
+            c->err = REDIS_ERR_IO;
+            return -1;
+        }
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Drop the next 'len' bytes of the stream, going through the input
+ * buffer, which needs no allocation. */
+static int redisDiscard(redisContext *c, size_t len) {
+    size_t avail;
+
+    while (len) {
+        if (redisBufferFill(c,1) == -1) return -1;
+        avail = min(sdslen(c->ibuf)-c->ipos,len);
+        c->ipos += avail;
+        len -= avail;
+    }
+    return 0;
+}
+
+/* Consume the "\r\n" that terminates a bulk payload. */
+static int redisSkipCrlf(redisContext *c) {
+    if (redisBufferFill(c,2) == -1) return -1;
+    c->ipos += 2;
+    return 0;
+}
+
+static redisReply *redisReadBulkReply(redisContext *c) {
+    size_t len;
+    char *replylen = redisReadLine(c,&len);
     sds buf;
-    char crlf[2];
-    int bulklen;
+    long long value;
+    int bulklen, flags = 0;
 
-    if (replylen == NULL) return redisIOError();
-    bulklen = (int)simple_strtol(replylen, (char **)NULL, 10);
-    sdsfree(replylen);
+    if (replylen == NULL) return redisIOError(c);
+    if (redisParseLongLong(replylen,len,&value) == -1 ||
+        value < -1 || value > INT_MAX)
+        return redisProtocolError(c);
+    bulklen = (int)value;
     if (bulklen == -1)
-        return createReplyObject(REDIS_REPLY_NIL,sdsempty());
+        return redisStringReply(c,REDIS_REPLY_NIL,"",0);
 
-    buf = sdsnewlen(NULL,bulklen);
-    kernel_anetRead(fd,buf,bulklen);
-    kernel_anetRead(fd,crlf,2);
-    return createReplyObject(REDIS_REPLY_STRING,buf);
+    if ((buf = redisReplyString(c,NULL,bulklen,&flags)) == NULL) {
+        /* skip the value: the connection stays usable */
+        if (redisDiscard(c,bulklen) == -1 || redisSkipCrlf(c) == -1)
+            return redisIOError(c);
+        return redisOOM(c,0);
+    }
+    if (redisReadPayload(c,buf,bulklen) == -1 || redisSkipCrlf(c) == -1) {
+        redisReplyStringFree(c->acct->pool,buf,flags);
+        return redisIOError(c);
+    }
+    return createReplyObject(c,REDIS_REPLY_STRING,buf,flags);
 }
 
-static redisReply *redisReadMultiBulkReply(int fd) {
-    sds replylen = redisReadLine(fd);
+static redisReply *redisReadMultiBulkReply(redisContext *c) {
+    size_t len;
+    char *replylen = redisReadLine(c,&len);
+    long long value;
     long elements, j;
     redisReply *r;
 
-    if (replylen == NULL) return redisIOError();
-    elements = simple_strtol(replylen,NULL,10);
-    sdsfree(replylen);
+    if (replylen == NULL) return redisIOError(c);
+    if (redisParseLongLong(replylen,len,&value) == -1 ||
+        value < -1 || value > INT_MAX/(long long)sizeof(redisReply*))
+        return redisProtocolError(c);
+    elements = (long)value;
 
     if (elements == -1)
-        return createReplyObject(REDIS_REPLY_NIL,sdsempty());
-
-    if ((r = kmalloc(sizeof(*r), GFP_KERNEL)) == NULL) redisOOM();
-    r->type = REDIS_REPLY_ARRAY;
-    r->elements = elements;
-    if ((r->element = kmalloc(sizeof(*r)*elements, GFP_KERNEL)) == NULL) redisOOM();
-    for (j = 0; j < elements; j++)
-        r->element[j] = redisReadReply(fd);
+        return redisStringReply(c,REDIS_REPLY_NIL,"",0);
+
+    /* the elements can not be skipped without parsing them */
+    r = createReplyObject(c,REDIS_REPLY_ARRAY,NULL,0);
+    if (r == &redisOOMReply) return redisOOM(c,1);
+    if (elements &&
+        (r->element = redisReplyAlloc(c,sizeof(redisReply*)*elements)) == NULL) {
+        redisReplyNodeFree(c->acct->pool,r);
+        return redisOOM(c,1);
+    }
+    for (j = 0; j < elements; j++) {
+        r->element[j] = redisReadReply(c);
+        /* the rest of the array is lost with the connection */
+        if (c->err) {
+            if (r->element[j]) freeReplyObject(r->element[j]);
+            break;
+        }
+    }
+    r->elements = j;
     return r;
 }
 
-static redisReply *redisReadReply(int fd) {
+/* Parse one reply. The elements of arrays go through redisReadReply()
+ * again, which only accounts for the top level reply. */
+static redisReply *redisReadReplyNested(redisContext *c) {
     char type;
 
-    if (kernel_anetRead(fd,&type,1) <= 0) return redisIOError();
+    if (c->err) return redisIOError(c);
+    if (redisBufferFill(c,1) == -1) return redisIOError(c);
+    type = c->ibuf[c->ipos++];
     switch(type) {
         case '-':
-            return redisReadSingleLineReply(fd,REDIS_REPLY_ERROR);
+            return redisReadSingleLineReply(c,REDIS_REPLY_ERROR);
         case '+':
-            return redisReadSingleLineReply(fd,REDIS_REPLY_STRING);
+            return redisReadSingleLineReply(c,REDIS_REPLY_STRING);
         case ':':
-            return redisReadIntegerReply(fd);
+            return redisReadIntegerReply(c);
         case '$':
-            return redisReadBulkReply(fd);
+            return redisReadBulkReply(c);
         case '*':
-            return redisReadMultiBulkReply(fd);
+            return redisReadMultiBulkReply(c);
         default:
             printk(KERN_ERR "protocol error, got '%c' as reply type byte\n", type);
+            c->err = REDIS_ERR_PROTOCOL;
             return NULL;
     }
 }
 
+/* Read the next reply from the connection, without sending anything. This
+ * is what redisCommand() does after writing the request, and can be used
+ * on its own for replies the server pushes (e.g. Pub/Sub messages).
+ *
+ * Once c->err is set the connection is out of sync with the server and an
+ * error reply is returned right away: check c->err to tell a failed
+ * connection from an error reply sent by the server.
+ *
+ * If memory runs out, or the reply would exceed the budget of the
+ * context, the out of memory reply is returned (see redisIsOOMReply()).
+ * When the rest of the reply can not be skipped c->err is set as well. */
+redisReply *redisReadReply(redisContext *c) {
+    redisReply *r;
+
+    if (c->depth++ == 0) c->charged = 0;
+    r = redisReadReplyNested(c);
+    if (--c->depth == 0) {
+        if (r == NULL || r == &redisOOMReply) {
+            /* whatever was allocated for it is freed already */
+            atomic_long_sub(c->charged,&c->acct->used);
+        } else {
+            /* the whole tree is given back when the top reply is freed */
+            r->flags |= REDIS_REPLY_F_TOP;
+            r->mem = c->charged;
+            atomic_inc(&c->acct->refs);
+        }
+    }
+    return r;
+}
+
 /* Helper function for redisCommand(). It's used to append the next argument
- * to the argument vector. */
-static void addArgument(sds a, char ***argv, int *argc) {
-    (*argc)++;
-    if ((*argv = krealloc(*argv, sizeof(char*)*(*argc), GFP_KERNEL)) == NULL) 
-        redisOOM();
-    (*argv)[(*argc)-1] = a;
+ * to the argument vector. Returns -1 (and frees 'a') if out of memory. */
+static int addArgument(sds a, char ***argv, int *argc, gfp_t gfp) {
+    char **v = krealloc(*argv, sizeof(char*)*(*argc+1), gfp);
+
+    if (v == NULL) {
+        sdsfree(a);
+        return -1;
+    }
+    *argv = v;
+    (*argv)[(*argc)++] = a;
+    return 0;
+}
+
+/* Append 'len' bytes to 's', allocating with 'gfp'. On failure 's' is
+ * freed and NULL returned, and so is NULL passed in: a string can be built
+ * with a chain of calls and checked once at the end. */
+static sds redisCatLen(sds s, const void *t, size_t len, gfp_t gfp) {
+    sds n;
+
+    if (s == NULL) return NULL;
+    if ((n = sdsMakeRoomForGfp(s,len,gfp)) == NULL) {
+        sdsfree(s);
+        return NULL;
+    }
+    return sdscatlen(n,t,len);
+}
+
+/* Length of a "<type><len>\r\n" protocol header. */
+static size_t redisHeaderLen(size_t len) {
+    size_t digits = 1;
+
+    while (len >= 10) {
+        len /= 10;
+        digits++;
+    }
+    return 1+digits+2;
+}
+
+/* Write the "<type><len>\r\n" header of 'len' to 'buf', which has room
+ * for REDIS_HEADER_MAX bytes, and return its length: for encoders that do
+ * not build an sds, such as redischain.c. */
+size_t redisFormatHeader(char *buf, char type, size_t len) {
+    size_t n = redisHeaderLen(len), j = n-2;
+
+    buf[0] = type;
+    do {
+        buf[--j] = '0'+len%10;
+        len /= 10;
+    } while (len);
+    buf[n-2] = '\r';
+    buf[n-1] = '\n';
+    return n;
+}
+
+/* Append a "<type><len>\r\n" protocol header (e.g. "*3\r\n" or "$5\r\n")
+ * to 'cmd' without going through the printf machinery. Like the other
+ * redisCat* helpers it returns NULL, having freed 'cmd', if out of memory,
+ * and passes NULL through. */
+static sds redisCatHeader(sds cmd, char type, long long len, gfp_t gfp) {
+    sds n;
+
+    if (cmd == NULL) return NULL;
+    /* room for the lot, so that the appends below do not allocate */
+    n = sdsMakeRoomForGfp(cmd,len < 0 ? 1+SDS_LLSTR_SIZE+2 :
+            redisHeaderLen(len),gfp);
+    if (n == NULL) {
+        sdsfree(cmd);
+        return NULL;
+    }
+    n = sdscatlen(n,&type,1);
+    n = sdscatlonglong(n,len);
+    return sdscatlen(n,"\r\n",2);
+}
+
+/* Append a single bulk argument ("$<len>\r\n<arg>\r\n") to 'cmd'. */
+static sds redisCatArgument(sds cmd, const char *arg, size_t len, gfp_t gfp) {
+    cmd = redisCatHeader(cmd,'$',len,gfp);
+    cmd = redisCatLen(cmd,arg,len,gfp);
+    return redisCatLen(cmd,"\r\n",2,gfp);
+}
+
+/* Append a command given as an argument vector to 'cmd'. When 'argvlen'
+ * is NULL the arguments are taken to be nul terminated strings. Returns
+ * NULL (and frees 'cmd') if out of memory. */
+sds redisCatCommandArgv(sds cmd, int argc, const char **argv,
+        const size_t *argvlen, gfp_t gfp) {
+    size_t size, len;
+    sds n;
+    int j;
+
+    if (cmd == NULL) return NULL;
+    size = redisHeaderLen(argc);
+    for (j = 0; j < argc; j++) {
+        len = argvlen ? argvlen[j] : strlen(argv[j]);
+        size += redisHeaderLen(len)+len+2;
+    }
+    if ((n = sdsMakeRoomForGfp(cmd,size,gfp)) == NULL) {
+        sdsfree(cmd);
+        return NULL;
+    }
+    cmd = redisCatHeader(n,'*',argc,gfp);
+    for (j = 0; j < argc; j++)
+        cmd = redisCatArgument(cmd,argv[j],
+                argvlen ? argvlen[j] : strlen(argv[j]),gfp);
+    return cmd;
+}
+
+/* Append 'r' to 's' in the protocol, to pass a reply on. Status replies
+ * are not told apart from bulk strings once read, so every string is
+ * written as a bulk string. Returns NULL if out of memory, like the other
+ * redisCat* helpers. */
+sds redisCatReply(sds s, const redisReply *r, gfp_t gfp) {
+    size_t j;
+
+    switch (r->type) {
+    case REDIS_REPLY_ERROR:
+        s = redisCatLen(s,"-",1,gfp);
+        s = redisCatLen(s,r->reply,sdslen(r->reply),gfp);
+        return redisCatLen(s,"\r\n",2,gfp);
+    case REDIS_REPLY_STRING:
+        return redisCatArgument(s,r->reply,sdslen(r->reply),gfp);
+    case REDIS_REPLY_INTEGER:
+        return redisCatHeader(s,':',r->integer,gfp);
+    case REDIS_REPLY_NIL:
+        return redisCatHeader(s,'$',-1,gfp);
+    case REDIS_REPLY_ARRAY:
+        s = redisCatHeader(s,'*',r->elements,gfp);
+        for (j = 0; j < r->elements && s; j++)
+            s = redisCatReply(s,r->element[j],gfp);
+        return s;
+    }
+    return s;
+}
+
+/* Take the command buffer kept by 'c', emptied, or a new one. */
+static sds redisTakeObuf(redisContext *c) {
+    sds cmd = c->obuf;
+
+    if (cmd == NULL) {
+        cmd = sdsnewlenGfp("",0,c->gfp|__GFP_NOWARN);
+        if (cmd) c->allocs++;
+        return cmd;
+    }
+    c->obuf = NULL;
+    sdsclear(cmd);
+    return cmd;
+}
+
+/* Keep 'cmd' for the next command, unless it grew large. */
+static void redisGiveObuf(redisContext *c, sds cmd) {
+    if (sdsAllocSize(cmd) > REDIS_OBUF_KEEP) sdsfree(cmd);
+    else c->obuf = cmd;
+}
+
+/* Encode a command into the command buffer of 'c'. Returns NULL if out of
+ * memory. */
+static sds redisBuildCommandArgv(redisContext *c, int argc, const char **argv,
+        const size_t *argvlen) {
+    sds cmd = redisTakeObuf(c);
+    size_t cap;
+
+    if (cmd == NULL) return NULL;
+    cap = sdsAllocSize(cmd);
+    cmd = redisCatCommandArgv(cmd,argc,argv,argvlen,c->gfp|__GFP_NOWARN);
+    /* it is grown at most once, to the exact size */
+    if (cmd && sdsAllocSize(cmd) != cap) c->allocs++;
+    return cmd;
+}
+
+/* Write the 'len' bytes at 'buf' to the socket. Returns 0 on success and
+ * -1 if the connection failed before everything was written. */
+static int redisWrite(redisContext *c, const char *buf, size_t len) {
+    int cork = c->cork && len >= (size_t)c->cork;
+    int rc = 0;
+
+    if (c->err) return -1;
+    if (cork) redisCork(c,1);
+    while (len) {
+        int chunk = min_t(size_t,len,INT_MAX);
+
+        if (kernel_sockWrite(c->sock,(char*)buf,chunk) != chunk) {
+            c->err = REDIS_ERR_IO;
+            rc = -1;
+            break;
+        }
+        buf += chunk;
+        len -= chunk;
+    }
+    if (cork) redisCork(c,0);
+    return rc;
+}
+
+static int redisWriteCommand(redisContext *c, sds cmd) {
+    return redisWrite(c,cmd,sdslen(cmd));
+}
+
+/* Send commands already encoded in the protocol by the caller, who must
+ * then read one reply per command. The bytes are sent as they are, so
+ * they must hold whole, well formed commands. */
+int redisSendFormatted(redisContext *c, const char *buf, size_t len) {
+    return redisWrite(c,buf,len);
+}
+
+/* Copy the NULL terminated list of command names 'names'. Returns NULL if
+ * out of memory. */
+sds *redisCommandListCreate(const char * const *names) {
+    sds *list;
+    int n, j;
+
+    for (n = 0; names[n]; n++);
+    list = kzalloc(sizeof(sds)*(n+1), GFP_KERNEL);
+    if (list == NULL) return NULL;
+    for (j = 0; j < n; j++) {
+        if ((list[j] = sdsnew(names[j])) == NULL) {
+            redisCommandListFree(list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+void redisCommandListFree(sds *list) {
+    sds *name;
+
+    if (list == NULL) return;
+    for (name = list; *name; name++) sdsfree(*name);
+    kfree(list);
+}
+
+/* Is the command encoded in 'cmd' named in 'list' (regardless of case)?
+ * Commands are always sent as multibulk, so the name is the first bulk. */
+int redisCommandInList(const char *cmd, size_t len, sds *list) {
+    const char *p = cmd, *end = cmd+len, *name;
+    size_t namelen = 0;
+
+    if (len < 4 || *p != '*' || (p = memchr(p,'\n',len)) == NULL)
+        return 0;
+    if (++p >= end || *p != '$') return 0;
+    while (++p < end && *p >= '0' && *p <= '9')
+        namelen = namelen*10+(*p-'0');
+    name = p+2;
+    if (name > end || namelen > (size_t)(end-name)) return 0;
+    for (; *list; list++)
+        if (sdslen(*list) == namelen && !strncasecmp(*list,name,namelen))
+            return 1;
+    return 0;
+}
+
+/* Send 'cmd', the command buffer of 'c', and read the reply, unless the
+ * cache of 'c' has it or another context is sending the same command. */
+static redisReply *redisRoundTrip(redisContext *c, sds cmd) {
+    redisFlightCall *call = NULL;
+    redisReply *r;
+
+    if (c->cache &&
+        (r = redisCacheLookup(c->cache,cmd,sdslen(cmd))) != NULL)
+        goto done;
+    if (c->flight && (r = redisFlightJoin(c->flight,cmd,sdslen(cmd),
+                                          c->gfp|__GFP_NOWARN,&call)))
+        goto done;
+    if (redisWriteCommand(c,cmd) == -1) {
+        r = redisIOError(c);
+    } else {
+        r = redisReadReply(c);
+        if (c->cache)
+            redisCacheStore(c->cache,cmd,sdslen(cmd),r,c->gfp|__GFP_NOWARN);
+    }
+    if (call)
+        redisFlightDone(c->flight,call,c->err ? NULL : r,c->gfp|__GFP_NOWARN);
+done:
+    redisGiveObuf(c,cmd);
+    return r;
 }
 
 /* Execute a command. This function is printf alike:
@@ -223,8 +1256,8 @@ static void addArgument(sds a, char ***argv, int *argc) {
  * When using %b you need to provide both the pointer to the string
  * and the length in bytes. Examples:
  *
- * redisCommand("GET %s", mykey);
- * redisCommand("SET %s %b", mykey, somevalue, somevalue_len);
+ * redisCommand(c, "GET %s", mykey);
+ * redisCommand(c, "SET %s %b", mykey, somevalue, somevalue_len);
  *
  * RETURN VALUE:
  *
@@ -248,68 +1281,738 @@ static void addArgument(sds a, char ***argv, int *argc) {
  * Finally when type is REDIS_REPLY_INTEGER the long long integer is
  * stored at reply->integer.
  */
-redisReply *redisCommand(int fd, const char *format, ...) {
+redisReply *redisCommand(redisContext *c, const char *format, ...) {
     va_list ap;
     size_t size;
-    const char *arg, *c = format;
-    sds cmd = sdsempty();     /* whole command buffer */
-    sds curr_arg = sdsempty(); /* current argument */
+    const char *arg, *f = format;
+    sds cmd;                   /* whole command buffer */
+    sds curr_arg;              /* current argument */
     char **argv = NULL;
     int argc = 0, j;
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
 
     /* Build the command string accordingly to protocol */
+    curr_arg = sdsnewlenGfp("",0,gfp);
     va_start(ap,format);
-    while(*c != '\0') {
-        if (*c != '%' || c[1] == '\0') {
-            if (*c == ' ') {
+    while(*f != '\0' && curr_arg != NULL) {
+        if (*f != '%' || f[1] == '\0') {
+            if (*f == ' ') {
                 if (sdslen(curr_arg) != 0) {
-                    addArgument(curr_arg, &argv, &argc);
-                    curr_arg = sdsempty();
+                    if (addArgument(curr_arg,&argv,&argc,gfp) == -1)
+                        curr_arg = NULL;
+                    else
+                        curr_arg = sdsnewlenGfp("",0,gfp);
                 }
             } else {
-                curr_arg = sdscatlen(curr_arg,c,1);
+                curr_arg = redisCatLen(curr_arg,f,1,gfp);
             }
         } else {
-            switch(c[1]) {
+            switch(f[1]) {
                 case 's':
                     arg = va_arg(ap,char*);
-                    curr_arg = sdscat(curr_arg,arg);
+                    curr_arg = redisCatLen(curr_arg,arg,strlen(arg),gfp);
                     break;
                 case 'b':
                     arg = va_arg(ap,char*);
                     size = va_arg(ap,size_t);
-                    curr_arg = sdscatlen(curr_arg,arg,size);
+                    curr_arg = redisCatLen(curr_arg,arg,size,gfp);
                     break;
                 case '%':
-                    cmd = sdscat(cmd,"%");
+                    curr_arg = redisCatLen(curr_arg,"%",1,gfp);
                     break;
             }
-            c++;
+            f++;
         }
-        c++;
+        f++;
     }
     va_end(ap);
 
     /* Add the last argument if needed */
-    if (sdslen(curr_arg) != 0)
-        addArgument(curr_arg, &argv, &argc);
-    else
+    if (curr_arg == NULL) {
+        cmd = NULL;
+        goto done;
+    }
+    if (sdslen(curr_arg) != 0) {
+        if (addArgument(curr_arg,&argv,&argc,gfp) == -1) {
+            cmd = NULL;
+            goto done;
+        }
+    } else {
         sdsfree(curr_arg);
+    }
 
-    /* Build the command at protocol level */
-    cmd = sdscatprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        cmd = sdscatprintf(cmd,"$%zu\r\n",sdslen(argv[j]));
-        cmd = sdscatlen(cmd,argv[j],sdslen(argv[j]));
-        cmd = sdscatlen(cmd,"\r\n",2);
-        sdsfree(argv[j]);
+    /* Build the command at protocol level. The exact size is known in
+     * advance, so grow the buffer once instead of once per argument. */
+    size = redisHeaderLen(argc);
+    for (j = 0; j < argc; j++)
+        size += redisHeaderLen(sdslen(argv[j]))+sdslen(argv[j])+2;
+    if ((cmd = redisTakeObuf(c)) != NULL) {
+        size_t cap = sdsAllocSize(cmd);
+        sds n = sdsMakeRoomForGfp(cmd,size,gfp);
+
+        if (n == NULL) sdsfree(cmd);
+        else if (sdsAllocSize(n) != cap) c->allocs++;
+        cmd = n;
     }
+    cmd = redisCatHeader(cmd,'*',argc,gfp);
+    for (j = 0; j < argc; j++)
+        cmd = redisCatArgument(cmd,argv[j],sdslen(argv[j]),gfp);
+
+done:
+    for (j = 0; j < argc; j++)
+        sdsfree(argv[j]);
     kfree(argv);
+    if (cmd == NULL) return redisOOM(c,0);
 
     /* Send the command via socket */
-    kernel_anetWrite(fd,cmd,sdslen(cmd));
+    return redisRoundTrip(c,cmd);
+}
+
+/* Execute a command given as an argument vector. This is the binary safe
+ * counterpart of redisCommand() for when the number of arguments is not
+ * known in advance. 'argvlen' holds the length of every argument, or is
+ * NULL when they are all nul terminated strings. */
+redisReply *redisCommandArgv(redisContext *c, int argc, const char **argv,
+        const size_t *argvlen) {
+    sds cmd = redisBuildCommandArgv(c,argc,argv,argvlen);
+
+    if (cmd == NULL) return redisOOM(c,0);
+    return redisRoundTrip(c,cmd);
+}
+
+/* Send a command given as an argument vector without waiting for its
+ * reply, which is left for redisReadReply(). Returns 0 on success and -1
+ * if the connection failed. */
+int redisSendCommandArgv(redisContext *c, int argc, const char **argv,
+        const size_t *argvlen) {
+    sds cmd = redisBuildCommandArgv(c,argc,argv,argvlen);
+    int err;
+
+    if (cmd == NULL) {
+        redisOOM(c,0);
+        return -1;
+    }
+    err = redisWriteCommand(c,cmd);
+    redisGiveObuf(c,cmd);
+    return err;
+}
+
+/* Send the commands of 'h' (HELLO, or AUTH and CLIENT SETNAME, then
+ * SELECT) in a single write, and check all the replies once they are
+ * back: setting up a connection costs one round trip whatever it needs.
+ * Returns NULL on success, or the first error reply (which must be freed
+ * with freeReplyObject()). */
+redisReply *redisRunHandshake(redisContext *c, const redisHandshake *h) {
+    const char *argv[7];
+    char db[16];
+    redisReply *r, *err = NULL;
+    sds cmd;
+    int argc, n = 0;
+
+    if (h->protocol && h->protocol != 2)
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdsnew("Only RESP2 (HELLO 2) is supported"),0);
+    if ((cmd = redisTakeObuf(c)) == NULL) return redisOOM(NULL,0);
+
+    if (h->protocol) {
+        argc = 0;
+        argv[argc++] = "HELLO";
+        argv[argc++] = "2";
+        if (h->password) {
+            argv[argc++] = "AUTH";
+            argv[argc++] = h->username ? h->username : "default";
+            argv[argc++] = h->password;
+        }
+        if (h->name) {
+            argv[argc++] = "SETNAME";
+            argv[argc++] = h->name;
+        }
+        cmd = redisCatCommandArgv(cmd,argc,argv,NULL,c->gfp|__GFP_NOWARN);
+        n++;
+    } else {
+        if (h->password) {
+            argc = 0;
+            argv[argc++] = "AUTH";
+            if (h->username) argv[argc++] = h->username;
+            argv[argc++] = h->password;
+            cmd = redisCatCommandArgv(cmd,argc,argv,NULL,
+                    c->gfp|__GFP_NOWARN);
+            n++;
+        }
+        if (h->name) {
+            argv[0] = "CLIENT";
+            argv[1] = "SETNAME";
+            argv[2] = h->name;
+            cmd = redisCatCommandArgv(cmd,3,argv,NULL,c->gfp|__GFP_NOWARN);
+            n++;
+        }
+    }
+    if (h->db) {
+        snprintf(db,sizeof(db),"%d",h->db);
+        argv[0] = "SELECT";
+        argv[1] = db;
+        cmd = redisCatCommandArgv(cmd,2,argv,NULL,c->gfp|__GFP_NOWARN);
+        n++;
+    }
+    if (cmd == NULL) return redisOOM(NULL,0);
+    if (n && redisWriteCommand(c,cmd) == -1) n = 0;
+    redisGiveObuf(c,cmd);
+    if (c->err)
+        return createReplyObject(NULL,REDIS_REPLY_ERROR,
+                sdsnew("Connection lost during the handshake"),0);
+
+    while (n--) {
+        if ((r = redisReadReply(c)) == NULL)
+            return err ? err : createReplyObject(NULL,REDIS_REPLY_ERROR,
+                    sdsnew("Connection lost during the handshake"),0);
+        if (r->type == REDIS_REPLY_ERROR && err == NULL) err = r;
+        else freeReplyObject(r);
+    }
+    return err;
+}
+
+/* redisConnect() followed by redisRunHandshake(). The context is only
+ * set if both succeed. */
+redisReply *redisConnectHandshake(redisContext **c, const char *addr,
+        int port, const redisHandshake *h) {
+    redisReply *r;
+
+    if ((r = redisConnect(c,addr,port)) != NULL) return r;
+    if ((r = redisRunHandshake(*c,h)) != NULL) {
+        redisFree(*c);
+        *c = NULL;
+    }
+    return r;
+}
+
+static size_t batchKeyLen(const char **keys, const size_t *keylens, int j) {
+    return keylens ? keylens[j] : strlen(keys[j]);
+}
+
+/* Number of keys, starting at 'first', that go in the next MGET/MSET so
+ * that it stays within REDIS_BATCH_MAX_ARGS arguments and, unless a single
+ * key/value pair is larger by itself, REDIS_BATCH_MAX_BYTES of payload. */
+static int redisBatchChunkLen(int first, int count, const char **keys,
+        const size_t *keylens, const size_t *vallens) {
+    int n = 0, args = 1, per = vallens ? 2 : 1;
+    size_t bytes = 0, len;
+
+    while (first+n < count) {
+        len = batchKeyLen(keys,keylens,first+n);
+        if (vallens) len += vallens[first+n];
+        if (n > 0 && (args+per > REDIS_BATCH_MAX_ARGS ||
+                      bytes+len > REDIS_BATCH_MAX_BYTES))
+            break;
+        args += per;
+        bytes += len;
+        n++;
+    }
+    return n;
+}
+
+/* Store the reply to a GET of a single key into 'res'. */
+static void redisBatchStoreValue(redisBatchResult *res, redisReply *r) {
+    switch(r->type) {
+        case REDIS_REPLY_STRING:
+            res->len = sdslen(r->reply);
+            memcpy(res->buf,r->reply,min(res->len,res->buflen));
+            res->status = (res->len > res->buflen) ?
+                REDIS_BATCH_TRUNC : REDIS_BATCH_OK;
+            break;
+        case REDIS_REPLY_NIL:
+            res->len = 0;
+            res->status = REDIS_BATCH_NIL;
+            break;
+        default:
+            res->len = 0;
+            res->status = REDIS_BATCH_ERR;
+            break;
+    }
+}
+
+/* Status of the keys left to redisBatchPipeline() */
+#define REDIS_BATCH_PENDING (-1)
+
+/* Send a GET (vals == NULL) or SET for each key of status
+ * REDIS_BATCH_PENDING, in writes of about REDIS_BATCH_MAX_BYTES, then read
+ * their replies: each key gets its own status. */
+static int redisBatchPipeline(redisContext *c, int count, const char **keys,
+        const size_t *keylens, const char **vals, const size_t *vallens,
+        redisBatchResult *res) {
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
+    sds cmd = sdsnewlenGfp("",0,gfp);
+    int j, sent = 0, err = 0;
+    redisReply *r;
+
+    for (j = 0; j < count && cmd; j++) {
+        if (res[j].status == REDIS_BATCH_PENDING) {
+            cmd = redisCatHeader(cmd,'*',vals ? 3 : 2,gfp);
+            cmd = vals ? redisCatArgument(cmd,"SET",3,gfp) :
+                         redisCatArgument(cmd,"GET",3,gfp);
+            cmd = redisCatArgument(cmd,keys[j],batchKeyLen(keys,keylens,j),
+                    gfp);
+            if (vals) cmd = redisCatArgument(cmd,vals[j],vallens[j],gfp);
+        }
+        if (cmd && (j == count-1 || sdslen(cmd) >= REDIS_BATCH_MAX_BYTES)) {
+            if (redisWriteCommand(c,cmd) == -1) break;
+            sdsclear(cmd);
+            /* the keys up to here were sent */
+            sent = j+1;
+        }
+    }
+    if (cmd == NULL) redisOOM(c,0);
+    if (sent < count) err = -1;
+    sdsfree(cmd);
+
+    for (j = 0; j < count; j++) {
+        if (res[j].status != REDIS_BATCH_PENDING) continue;
+        r = j < sent && !c->err ? redisReadReply(c) : NULL;
+        if (r && c->err) {
+            freeReplyObject(r);
+            r = NULL;
+        }
+        if (r == NULL) {
+            res[j].status = REDIS_BATCH_ERR;
+            err = -1;
+        } else if (vals) {
+            res[j].status = (r->type == REDIS_REPLY_STRING) ?
+                REDIS_BATCH_OK : REDIS_BATCH_ERR;
+        } else {
+            redisBatchStoreValue(&res[j],r);
+        }
+        if (r) freeReplyObject(r);
+    }
+    return err;
+}
+
+/* Common implementation of redisGetBatch() and redisSetBatch(). The keys
+ * are split in MGET (vals == NULL) or MSET commands by
+ * redisBatchChunkLen(); all the chunks are written back to back before the
+ * first reply is read, so the whole batch costs a single round trip. In
+ * pipeline mode, and for the keys of the commands refused in auto mode,
+ * redisBatchPipeline() sends one GET or SET per key instead. */
+static int redisBatch(redisContext *c, int count, const char **keys,
+        const size_t *keylens, const char **vals, const size_t *vallens,
+        redisBatchResult *res) {
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
+    int automode = c->batchmode == REDIS_BATCH_MODE_AUTO;
+    int first, n, j, err = 0, refused = 0;
+    redisReply *r;
+    sds cmd;
+
+    if (c->batchmode == REDIS_BATCH_MODE_PIPELINE ||
+        (automode && c->batchpipe)) {
+        for (j = 0; j < count; j++) res[j].status = REDIS_BATCH_PENDING;
+        return redisBatchPipeline(c,count,keys,keylens,vals,vallens,res);
+    }
+
+    cmd = sdsnewlenGfp("",0,gfp);
+    for (first = 0; first < count; first += n) {
+        n = redisBatchChunkLen(first,count,keys,keylens,vallens);
+        if (cmd == NULL) {
+            redisOOM(c,0);
+            err = -1;
+            break;
+        }
+        sdsclear(cmd);
+        cmd = redisCatHeader(cmd,'*',1+n*(vals ? 2 : 1),gfp);
+        cmd = vals ? redisCatArgument(cmd,"MSET",4,gfp) :
+                     redisCatArgument(cmd,"MGET",4,gfp);
+        for (j = first; j < first+n; j++) {
+            cmd = redisCatArgument(cmd,keys[j],batchKeyLen(keys,keylens,j),
+                    gfp);
+            if (vals) cmd = redisCatArgument(cmd,vals[j],vallens[j],gfp);
+        }
+        if (cmd == NULL) {
+            redisOOM(c,0);
+            err = -1;
+            break;
+        }
+        if (redisWriteCommand(c,cmd) == -1) {
+            err = -1;
+            break;
+        }
+    }
+    sdsfree(cmd);
+    /* keys that were never sent */
+    for (j = first; j < count; j++)
+        res[j].status = REDIS_BATCH_ERR;
+
+    /* one reply per chunk that went out */
+    count = first;
+    for (first = 0; first < count; first += n) {
+        n = redisBatchChunkLen(first,count,keys,keylens,vallens);
+        /* after running out of memory the chunks sent are still read */
+        r = c->err ? NULL : redisReadReply(c);
+        if (r && c->err) {
+            /* an I/O error reply: the connection is gone */
+            freeReplyObject(r);
+            r = NULL;
+        }
+        for (j = first; j < first+n; j++) {
+            if (r == NULL) {
+                res[j].status = REDIS_BATCH_ERR;
+            } else if (automode && r->type == REDIS_REPLY_ERROR) {
+                /* e.g. CROSSSLOT: resent one key at a time below */
+                res[j].status = REDIS_BATCH_PENDING;
+                refused = 1;
+            } else if (vals) {
+                res[j].status = (r->type == REDIS_REPLY_STRING) ?
+                    REDIS_BATCH_OK : REDIS_BATCH_ERR;
+            } else if (r->type == REDIS_REPLY_ARRAY &&
+                       r->elements == (size_t)n) {
+                redisBatchStoreValue(&res[j],r->element[j-first]);
+            } else {
+                res[j].status = REDIS_BATCH_ERR;
+            }
+        }
+        /* the remaining replies can not be read either */
+        if (r == NULL) err = -1;
+        else freeReplyObject(r);
+    }
+    if (refused) {
+        c->batchpipe = 1;
+        if (redisBatchPipeline(c,count,keys,keylens,vals,vallens,res) == -1)
+            err = -1;
+    }
+    return err;
+}
+
+/* Fetch 'count' keys with as few round trips as possible. keys[j] (of
+ * length keylens[j], or nul terminated if 'keylens' is NULL) is looked up
+ * and its value copied into res[j].buf, which holds res[j].buflen bytes.
+ * res[j].len is set to the full length of the value and res[j].status to
+ * one of the REDIS_BATCH_* codes; a value that does not fit is truncated.
+ *
+ * The keys are sent as MGET commands of at most REDIS_BATCH_MAX_ARGS keys
+ * and REDIS_BATCH_MAX_BYTES bytes each, all pipelined in one go, or as a
+ * pipeline of GETs: see redisSetBatchMode().
+ *
+ * Returns 0 on success, or -1 if the connection failed or memory ran out,
+ * in which case the keys that could not be served have status
+ * REDIS_BATCH_ERR. */
+int redisGetBatch(redisContext *c, int count, const char **keys,
+        const size_t *keylens, redisBatchResult *res) {
+    return redisBatch(c,count,keys,keylens,NULL,NULL,res);
+}
+
+/* Set 'count' keys to the given values (vals[j] of length vallens[j]).
+ * This works like redisGetBatch() but sends MSET commands; res[j].status
+ * tells whether each key was set. The buf field of 'res' is not used. */
+int redisSetBatch(redisContext *c, int count, const char **keys,
+        const size_t *keylens, const char **vals, const size_t *vallens,
+        redisBatchResult *res) {
+    return redisBatch(c,count,keys,keylens,vals,vallens,res);
+}
+
+
+
+/* Create an empty transaction. Commands are queued with
+ * redisTransactionAppend() and sent with redisTransactionExec(). The
+ * transaction allocates with 'gfp', normally that of the context it is
+ * meant for (see redisSetAllocFlags()). */
+redisTransaction *redisTransactionCreate(gfp_t gfp) {
+    redisTransaction *t = kmalloc(sizeof(*t), gfp);
+
+    if (t == NULL) return NULL;
+    t->cmd = NULL;
+    t->gfp = gfp;
+    redisTransactionReset(t);
+    if (t->cmd == NULL) {
+        kfree(t);
+        return NULL;
+    }
+    return t;
+}
+
+void redisTransactionFree(redisTransaction *t) {
+    sdsfree(t->cmd);
+    kfree(t);
+}
+
+/* Drop the queued commands, so that 't' can be reused. */
+void redisTransactionReset(redisTransaction *t) {
+    if (t->cmd) sdsclear(t->cmd);
+    else t->cmd = sdsnewlenGfp("",0,t->gfp);
+    t->cmd = redisCatHeader(t->cmd,'*',1,t->gfp);
+    t->cmd = redisCatArgument(t->cmd,"MULTI",5,t->gfp);
+    t->count = 0;
+}
+
+/* Queue a command given as an argument vector (see redisCommandArgv()).
+ * Nothing is sent until redisTransactionExec(). Returns 0 on success and
+ * -1 if out of memory, after which the transaction can only be reset. */
+int redisTransactionAppend(redisTransaction *t, int argc, const char **argv,
+        const size_t *argvlen) {
+    t->cmd = redisCatCommandArgv(t->cmd,argc,argv,argvlen,t->gfp);
+    t->count++;
+    return t->cmd ? 0 : -1;
+}
+
+/* Send MULTI, the queued commands and EXEC in a single write and read the
+ * replies, so that the whole transaction costs one round trip. The +OK of
+ * MULTI and the +QUEUED of every command are consumed here; what is
+ * returned is the reply to EXEC:
+ *
+ * - an array with the reply of every queued command, in order;
+ * - a nil reply if a watched key was modified and nothing was executed;
+ * - an error reply if a command could not be queued (the first such
+ *   error) or the connection failed (c->err is set).
+ *
+ * The transaction is left as it was, so it can be sent again. */
+redisReply *redisTransactionExec(redisContext *c, redisTransaction *t) {
+    static const char exec[] = "*1\r\n$4\r\nEXEC\r\n";
+    redisReply *r, *err = NULL;
+    size_t len;
+    sds cmd;
+    int j;
+
+    if (t->cmd == NULL) return redisOOM(c,0);
+    /* append EXEC for this write only */
+    len = sdslen(t->cmd);
+    cmd = sdsMakeRoomForGfp(t->cmd,sizeof(exec)-1,c->gfp|__GFP_NOWARN);
+    if (cmd == NULL) return redisOOM(c,0);
+    t->cmd = sdscatlen(cmd,exec,sizeof(exec)-1);
+    j = redisWriteCommand(c,t->cmd);
+    sdsrange(t->cmd,0,len-1);
+    if (j == -1) return redisIOError(c);
+
+    /* +OK, then one +QUEUED per command */
+    for (j = 0; j <= t->count; j++) {
+        r = redisReadReply(c);
+        if (c->err) {
+            if (r) freeReplyObject(r);
+            if (err) freeReplyObject(err);
+            return redisIOError(c);
+        }
+        if (r->type == REDIS_REPLY_ERROR && err == NULL) err = r;
+        else freeReplyObject(r);
+    }
+    r = redisReadReply(c);
+    if (c->err) {
+        if (r) freeReplyObject(r);
+        r = redisIOError(c);
+    }
+    if (err && c->err) {
+        freeReplyObject(err);
+    } else if (err) {
+        freeReplyObject(r);
+        r = err;
+    }
+    return r;
+}
+
+/* Run a transaction over the keys in 'keys' (of lengths 'keylens', or nul
+ * terminated if NULL) with optimistic locking. The keys are WATCHed, then
+ * 'fn' is called to queue the commands, possibly after reading the keys,
+ * and the transaction is executed. If a watched key was modified in the
+ * meantime EXEC replies nil and the whole thing is tried again, up to
+ * 'tries' times.
+ *
+ * Returns the reply to EXEC as redisTransactionExec() does (a nil reply
+ * if every try failed, the out of memory reply if the transaction could not
+ * be built), or NULL if 'fn' aborted. */
+redisReply *redisTransactionRun(redisContext *c, int nkeys, const char **keys,
+        const size_t *keylens, redisTransactionFn *fn, void *privdata,
+        int tries) {
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
+    redisTransaction *t;
+    redisReply *r = NULL;
+    sds cmd;
+    int j;
+
+    if ((t = redisTransactionCreate(gfp)) == NULL) return redisOOM(c,0);
+    cmd = redisCatHeader(sdsnewlenGfp("",0,gfp),'*',1+nkeys,gfp);
+    cmd = redisCatArgument(cmd,"WATCH",5,gfp);
+    for (j = 0; j < nkeys; j++)
+        cmd = redisCatArgument(cmd,keys[j],batchKeyLen(keys,keylens,j),gfp);
+    if (cmd == NULL) {
+        redisTransactionFree(t);
+        return redisOOM(c,0);
+    }
+
+    while (tries-- > 0) {
+        if (redisWriteCommand(c,cmd) == -1) {
+            r = redisIOError(c);
+            break;
+        }
+        r = redisReadReply(c);
+        if (c->err || r->type == REDIS_REPLY_ERROR) break;
+        freeReplyObject(r);
+
+        redisTransactionReset(t);
+        if (t->cmd == NULL || fn(c,t,privdata) != 0) {
+            r = redisCommand(c,"UNWATCH");
+            if (r) freeReplyObject(r);
+            r = t->cmd ? NULL : redisOOM(c,0);
+            break;
+        }
+        /* EXEC unwatches the keys, whatever its outcome */
+        r = redisTransactionExec(c,t);
+        if (r == NULL || r->type != REDIS_REPLY_NIL) break;
+        if (tries > 0) freeReplyObject(r);
+    }
     sdsfree(cmd);
-    return redisReadReply(fd);
+    redisTransactionFree(t);
+    return r;
 }
 
+/* Page sized buffer of the stream functions, charged to 'c' */
+static char *redisPageAlloc(redisContext *c) {
+    char *page;
 
+    if (redisCharge(c,REDIS_STREAM_CHUNK) == -1) return NULL;
+    if ((page = kmalloc(REDIS_STREAM_CHUNK, c->gfp|__GFP_NOWARN)) == NULL)
+        atomic_long_sub(REDIS_STREAM_CHUNK,&c->acct->used);
+    else
+        c->allocs++;
+    return page;
+}
+
+static void redisPageFree(redisContext *c, char *page) {
+    kfree(page);
+    atomic_long_sub(REDIS_STREAM_CHUNK,&c->acct->used);
+}
+
+/* Discard the next 'len' bytes of the stream. */
+static int redisSkipPayload(redisContext *c, char *page, long long len) {
+    while (len > 0) {
+        size_t chunk = min_t(long long,len,REDIS_STREAM_CHUNK);
+
+        if (redisReadPayload(c,page,chunk) == -1) return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* GET a value that may be too large to be allocated contiguously. The
+ * value is read into a single page sized buffer, and handed to 'fn' one
+ * chunk (of at most REDIS_STREAM_CHUNK bytes) at a time, together with
+ * 'privdata'. If 'fn' returns non zero the rest of the value is read and
+ * discarded, so the connection stays usable. The full length of the value
+ * is stored in *len.
+ *
+ * Returns 1 if the value was delivered, 0 if the key does not exist and -1
+ * on error (error reply, I/O error or aborted delivery). */
+int redisGetStream(redisContext *c, const char *key, size_t keylen,
+        redisStreamFn *fn, void *privdata, long long *len) {
+    const char *argv[2] = { "GET", key };
+    size_t argvlen[2] = { 3, keylen };
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
+    sds cmd;
+    char *page, *line;
+    size_t linelen;
+    long long remaining;
+    int err = 0;
+
+    *len = 0;
+    /* allocate before sending, so that failing leaves the stream alone */
+    cmd = redisCatCommandArgv(sdsnewlenGfp("",0,gfp),2,argv,argvlen,gfp);
+    if (cmd == NULL || (page = redisPageAlloc(c)) == NULL) {
+        sdsfree(cmd);
+        redisOOM(c,0);
+        return -1;
+    }
+    if (redisWriteCommand(c,cmd) == -1) {
+        sdsfree(cmd);
+        goto err;
+    }
+    sdsfree(cmd);
+
+    if (redisBufferFill(c,1) == -1) goto err;
+    if (c->ibuf[c->ipos] != '$') {
+        /* most likely an error reply: parse and drop it */
+        redisReply *r = redisReadReply(c);
+
+        if (r) freeReplyObject(r);
+        goto err;
+    }
+    c->ipos++;
+    if ((line = redisReadLine(c,&linelen)) == NULL) goto err;
+    if (redisParseLongLong(line,linelen,len) == -1 || *len < -1) {
+        c->err = REDIS_ERR_PROTOCOL;
+        goto err;
+    }
+    if (*len == -1) {
+        *len = 0;
+        redisPageFree(c,page);
+        return 0;
+    }
+
+    remaining = *len;
+    while (remaining > 0) {
+        size_t chunk = min_t(long long,remaining,REDIS_STREAM_CHUNK);
+
+        if (redisReadPayload(c,page,chunk) == -1) goto err;
+        remaining -= chunk;
+        if (fn(privdata,page,chunk) != 0) {
+            err = -1;
+            break;
+        }
+    }
+    if (redisSkipPayload(c,page,remaining) == -1 || redisSkipCrlf(c) == -1)
+        err = -1;
+    redisPageFree(c,page);
+    return err ? -1 : 1;
+
+err:
+    redisPageFree(c,page);
+    return -1;
+}
+
+/* SET a value of 'vallen' bytes without having it in memory as a whole.
+ * 'fn' is called repeatedly with a page sized buffer and the number of
+ * bytes (at most REDIS_STREAM_CHUNK) it has to fill with the next part of
+ * the value; every chunk is written to the socket before the next one is
+ * requested. If 'fn' returns non zero the request can not be completed:
+ * the connection is marked failed (later commands get an "I/O error"
+ * reply) and must be closed with redisFree().
+ *
+ * Returns 0 if the key was set and -1 otherwise. */
+int redisSetStream(redisContext *c, const char *key, size_t keylen,
+        long long vallen, redisStreamFn *fn, void *privdata) {
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
+    sds cmd = sdsnewlenGfp("",0,gfp);
+    int cork = c->cork && vallen >= c->cork;
+    redisReply *r;
+    char *page;
+    int ok;
+
+    cmd = redisCatHeader(cmd,'*',3,gfp);
+    cmd = redisCatArgument(cmd,"SET",3,gfp);
+    cmd = redisCatArgument(cmd,key,keylen,gfp);
+    cmd = redisCatHeader(cmd,'$',vallen,gfp);
+    if (cmd == NULL || (page = redisPageAlloc(c)) == NULL) {
+        sdsfree(cmd);
+        redisOOM(c,0);
+        return -1;
+    }
+    if (cork) redisCork(c,1);
+    if (redisWriteCommand(c,cmd) == -1) goto err;
+
+    while (vallen > 0) {
+        size_t chunk = min_t(long long,vallen,REDIS_STREAM_CHUNK);
+
+        if (fn(privdata,page,chunk) != 0 ||
+            kernel_sockWrite(c->sock,page,chunk) != (int)chunk)
+            goto err;
+        vallen -= chunk;
+    }
+    if (kernel_sockWrite(c->sock,"\r\n",2) != 2) goto err;
+    if (cork) redisCork(c,0);
+    redisPageFree(c,page);
+    sdsfree(cmd);
+
+    if ((r = redisReadReply(c)) == NULL) return -1;
+    ok = (r->type == REDIS_REPLY_STRING);
+    freeReplyObject(r);
+    return ok ? 0 : -1;
+
+err:
+    /* part of the value is on the wire: the next reply would not be ours */
+    c->err = REDIS_ERR_IO;
+    if (cork) redisCork(c,0);
+    redisPageFree(c,page);
+    sdsfree(cmd);
+    return -1;
+}
@@ -43,15 +43,126 @@
 
 #define REDIS_ERR_LEN 256
 
+/* Reasons for a connection to become unusable (redisContext.err) */
+#define REDIS_ERR_IO 1       /* Read or write failed, or EOF */
+#define REDIS_ERR_PROTOCOL 2 /* The server sent something unparsable */
+#define REDIS_ERR_OOM 3      /* Out of memory (or budget) while reading */
+
+/* Per-key status of redisGetBatch()/redisSetBatch() */
+#define REDIS_BATCH_OK 0    /* value copied (GET) or key set (SET) */
+#define REDIS_BATCH_NIL 1   /* the key does not exist (GET) */
+#define REDIS_BATCH_TRUNC 2 /* the value did not fit, buf holds a prefix */
+#define REDIS_BATCH_ERR 3   /* error reply or connection failure */
+
+/* How the batch functions send the keys, see redisSetBatchMode() */
+#define REDIS_BATCH_MODE_AUTO 0     /* MGET/MSET, or GET/SET after a refusal */
+#define REDIS_BATCH_MODE_MULTI 1    /* MGET/MSET only */
+#define REDIS_BATCH_MODE_PIPELINE 2 /* A pipeline of GET/SET */
+
+/* Limits of a single MGET/MSET issued by the batch functions */
+#define REDIS_BATCH_MAX_ARGS 512
+#define REDIS_BATCH_MAX_BYTES (64*1024)
+
+/* Largest piece of a value handled at once by redisGetStream() and
+ * redisSetStream(); the buffer is a single page, so it never needs a
+ * high order allocation. */
+#define REDIS_STREAM_CHUNK PAGE_SIZE
+
+/* Size of each read from the socket into the input buffer */
+#define REDIS_IOBUF_LEN (1024*16)
+
+/* Largest reply string taken from the pool of a context */
+#define REDIS_POOL_STRLEN 128
+
+/* Command buffers larger than this are not kept for the next command */
+#define REDIS_OBUF_KEEP (1024*64)
+
+/* Room for any "<type><len>\r\n" header, see redisFormatHeader() */
+#define REDIS_HEADER_MAX (1+SDS_LLSTR_SIZE+2)
+
 
 #include <linux/types.h>
 #include <linux/string.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
+#include <linux/spinlock.h>
+#include <linux/un.h>
+#include <linux/in6.h>
+#include <asm/atomic.h>
+
 #include "sds.h"
 #include "networking_utils.h"
 
+/* Address of a Redis server: a unix socket path, or an IPv4 or IPv6 address
+ * and port. See redisParseAddress(). */
+typedef struct redisAddress {
+    int family; /* AF_UNIX, AF_INET or AF_INET6 */
+    int len;    /* Bytes of 'u' passed to connect() */
+    union {
+        struct sockaddr sa;
+        struct sockaddr_un un;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } u;
+} redisAddress;
+
+/* Socket options set by redisConnectAddress() before connecting. Zero
+ * leaves the system default; an option that can not be set makes the
+ * connection fail. The TCP ones are ignored on unix sockets. */
+typedef struct redisSocketOptions {
+    int sndbuf;    /* SO_SNDBUF, in bytes */
+    int rcvbuf;    /* SO_RCVBUF, in bytes (before connecting, so that the
+                      TCP window scale is chosen accordingly) */
+    int keepalive; /* SO_KEEPALIVE, with the following if non zero: */
+    int keepidle;  /* TCP_KEEPIDLE, seconds idle before the first probe */
+    int keepintvl; /* TCP_KEEPINTVL, seconds between probes */
+    int keepcnt;   /* TCP_KEEPCNT, unanswered probes before giving up */
+    int busypoll;  /* SO_BUSY_POLL, microseconds to spin on the device
+                      queue on a blocking read (Linux 3.11) */
+    int quickack;  /* TCP_QUICKACK, set again after every read as the
+                      stack clears it */
+    int priority;  /* SO_PRIORITY */
+    int mark;      /* SO_MARK (Linux 2.6.25) */
+    int cork;      /* TCP_CORK the writes of this many bytes or more, so
+                      that they go out in full segments */
+} redisSocketOptions;
+
+/* Commands sent right after connecting, see redisRunHandshake() */
+typedef struct redisHandshake {
+    const char *username; /* ACL user of AUTH (Redis 6), or NULL */
+    const char *password; /* AUTH password, or NULL for no AUTH */
+    int db;               /* SELECT this DB if non zero */
+    const char *name;     /* CLIENT SETNAME, or NULL */
+    int protocol;         /* Send HELLO with this version (only 2 is
+                             supported), or 0 for none */
+} redisHandshake;
+
+/* Free lists of preallocated reply nodes and strings, see
+ * redisContextSetPool() */
+typedef struct redisPool {
+    spinlock_t lock;
+    void *nodes;   /* Free reply nodes */
+    void *strings; /* Free strings of REDIS_POOL_STRLEN bytes */
+} redisPool;
+
+/* Memory accounting of a context. It is shared with the replies read from
+ * the context, which give their bytes back when freed, so it lives until
+ * both the context and its last reply are gone. */
+typedef struct redisMemAcct {
+    atomic_t refs;
+    atomic_long_t used;   /* Bytes of the input buffer and live replies */
+    long budget;          /* Limit of 'used', or 0 for none */
+    atomic_t failures;    /* Allocations that failed or were refused */
+    redisPool *pool;      /* Preallocated memory for replies, or NULL */
+} redisMemAcct;
+
+/* redisReply.flags, internal to redisclient.c */
+#define REDIS_REPLY_F_TOP 1      /* Holds a reference to acct */
+#define REDIS_REPLY_F_POOLNODE 2 /* The reply node comes from the pool */
+#define REDIS_REPLY_F_POOLSTR 4  /* So does the string */
+#define REDIS_REPLY_F_SHARED 8   /* Freed with its last reference (refs) */
+
 /* This is the reply object returned by redisCommand() */
 typedef struct redisReply {
     int type; /* REDIS_REPLY_* */
@@ -59,11 +170,129 @@ typedef struct redisReply {
     char *reply; /* Used for both REDIS_REPLY_ERROR and REDIS_REPLY_STRING */
     size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
+    redisMemAcct *acct; /* Accounting of the context it was read from */
+    size_t mem;         /* Bytes charged to acct, elements included (top) */
+    int flags;          /* REDIS_REPLY_F_* */
+    atomic_t refs;      /* References to a shared reply (top) */
 } redisReply;
 
-redisReply *redisConnect(int *fd, const char *ip, int port);
+/* Caller provided slot for one key of redisGetBatch()/redisSetBatch() */
+typedef struct redisBatchResult {
+    int status;    /* REDIS_BATCH_* */
+    char *buf;     /* Buffer receiving the value (GET only) */
+    size_t buflen; /* Size of buf */
+    size_t len;    /* Full length of the value */
+} redisBatchResult;
+
+/* Consumer (redisGetStream) or producer (redisSetStream) of the chunks of
+ * a streamed value. Returns 0 to go on, non zero to abort. */
+typedef int redisStreamFn(void *privdata, char *buf, size_t len);
+
+/* A MULTI/EXEC transaction being built. The queued commands are kept
+ * already encoded, so that MULTI, the commands and EXEC go out in a single
+ * write. */
+typedef struct redisTransaction {
+    sds cmd;   /* MULTI and the queued commands */
+    int count; /* Number of queued commands */
+    gfp_t gfp; /* Flags of the allocations of cmd */
+} redisTransaction;
+
+/* Queues the commands of a transaction with redisTransactionAppend(). It
+ * may read the watched keys through 'c' first. Returns 0 to go on, non
+ * zero to abort the transaction. */
+struct redisContext;
+typedef int redisTransactionFn(struct redisContext *c, redisTransaction *t,
+        void *privdata);
+
+struct redisCache;
+struct redisFlight;
+
+/* State of a connection to a Redis server. Replies are read from the socket
+ * in REDIS_IOBUF_LEN chunks into 'ibuf' and parsed from there. */
+typedef struct redisContext {
+    struct socket *sock;
+    sds ibuf;    /* Input buffer */
+    size_t ipos; /* Position of the first unparsed byte in ibuf */
+    int err;     /* REDIS_ERR_* once the connection failed, 0 before */
+    gfp_t gfp;   /* Flags of the allocations made on behalf of the context */
+    redisMemAcct *acct;
+    size_t ibufmem; /* Bytes of ibuf charged to acct */
+    int depth;      /* Nesting of the reply being read */
+    size_t charged; /* Bytes charged for the reply being read */
+    sds obuf;       /* Command buffer kept for the next command */
+    unsigned long allocs; /* Allocator calls, see redisAllocCount() */
+    int quickack;   /* Set TCP_QUICKACK after reads */
+    int cork;       /* Cork writes of this many bytes or more, 0 never */
+    int fdsock;     /* sock was adopted from a descriptor, and is held by
+                       a reference to its file */
+    struct redisCache *cache; /* Serves some commands, see rediscache.h */
+    struct redisFlight *flight; /* Coalesces some commands, see
+                                   redisflight.h */
+    int batchmode;  /* REDIS_BATCH_MODE_* */
+    int batchpipe;  /* The server refused an MGET/MSET: pipeline batches */
+} redisContext;
+
+int redisParseAddress(redisAddress *a, const char *addr, int port);
+redisReply *redisConnect(redisContext **c, const char *addr, int port);
+redisReply *redisConnectAddress(redisContext **c, const redisAddress *a,
+        const redisSocketOptions *opts);
+redisContext *redisContextCreate(struct socket *sock);
+redisReply *redisConnectFd(redisContext **c, int fd);
+redisReply *redisConnectHandshake(redisContext **c, const char *addr,
+        int port, const redisHandshake *h);
+redisReply *redisRunHandshake(redisContext *c, const redisHandshake *h);
+int redisTlsInstall(redisContext *c, const void *tx, int txlen,
+        const void *rx, int rxlen);
+void redisFree(redisContext *c);
+void redisCork(redisContext *c, int on);
+void redisSetAllocFlags(redisContext *c, gfp_t gfp);
+void redisSetMemoryBudget(redisContext *c, long bytes);
+void redisSetCache(redisContext *c, struct redisCache *cache);
+void redisSetFlight(redisContext *c, struct redisFlight *f);
+void redisSetBatchMode(redisContext *c, int mode);
+long redisMemoryUsed(redisContext *c);
+redisReply *redisOOMReplyFor(redisContext *c);
+int redisIsOOMReply(redisReply *r);
+int redisContextSetPool(redisContext *c, int nodes, int strings);
+unsigned long redisAllocCount(redisContext *c);
 void freeReplyObject(redisReply *r);
-redisReply *redisCommand(int fd, const char *format, ...);
+redisReply *redisReplyCopy(const redisReply *r, gfp_t gfp, size_t *size);
+redisReply *redisReplyGet(redisReply *r);
+redisReply *redisReadReply(redisContext *c);
+int redisBufferRead(redisContext *c);
+int redisBufferReadNonBlock(redisContext *c);
+int redisParseLongLong(const char *s, size_t len, long long *value);
+sds *redisCommandListCreate(const char * const *names);
+void redisCommandListFree(sds *list);
+int redisCommandInList(const char *cmd, size_t len, sds *list);
+redisReply *redisCommand(redisContext *c, const char *format, ...);
+redisReply *redisCommandArgv(redisContext *c, int argc, const char **argv,
+        const size_t *argvlen);
+int redisSendCommandArgv(redisContext *c, int argc, const char **argv,
+        const size_t *argvlen);
+int redisSendFormatted(redisContext *c, const char *buf, size_t len);
+sds redisCatReply(sds s, const redisReply *r, gfp_t gfp);
+sds redisCatCommandArgv(sds cmd, int argc, const char **argv,
+        const size_t *argvlen, gfp_t gfp);
+size_t redisFormatHeader(char *buf, char type, size_t len);
+int redisGetBatch(redisContext *c, int count, const char **keys,
+        const size_t *keylens, redisBatchResult *res);
+int redisSetBatch(redisContext *c, int count, const char **keys,
+        const size_t *keylens, const char **vals, const size_t *vallens,
+        redisBatchResult *res);
+redisTransaction *redisTransactionCreate(gfp_t gfp);
+void redisTransactionFree(redisTransaction *t);
+void redisTransactionReset(redisTransaction *t);
+int redisTransactionAppend(redisTransaction *t, int argc, const char **argv,
+        const size_t *argvlen);
+redisReply *redisTransactionExec(redisContext *c, redisTransaction *t);
+redisReply *redisTransactionRun(redisContext *c, int nkeys, const char **keys,
+        const size_t *keylens, redisTransactionFn *fn, void *privdata,
+        int tries);
+int redisGetStream(redisContext *c, const char *key, size_t keylen,
+        redisStreamFn *fn, void *privdata, long long *len);
+int redisSetStream(redisContext *c, const char *key, size_t keylen,
+        long long vallen, redisStreamFn *fn, void *privdata);
 
 
 
@@ -0,0 +1,286 @@
+/*
+   Compression of the values SET and read back with GET.
+
+   redisCodecSet() compresses values of at least 'threshold' bytes and
+   stores them behind a small header (see rediscodec.h); a value that
+   does not get smaller is stored as it is. redisCodecGet() reads either
+   kind and decompresses straight into the caller's buffer, so values
+   written before the codec was used, or by other clients, are read back
+   unchanged. Which codec compressed a value is in its header: any codec
+   reads what the others wrote, as long as the kernel has it.
+
+   The compression and decompression states of a codec are shared, each
+   under its own mutex: one codec per thread avoids contention on them.
+ */
+
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#ifdef REDIS_CODEC_HAVE_LZ4
+#include <linux/lz4.h>
+#endif
+
+#include "rediscodec.h"
+
+/* Larger buffers are allocated with vmalloc() */
+#define REDIS_CODEC_KMALLOC_MAX (16*PAGE_SIZE)
+
+/* Allocate a buffer of 'size' bytes with 'gfp'. vmalloc() allocates with
+ * GFP_KERNEL whatever the caller's flags, so larger buffers can only be
+ * had when 'gfp' allows as much: NULL is returned otherwise. */
+static void *redisCodecAlloc(size_t size, gfp_t gfp) {
+    if (size <= REDIS_CODEC_KMALLOC_MAX) return kmalloc(size, gfp);
+    if ((gfp & GFP_KERNEL) != GFP_KERNEL) return NULL;
+    return vmalloc(size);
+}
+
+static void redisCodecRelease(void *buf, size_t size) {
+    if (size <= REDIS_CODEC_KMALLOC_MAX) kfree(buf);
+    else vfree(buf);
+}
+
+static void redisCodecPutHeader(char *buf, int type, size_t len) {
+    buf[0] = (char)REDIS_CODEC_MAGIC;
+    buf[1] = type;
+    buf[2] = len & 0xff;
+    buf[3] = (len >> 8) & 0xff;
+    buf[4] = (len >> 16) & 0xff;
+    buf[5] = (len >> 24) & 0xff;
+}
+
+static size_t redisCodecHeaderLen(const char *buf) {
+    const unsigned char *p = (const unsigned char *)buf;
+
+    return p[2] | (p[3] << 8) | (p[4] << 16) | ((size_t)p[5] << 24);
+}
+
+/* Compress 'codec' values of 'threshold' bytes or more with 'type', at
+ * 'level' for zlib (1 to 9, or Z_DEFAULT_COMPRESSION). REDIS_CODEC_NONE
+ * only decompresses. Returns NULL if out of memory or if the codec is not
+ * available in this kernel. */
+redisCodec *redisCodecCreate(int type, int level, size_t threshold) {
+    redisCodec *codec;
+    int size;
+
+#ifndef REDIS_CODEC_HAVE_LZ4
+    if (type == REDIS_CODEC_LZ4) return NULL;
+#endif
+    if ((codec = kzalloc(sizeof(*codec), GFP_KERNEL)) == NULL) return NULL;
+    codec->type = type;
+    codec->level = level;
+    codec->threshold = threshold;
+    mutex_init(&codec->clock);
+    mutex_init(&codec->dlock);
+
+    /* any value may have to be inflated */
+    codec->inflate.workspace = vmalloc(zlib_inflate_workspacesize());
+    if (codec->inflate.workspace == NULL ||
+        zlib_inflateInit(&codec->inflate) != Z_OK) goto err;
+
+    if (type == REDIS_CODEC_ZLIB) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+        size = zlib_deflate_workspacesize(MAX_WBITS,MAX_MEM_LEVEL);
+#else
+        size = zlib_deflate_workspacesize();
+#endif
+        codec->deflate.workspace = vmalloc(size);
+        if (codec->deflate.workspace == NULL ||
+            zlib_deflateInit2(&codec->deflate,level,Z_DEFLATED,MAX_WBITS,
+                              MAX_MEM_LEVEL,Z_DEFAULT_STRATEGY) != Z_OK)
+            goto err;
+    }
+#ifdef REDIS_CODEC_HAVE_LZ4
+    if (type == REDIS_CODEC_LZ4 &&
+        (codec->lz4mem = vmalloc(LZ4_MEM_COMPRESS)) == NULL) goto err;
+#endif
+    return codec;
+
+err:
+    redisCodecFree(codec);
+    return NULL;
+}
+
+void redisCodecFree(redisCodec *codec) {
+    if (codec->inflate.workspace) {
+        if (codec->inflate.state) zlib_inflateEnd(&codec->inflate);
+        vfree(codec->inflate.workspace);
+    }
+    if (codec->deflate.workspace) {
+        if (codec->deflate.state) zlib_deflateEnd(&codec->deflate);
+        vfree(codec->deflate.workspace);
+    }
+    if (codec->lz4mem) vfree(codec->lz4mem);
+    kfree(codec);
+}
+
+/* Compress 'len' bytes at 'src' into at most 'cap' bytes at 'dst'. Returns
+ * the compressed length, or 0 if it does not fit. Called with clock
+ * held. */
+static size_t redisCodecCompress(redisCodec *codec, const char *src,
+        size_t len, char *dst, size_t cap) {
+    z_stream *s = &codec->deflate;
+
+    if (codec->type == REDIS_CODEC_ZLIB) {
+        if (zlib_deflateReset(s) != Z_OK) return 0;
+        s->next_in = (u8 *)src;
+        s->avail_in = len;
+        s->next_out = (u8 *)dst;
+        s->avail_out = cap;
+        return zlib_deflate(s,Z_FINISH) == Z_STREAM_END ? s->total_out : 0;
+    }
+#ifdef REDIS_CODEC_HAVE_LZ4
+    if (codec->type == REDIS_CODEC_LZ4) {
+        int n = LZ4_compress_default(src,dst,len,cap,codec->lz4mem);
+
+        return n > 0 ? n : 0;
+    }
+#endif
+    return 0;
+}
+
+/* Decompress the 'len' bytes at 'src', compressed with 'type', into the
+ * 'out' bytes at 'dst'. Returns 0, or -1 if the data is corrupt or does
+ * not decompress to exactly 'out' bytes. Called with dlock held. */
+static int redisCodecDecompress(redisCodec *codec, int type, const char *src,
+        size_t len, char *dst, size_t out) {
+    z_stream *s = &codec->inflate;
+
+    switch (type) {
+    case REDIS_CODEC_NONE:
+        if (len != out) return -1;
+        memcpy(dst,src,len);
+        return 0;
+    case REDIS_CODEC_ZLIB:
+        if (zlib_inflateReset(s) != Z_OK) return -1;
+        s->next_in = (u8 *)src;
+        s->avail_in = len;
+        s->next_out = (u8 *)dst;
+        s->avail_out = out;
+        if (zlib_inflate(s,Z_FINISH) != Z_STREAM_END) return -1;
+        return s->total_out == out ? 0 : -1;
+#ifdef REDIS_CODEC_HAVE_LZ4
+    case REDIS_CODEC_LZ4:
+        return LZ4_decompress_safe(src,dst,len,out) == (int)out ? 0 : -1;
+#endif
+    }
+    return -1;
+}
+
+/* SET 'key' to 'val', compressed if it is at least the threshold of
+ * 'codec' long and gets smaller. The buffer of the compressed value is
+ * allocated with the flags of 'c': without it the value is stored as it
+ * is. Returns 0 if the key was set and -1 otherwise. */
+int redisCodecSet(redisContext *c, redisCodec *codec, const char *key,
+        size_t keylen, const char *val, size_t vallen) {
+    const char *argv[3] = { "SET", key, val };
+    size_t argvlen[3] = { 3, keylen, vallen };
+    size_t size = REDIS_CODEC_HDR+vallen, n = 0;
+    gfp_t gfp = c->gfp|__GFP_NOWARN;
+    char *buf = NULL;
+    redisReply *r;
+    ktime_t start;
+    int rc;
+
+    if (codec->type != REDIS_CODEC_NONE && vallen >= codec->threshold &&
+        vallen > REDIS_CODEC_HDR && vallen <= 0xffffffffUL &&
+        (buf = redisCodecAlloc(size,gfp)) != NULL) {
+        mutex_lock(&codec->clock);
+        start = ktime_get();
+        /* only worth it if it saves more than the header */
+        n = redisCodecCompress(codec,val,vallen,buf+REDIS_CODEC_HDR,
+                vallen-REDIS_CODEC_HDR-1);
+        codec->stats.compress_ns +=
+            ktime_to_ns(ktime_sub(ktime_get(),start));
+        if (n) {
+            codec->stats.compressed++;
+            codec->stats.bytes_in += vallen;
+            codec->stats.bytes_out += REDIS_CODEC_HDR+n;
+        } else {
+            codec->stats.raw++;
+        }
+        mutex_unlock(&codec->clock);
+        if (n) {
+            redisCodecPutHeader(buf,codec->type,vallen);
+            argv[2] = buf;
+            argvlen[2] = REDIS_CODEC_HDR+n;
+        }
+    }
+    /* a value that looks like a header is stored behind one */
+    if (n == 0 && vallen && (unsigned char)val[0] == REDIS_CODEC_MAGIC) {
+        if (vallen > 0xffffffffUL) goto err;
+        if (buf == NULL && (buf = redisCodecAlloc(size,gfp)) == NULL)
+            goto err;
+        redisCodecPutHeader(buf,REDIS_CODEC_NONE,vallen);
+        memcpy(buf+REDIS_CODEC_HDR,val,vallen);
+        argv[2] = buf;
+        argvlen[2] = size;
+    }
+
+    r = redisCommandArgv(c,3,argv,argvlen);
+    rc = r->type == REDIS_REPLY_STRING && !strcmp(r->reply,"OK") ? 0 : -1;
+    freeReplyObject(r);
+    if (buf) redisCodecRelease(buf,size);
+    return rc;
+
+err:
+    if (buf) redisCodecRelease(buf,size);
+    return -1;
+}
+
+/* GET 'key' into the 'buflen' bytes at 'buf', decompressing it if it was
+ * stored compressed. The length of the value is stored in *len, even when
+ * it does not fit in 'buf', and 0 if the key does not exist.
+ *
+ * Returns 1 if the value was read, 0 if the key does not exist and -1 on
+ * error (error reply, I/O error, corrupt value, or 'buf' too small). */
+int redisCodecGet(redisContext *c, redisCodec *codec, const char *key,
+        size_t keylen, char *buf, size_t buflen, size_t *len) {
+    const char *argv[2] = { "GET", key };
+    size_t argvlen[2] = { 3, keylen };
+    redisReply *r = redisCommandArgv(c,2,argv,argvlen);
+    const char *v = r->reply;
+    size_t vlen;
+    ktime_t start;
+    int rc = -1, type;
+
+    if (r->type == REDIS_REPLY_NIL) {
+        *len = 0;
+        rc = 0;
+    } else if (r->type == REDIS_REPLY_STRING) {
+        vlen = sdslen(r->reply);
+        if (vlen >= REDIS_CODEC_HDR &&
+            (unsigned char)v[0] == REDIS_CODEC_MAGIC) {
+            type = v[1];
+            *len = redisCodecHeaderLen(v);
+            if (*len <= buflen) {
+                mutex_lock(&codec->dlock);
+                start = ktime_get();
+                rc = redisCodecDecompress(codec,type,v+REDIS_CODEC_HDR,
+                        vlen-REDIS_CODEC_HDR,buf,*len);
+                if (type != REDIS_CODEC_NONE) {
+                    codec->stats.decompress_ns +=
+                        ktime_to_ns(ktime_sub(ktime_get(),start));
+                    codec->stats.decompressed++;
+                }
+                mutex_unlock(&codec->dlock);
+                if (rc == 0) rc = 1;
+            }
+        } else {
+            *len = vlen;
+            if (vlen <= buflen) {
+                memcpy(buf,v,vlen);
+                rc = 1;
+            }
+        }
+    }
+    freeReplyObject(r);
+    return rc;
+}
+
+/* A snapshot of the statistics of 'codec' */
+void redisCodecGetStats(redisCodec *codec, redisCodecStats *stats) {
+    mutex_lock(&codec->clock);
+    mutex_lock(&codec->dlock);
+    *stats = codec->stats;
+    mutex_unlock(&codec->dlock);
+    mutex_unlock(&codec->clock);
+}
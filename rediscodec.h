@@ -0,0 +1,65 @@
+/*
+   Compression of the values SET and read back with GET, for the kernel
+   redis client.
+ */
+
+#ifndef __REDISCODEC_H
+#define __REDISCODEC_H
+
+#include <linux/mutex.h>
+#include <linux/version.h>
+#include <linux/zlib.h>
+
+#include "redisclient.h"
+
+/* Codecs, stored in the header of a value */
+#define REDIS_CODEC_NONE 0 /* Stored as is, after the header */
+#define REDIS_CODEC_ZLIB 1 /* zlib_deflate (every kernel) */
+#define REDIS_CODEC_LZ4 2  /* LZ4 (Linux 4.11 or later, CONFIG_LZ4_*) */
+
+#if defined(CONFIG_LZ4_COMPRESS) && defined(CONFIG_LZ4_DECOMPRESS) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define REDIS_CODEC_HAVE_LZ4
+#endif
+
+/* A value written by the codec starts with this header: the magic byte,
+ * the codec and the length of the original value (32 bits, little
+ * endian). Values left as they are have no header, unless they start with
+ * the magic byte themselves. */
+#define REDIS_CODEC_MAGIC 0xFE
+#define REDIS_CODEC_HDR 6
+
+typedef struct redisCodecStats {
+    unsigned long compressed;   /* Values stored compressed */
+    unsigned long raw;          /* Values over the threshold that did not
+                                   compress, stored as they are */
+    unsigned long decompressed; /* Values read back compressed */
+    u64 bytes_in;               /* Original bytes of the compressed values */
+    u64 bytes_out;              /* What they compressed to: the ratio is
+                                   bytes_in / bytes_out */
+    u64 compress_ns;            /* Time spent compressing */
+    u64 decompress_ns;          /* Time spent decompressing */
+} redisCodecStats;
+
+typedef struct redisCodec {
+    int type;              /* REDIS_CODEC_* */
+    int level;             /* zlib level */
+    size_t threshold;      /* Smaller values are not compressed */
+    struct mutex clock;    /* Protects the compression state */
+    struct mutex dlock;    /* Protects the decompression state */
+    z_stream deflate;
+    z_stream inflate;
+    void *lz4mem;          /* LZ4 work memory */
+    redisCodecStats stats; /* Compression part under clock, the rest
+                              under dlock */
+} redisCodec;
+
+redisCodec *redisCodecCreate(int type, int level, size_t threshold);
+void redisCodecFree(redisCodec *codec);
+int redisCodecSet(redisContext *c, redisCodec *codec, const char *key,
+        size_t keylen, const char *val, size_t vallen);
+int redisCodecGet(redisContext *c, redisCodec *codec, const char *key,
+        size_t keylen, char *buf, size_t buflen, size_t *len);
+void redisCodecGetStats(redisCodec *codec, redisCodecStats *stats);
+
+#endif /* __REDISCODEC_H */
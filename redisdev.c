@@ -0,0 +1,497 @@
+/*
+   Character device giving userspace batched access to a pool of client
+   connections, see redisdev.h for the interface.
+
+   Every open file has its own pair of rings. REDISDEV_ENTER takes the
+   commands submitted since the last call, copies them out of the shared
+   memory (the process may still be writing there, so nothing is checked
+   or sent in place), checks that each is a single well formed command
+   and sends them all in one write on a connection of the pool. Replies
+   are then read one by one and written back to the completion ring.
+
+   A completion that does not fit in the completion ring is held back
+   until the process makes room, and no more commands are taken in the
+   meantime: a slow reader slows the submissions down rather than losing
+   replies. Only a reply too large for the whole ring completes with
+   -ENOSPC.
+ */
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/compat.h>
+#include <asm/uaccess.h>
+
+#include "redisdev.h"
+
+/* Devices, to find the one a file is opened on */
+static LIST_HEAD(redisDevices);
+static DEFINE_MUTEX(redisDevicesLock);
+
+/* A command of the last batch */
+struct redisDevCmd {
+    __u64 user_data;
+    int status; /* 1 while sent and waiting for its reply */
+    sds reply;  /* Reply of a completion held back, NULL for none */
+};
+
+/* An open file of a device */
+typedef struct redisDevFile {
+    redisDev *dev;
+    struct mutex lock;          /* Serializes setup and REDISDEV_ENTER */
+    char *mem;                  /* Shared memory, NULL before setup */
+    unsigned long memlen;
+    struct redisdev_ring *sq, *cq;
+    char *sqdata, *cqdata;
+    u32 sqsize, cqsize;         /* Our copies, the shared ones may change */
+    u32 sqhead, cqtail;         /* Moved by us only */
+    struct redisDevCmd *batch;  /* REDISDEV_MAX_BATCH commands */
+    int nbatch;                 /* Commands in the last batch */
+    int held;                   /* First of them held back, or nbatch */
+    sds cmds;                   /* Commands of the batch, as sent */
+    sds out;                    /* Reply being written to the ring */
+} redisDevFile;
+
+#define REDISDEV_PAD(len) (((len)+REDISDEV_ALIGN-1) & ~(REDISDEV_ALIGN-1))
+
+/* Copy 'len' bytes at 'off' out of a ring of 'size' bytes */
+static void redisDevRingRead(const char *ring, u32 size, u32 off, void *dst,
+        size_t len) {
+    size_t first;
+
+    off &= size-1;
+    first = min_t(size_t,len,size-off);
+    memcpy(dst,ring+off,first);
+    memcpy((char*)dst+first,ring,len-first);
+}
+
+static void redisDevRingWrite(char *ring, u32 size, u32 off, const void *src,
+        size_t len) {
+    size_t first;
+
+    off &= size-1;
+    first = min_t(size_t,len,size-off);
+    memcpy(ring+off,src,first);
+    memcpy(ring,(const char*)src+first,len-first);
+}
+
+/* Parse the "<type><number>\r\n" line at 'p'. Returns the byte after it,
+ * or NULL if there is no such line before 'end'. */
+static const char *redisDevLine(const char *p, const char *end, char type,
+        long long *value) {
+    const char *cr;
+
+    if (p >= end || *p != type) return NULL;
+    if ((cr = memchr(p,'\r',end-p)) == NULL || cr+1 == end || cr[1] != '\n')
+        return NULL;
+    if (redisParseLongLong(p+1,cr-p-1,value) == -1) return NULL;
+    return cr+2;
+}
+
+/* Commands refused: they change the state of the connection, which the
+ * next batch (from any process) would inherit, or block it. */
+static const char *redisDevRefused[] = {
+    "SELECT", "SUBSCRIBE", "PSUBSCRIBE", "SSUBSCRIBE", "MONITOR", "MULTI",
+    "WATCH", "QUIT", "RESET", "HELLO", "WAIT", "WAITAOF", "BLPOP", "BRPOP",
+    "BRPOPLPUSH", "BLMOVE", "BLMPOP", "BZPOPMIN", "BZPOPMAX", "BZMPOP", NULL
+};
+
+static int redisDevArgIs(const char *arg, size_t len, const char *name) {
+    return strlen(name) == len && !strncasecmp(arg,name,len);
+}
+
+/* Check that the 'len' bytes at 'p' are exactly one command, a multi bulk
+ * of bulk strings: anything else would leave the replies out of step
+ * with the commands. Returns 0 if so, -EINVAL if not, and -EOPNOTSUPP for
+ * the commands of redisDevRefused, CLIENT REPLY and XREAD or XREADGROUP
+ * with BLOCK. */
+static int redisDevCheckCommand(const char *p, size_t len) {
+    const char *end = p+len, *name = NULL;
+    long long argc, arglen, namelen = 0, j;
+    int refused = 0, xread = 0;
+    const char **r;
+
+    if ((p = redisDevLine(p,end,'*',&argc)) == NULL || argc < 1)
+        return -EINVAL;
+    for (j = 0; j < argc; j++) {
+        if ((p = redisDevLine(p,end,'$',&arglen)) == NULL || arglen < 0 ||
+            arglen+2 > end-p || p[arglen] != '\r' || p[arglen+1] != '\n')
+            return -EINVAL;
+        if (j == 0) {
+            name = p;
+            namelen = arglen;
+            for (r = redisDevRefused; *r; r++)
+                if (redisDevArgIs(p,arglen,*r)) refused = 1;
+            xread = redisDevArgIs(p,arglen,"XREAD") ||
+                    redisDevArgIs(p,arglen,"XREADGROUP");
+        } else if (j == 1 && redisDevArgIs(name,namelen,"CLIENT") &&
+                   redisDevArgIs(p,arglen,"REPLY")) {
+            refused = 1;
+        } else if (xread) {
+            /* the options come before STREAMS, the keys after */
+            if (redisDevArgIs(p,arglen,"STREAMS")) xread = 0;
+            else if (redisDevArgIs(p,arglen,"BLOCK")) refused = 1;
+        }
+        p += arglen+2;
+    }
+    if (p != end) return -EINVAL;
+    return refused ? -EOPNOTSUPP : 0;
+}
+
+/* Write the completion of f->batch[j] to the ring, without making it
+ * visible yet. Returns -1 if there is no room for it. */
+static int redisDevPost(redisDevFile *f, int j, const char *data,
+        size_t len) {
+    struct redisdev_entry e;
+    size_t size = sizeof(e)+REDISDEV_PAD(len);
+
+    e.len = len;
+    e.status = f->batch[j].status;
+    e.user_data = f->batch[j].user_data;
+    if (size > f->cqsize) { /* would never fit */
+        e.len = len = 0;
+        e.status = -ENOSPC;
+        size = sizeof(e);
+    }
+    if (size > f->cqsize-(f->cqtail-ACCESS_ONCE(f->cq->head))) return -1;
+    redisDevRingWrite(f->cqdata,f->cqsize,f->cqtail,&e,sizeof(e));
+    if (len)
+        redisDevRingWrite(f->cqdata,f->cqsize,f->cqtail+sizeof(e),data,len);
+    f->cqtail += size;
+    return 0;
+}
+
+/* Write the completions held back, as far as they fit. Returns how many
+ * were written. */
+static int redisDevFlush(redisDevFile *f) {
+    struct redisDevCmd *cmd;
+    int n = 0;
+
+    while (f->held < f->nbatch) {
+        cmd = &f->batch[f->held];
+        if (redisDevPost(f,f->held,cmd->reply,
+                    cmd->reply ? sdslen(cmd->reply) : 0) == -1)
+            break;
+        sdsfree(cmd->reply);
+        cmd->reply = NULL;
+        f->held++;
+        n++;
+    }
+    return n;
+}
+
+/* Lock a connection of the pool, preferring one that is free, and connect
+ * it if needed. Returns NULL if the server can not be reached. */
+static redisDevConn *redisDevGetConn(redisDev *d) {
+    unsigned int first = atomic_inc_return(&d->next);
+    redisDevConn *conn;
+    redisReply *r;
+    int j;
+
+    for (j = 0; j < d->nconns; j++) {
+        conn = &d->conns[(first+j) % d->nconns];
+        if (mutex_trylock(&conn->lock)) goto locked;
+    }
+    conn = &d->conns[first % d->nconns];
+    mutex_lock(&conn->lock);
+
+locked:
+    if (conn->c == NULL && (r = redisConnectAddress(&conn->c,&d->addr,
+                    NULL)) != NULL) {
+        if (printk_ratelimit())
+            printk(KERN_ERR "redisdev: %s\n", r->reply);
+        freeReplyObject(r);
+        mutex_unlock(&conn->lock);
+        return NULL;
+    }
+    return conn;
+}
+
+static void redisDevPutConn(redisDevConn *conn) {
+    if (conn->c->err) {
+        redisFree(conn->c);
+        conn->c = NULL;
+    }
+    mutex_unlock(&conn->lock);
+}
+
+/* Take the commands submitted so far into f->cmds and f->batch. Returns
+ * the number taken, or -EINVAL if the rings are corrupt. */
+static int redisDevTakeCommands(redisDevFile *f) {
+    u32 sqtail, avail, cqfree, start = f->sqhead;
+    struct redisdev_entry e;
+    size_t need, pos;
+    sds cmds;
+    int n = 0;
+
+    sqtail = ACCESS_ONCE(f->sq->tail);
+    cqfree = f->cqsize-(f->cqtail-ACCESS_ONCE(f->cq->head));
+    smp_rmb(); /* read the entries after the tail */
+    avail = sqtail-f->sqhead;
+    if (avail > f->sqsize || cqfree > f->cqsize) return -EINVAL;
+
+    sdsclear(f->cmds);
+    while (n < REDISDEV_MAX_BATCH && avail >= sizeof(e) &&
+           cqfree >= (n+1)*sizeof(e)) {
+        redisDevRingRead(f->sqdata,f->sqsize,f->sqhead,&e,sizeof(e));
+        if (e.len > avail) return n ? n : -EINVAL;
+        need = sizeof(e)+REDISDEV_PAD((size_t)e.len);
+        if (need > avail) return n ? n : -EINVAL;
+
+        pos = sdslen(f->cmds);
+        if ((cmds = sdsMakeRoomFor(f->cmds,e.len)) == NULL) {
+            f->sqhead = start; /* the batch is submitted again later */
+            return -ENOMEM;
+        }
+        f->cmds = cmds;
+        redisDevRingRead(f->sqdata,f->sqsize,f->sqhead+sizeof(e),
+                f->cmds+pos,e.len);
+        f->batch[n].user_data = e.user_data;
+        f->batch[n].reply = NULL;
+        f->batch[n].status = redisDevCheckCommand(f->cmds+pos,e.len);
+        if (f->batch[n].status == 0) {
+            sdsIncrLen(f->cmds,e.len);
+            f->batch[n].status = 1;
+        }
+        f->sqhead += need;
+        avail -= need;
+        n++;
+    }
+    return n;
+}
+
+/* Run the commands submitted on 'f', after writing the completions held
+ * back. Returns the number of completions written, or a negative errno:
+ * -EBUSY if completions are still held back for want of room. */
+static long redisDevEnter(redisDevFile *f) {
+    redisDevConn *conn = NULL;
+    struct redisDevCmd *cmd;
+    redisReply *r;
+    int n, j, sent, posted;
+
+    if (f->mem == NULL) return -EINVAL;
+    posted = redisDevFlush(f);
+    if (f->held < f->nbatch) {
+        n = posted ? posted : -EBUSY;
+        goto publish;
+    }
+    if ((n = redisDevTakeCommands(f)) <= 0) {
+        n = posted ? posted : n;
+        goto publish;
+    }
+    f->nbatch = n;
+    f->held = n;
+
+    sent = sdslen(f->cmds) != 0;
+    if (sent && ((conn = redisDevGetConn(f->dev)) == NULL ||
+                 redisSendFormatted(conn->c,f->cmds,sdslen(f->cmds)) == -1))
+        sent = 0;
+
+    for (j = 0; j < n; j++) {
+        cmd = &f->batch[j];
+        if (cmd->status == 1) {
+            r = sent ? redisReadReply(conn->c) : NULL;
+            if (r == NULL || conn->c->err) {
+                /* the reply may be the shared OOM reply of a failure */
+                if (r) freeReplyObject(r);
+                cmd->status = conn ? -EIO : -ENOTCONN;
+                sent = 0;
+            } else {
+                /* f->out is NULL after running out of memory */
+                if (f->out) sdsclear(f->out);
+                else f->out = sdsempty();
+                f->out = redisCatReply(f->out,r,GFP_KERNEL);
+                freeReplyObject(r);
+                cmd->status = f->out ? 0 : -ENOMEM;
+            }
+        }
+        if (f->held == n &&
+            redisDevPost(f,j,f->out,cmd->status ? 0 : sdslen(f->out)) == 0) {
+            posted++;
+            continue;
+        }
+        /* hold it back, with the rest of the batch */
+        if (f->held == n) f->held = j;
+        if (cmd->status == 0) {
+            cmd->reply = f->out;
+            f->out = NULL;
+        }
+    }
+    if (conn) redisDevPutConn(conn);
+    n = posted;
+
+publish:
+    smp_wmb(); /* the completions before the tail that shows them */
+    f->cq->tail = f->cqtail;
+    f->sq->head = f->sqhead;
+    return n;
+}
+
+static int redisDevSetup(redisDevFile *f, struct redisdev_setup __user *arg) {
+    struct redisdev_setup s;
+
+    if (copy_from_user(&s,arg,sizeof(s))) return -EFAULT;
+    if (s.sq_size < PAGE_SIZE || s.sq_size > REDISDEV_MAX_RING ||
+        (s.sq_size & (s.sq_size-1)) ||
+        s.cq_size < PAGE_SIZE || s.cq_size > REDISDEV_MAX_RING ||
+        (s.cq_size & (s.cq_size-1)))
+        return -EINVAL;
+    if (f->mem) return -EBUSY;
+
+    f->memlen = PAGE_SIZE+s.sq_size+s.cq_size;
+    if ((f->mem = vmalloc_user(f->memlen)) == NULL) return -ENOMEM;
+    f->sq = (struct redisdev_ring *)f->mem;
+    f->cq = (struct redisdev_ring *)(f->mem+REDISDEV_CQ_OFFSET);
+    f->sqsize = f->sq->size = s.sq_size;
+    f->cqsize = f->cq->size = s.cq_size;
+    f->sq->data = PAGE_SIZE;
+    f->cq->data = PAGE_SIZE+s.sq_size;
+    f->sqdata = f->mem+f->sq->data;
+    f->cqdata = f->mem+f->cq->data;
+
+    s.map_size = f->memlen;
+    return copy_to_user(arg,&s,sizeof(s)) ? -EFAULT : 0;
+}
+
+static long redisDevIoctl(struct file *file, unsigned int cmd,
+        unsigned long arg) {
+    redisDevFile *f = file->private_data;
+    long rc;
+
+    mutex_lock(&f->lock);
+    switch (cmd) {
+    case REDISDEV_SETUP:
+        rc = redisDevSetup(f,(struct redisdev_setup __user *)arg);
+        break;
+    case REDISDEV_ENTER:
+        rc = redisDevEnter(f);
+        break;
+    default:
+        rc = -ENOTTY;
+    }
+    mutex_unlock(&f->lock);
+    return rc;
+}
+
+#ifdef CONFIG_COMPAT
+/* The structures are the same, only the pointer needs converting */
+static long redisDevCompatIoctl(struct file *file, unsigned int cmd,
+        unsigned long arg) {
+    return redisDevIoctl(file,cmd,(unsigned long)compat_ptr(arg));
+}
+#endif
+
+static int redisDevMmap(struct file *file, struct vm_area_struct *vma) {
+    redisDevFile *f = file->private_data;
+    int rc;
+
+    mutex_lock(&f->lock);
+    if (f->mem == NULL || vma->vm_pgoff != 0 ||
+        vma->vm_end-vma->vm_start > PAGE_ALIGN(f->memlen))
+        rc = -EINVAL;
+    else
+        rc = remap_vmalloc_range(vma,f->mem,0);
+    mutex_unlock(&f->lock);
+    return rc;
+}
+
+static int redisDevOpen(struct inode *inode, struct file *file) {
+    redisDevFile *f;
+    redisDev *d;
+
+    if ((f = kzalloc(sizeof(*f),GFP_KERNEL)) == NULL) return -ENOMEM;
+    mutex_lock(&redisDevicesLock);
+    list_for_each_entry(d, &redisDevices, node)
+        if (d->misc.minor == (int)iminor(inode)) f->dev = d;
+    mutex_unlock(&redisDevicesLock);
+
+    if (f->dev == NULL) {
+        kfree(f);
+        return -ENODEV;
+    }
+    f->batch = kmalloc(sizeof(*f->batch)*REDISDEV_MAX_BATCH,GFP_KERNEL);
+    f->cmds = sdsempty();
+    if (f->batch == NULL || f->cmds == NULL) {
+        kfree(f->batch);
+        sdsfree(f->cmds);
+        kfree(f);
+        return -ENOMEM;
+    }
+    mutex_init(&f->lock);
+    file->private_data = f;
+    return nonseekable_open(inode,file);
+}
+
+static int redisDevRelease(struct inode *inode, struct file *file) {
+    redisDevFile *f = file->private_data;
+
+    while (f->held < f->nbatch)
+        sdsfree(f->batch[f->held++].reply);
+    /* the mapping holds its own reference on the pages */
+    vfree(f->mem);
+    kfree(f->batch);
+    sdsfree(f->cmds);
+    sdsfree(f->out);
+    kfree(f);
+    return 0;
+}
+
+static const struct file_operations redisDevFops = {
+    .owner = THIS_MODULE,
+    .open = redisDevOpen,
+    .release = redisDevRelease,
+    .unlocked_ioctl = redisDevIoctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl = redisDevCompatIoctl,
+#endif
+    .mmap = redisDevMmap,
+};
+
+/* Create the device /dev/'name', whose batches go to the server at 'addr'
+ * and 'port' (see redisParseAddress()) over up to 'nconns' connections,
+ * opened when first needed. Returns NULL on error. */
+redisDev *redisDevCreate(const char *name, const char *addr, int port,
+        int nconns) {
+    redisDev *d;
+    int j;
+
+    if (nconns < 1 || (d = kzalloc(sizeof(*d),GFP_KERNEL)) == NULL)
+        return NULL;
+    if (redisParseAddress(&d->addr,addr,port) == -1 ||
+        (d->conns = kzalloc(sizeof(*d->conns)*nconns,GFP_KERNEL)) == NULL) {
+        kfree(d);
+        return NULL;
+    }
+    d->nconns = nconns;
+    for (j = 0; j < nconns; j++)
+        mutex_init(&d->conns[j].lock);
+    atomic_set(&d->next,0);
+
+    d->misc.minor = MISC_DYNAMIC_MINOR;
+    d->misc.name = name;
+    d->misc.fops = &redisDevFops;
+    mutex_lock(&redisDevicesLock);
+    if (misc_register(&d->misc)) {
+        mutex_unlock(&redisDevicesLock);
+        kfree(d->conns);
+        kfree(d);
+        return NULL;
+    }
+    list_add(&d->node,&redisDevices);
+    mutex_unlock(&redisDevicesLock);
+    return d;
+}
+
+/* Remove the device and close its connections. It must not be open. */
+void redisDevDestroy(redisDev *d) {
+    int j;
+
+    mutex_lock(&redisDevicesLock);
+    list_del(&d->node);
+    misc_deregister(&d->misc);
+    mutex_unlock(&redisDevicesLock);
+    for (j = 0; j < d->nconns; j++)
+        redisFree(d->conns[j].c);
+    kfree(d->conns);
+    kfree(d);
+}
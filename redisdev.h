@@ -0,0 +1,93 @@
+/*
+   A character device sharing the connections of the kernel client with
+   userspace processes, which submit commands in batches through rings in
+   memory shared with the module.
+
+   The device is set up with REDISDEV_SETUP and mapped with mmap() at
+   offset 0. The mapping starts with two struct redisdev_ring: the
+   submission ring at offset 0 and the completion ring at
+   REDISDEV_CQ_OFFSET, each followed (at its 'data' offset) by 'size'
+   bytes of entries. An entry is a struct redisdev_entry followed by 'len'
+   bytes, the whole padded to REDISDEV_ALIGN; entries wrap around the end
+   of a ring, so they may be split in two.
+
+   The process writes commands, encoded in the protocol, to the
+   submission ring and moves its tail, then calls REDISDEV_ENTER. The
+   module sends every command submitted in a single write on one of its
+   connections, and writes one completion per command to the completion
+   ring: 'status' 0 and the reply in the protocol, or a negative errno
+   and no data. Commands that would change the state of the shared
+   connection or block it (SELECT, MULTI, SUBSCRIBE, BLPOP, ...) complete
+   with -EOPNOTSUPP without being sent. The process moves the completion
+   head once it is done with them. 'head' and 'tail' run freely and are
+   taken modulo 'size'.
+ */
+
+#ifndef __REDISDEV_H
+#define __REDISDEV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct redisdev_ring {
+    __u32 head; /* Next byte to consume, moved by the consumer */
+    __u32 tail; /* Next byte to produce, moved by the producer */
+    __u32 size; /* Bytes of entries, a power of two */
+    __u32 data; /* Offset of the entries in the mapping */
+};
+
+struct redisdev_entry {
+    __u32 len;       /* Bytes following the entry */
+    __s32 status;    /* Completion: 0 or a negative errno */
+    __u64 user_data; /* Copied from a command to its completion */
+};
+
+struct redisdev_setup {
+    __u32 sq_size;  /* Bytes of the submission ring, a power of two */
+    __u32 cq_size;  /* Bytes of the completion ring, a power of two */
+    __u32 map_size; /* Set to the length to mmap() */
+};
+
+#define REDISDEV_ALIGN 8
+#define REDISDEV_CQ_OFFSET 64
+#define REDISDEV_MAX_RING (4*1024*1024)
+
+/* Commands sent in a single write by REDISDEV_ENTER */
+#define REDISDEV_MAX_BATCH 1024
+
+#define REDISDEV_IOC_MAGIC 0xE7
+#define REDISDEV_SETUP _IOWR(REDISDEV_IOC_MAGIC, 1, struct redisdev_setup)
+/* Returns the number of completions written */
+#define REDISDEV_ENTER _IO(REDISDEV_IOC_MAGIC, 2)
+
+#ifdef __KERNEL__
+
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <asm/atomic.h>
+
+#include "redisclient.h"
+
+/* A connection of the pool of a device */
+typedef struct redisDevConn {
+    struct mutex lock;
+    redisContext *c; /* NULL until connected, and after a failure */
+} redisDevConn;
+
+typedef struct redisDev {
+    struct miscdevice misc;
+    struct list_head node; /* In the list of devices */
+    redisAddress addr;     /* Server the connections go to */
+    int nconns;
+    redisDevConn *conns;
+    atomic_t next;         /* Connection tried first by the next batch */
+} redisDev;
+
+redisDev *redisDevCreate(const char *name, const char *addr, int port,
+        int nconns);
+void redisDevDestroy(redisDev *d);
+
+#endif /* __KERNEL__ */
+
+#endif /* __REDISDEV_H */
@@ -0,0 +1,145 @@
+/*
+   Coalescing of identical concurrent commands (single-flight).
+
+   When many threads send the same read at once, e.g. right after a hot
+   key expired, the first one sends it and the others wait for its reply
+   instead of sending their own: the server sees one command, and each
+   caller gets a reference to a shared copy of the reply, which it frees
+   with freeReplyObject() as usual and must not modify.
+
+   Commands are matched on their encoding, and only the commands of the
+   allow-list given at creation are coalesced, since only reads may be.
+   The contexts sharing a redisFlight must be connected to the same
+   server and database.
+ */
+
+#include <linux/jhash.h>
+
+#include "redisflight.h"
+
+/* Coalesce the commands named in the NULL terminated 'commands' (matched
+ * regardless of case). Returns NULL if out of memory. */
+redisFlight *redisFlightCreate(const char * const *commands) {
+    redisFlight *f = kzalloc(sizeof(*f), GFP_KERNEL);
+    int j;
+
+    if (f == NULL) return NULL;
+    if ((f->commands = redisCommandListCreate(commands)) == NULL) {
+        kfree(f);
+        return NULL;
+    }
+    spin_lock_init(&f->lock);
+    for (j = 0; j < REDIS_FLIGHT_BUCKETS; j++)
+        INIT_HLIST_HEAD(&f->buckets[j]);
+    atomic_long_set(&f->shared,0);
+    return f;
+}
+
+static void redisFlightPut(redisFlightCall *call) {
+    if (!atomic_dec_and_test(&call->refs)) return;
+    if (call->reply) freeReplyObject(call->reply);
+    sdsfree(call->key);
+    kfree(call);
+}
+
+/* Called with the lock held */
+static redisFlightCall *redisFlightFind(redisFlight *f, const char *cmd,
+        size_t len, u32 hash) {
+    struct hlist_node *pos;
+    redisFlightCall *call;
+
+    hlist_for_each_entry(call,pos,&f->buckets[hash%REDIS_FLIGHT_BUCKETS],node)
+        if (call->hash == hash && sdslen(call->key) == len &&
+            !memcmp(call->key,cmd,len)) return call;
+    return NULL;
+}
+
+/* Join the flight of 'cmd', encoded in 'len' bytes. If the same command is
+ * already on its way, wait for it and return a reference to its reply.
+ * Otherwise return NULL: the caller sends the command itself, and if
+ * '*call' was set, others may wait for it, so the caller hands the reply
+ * to redisFlightDone() as soon as it has it. '*call' stays NULL when the
+ * command is not coalesced, when out of memory, and when the command
+ * waited for failed. */
+redisReply *redisFlightJoin(redisFlight *f, const char *cmd, size_t len,
+        gfp_t gfp, redisFlightCall **call) {
+    redisFlightCall *fc, *new = NULL;
+    redisReply *r = NULL;
+    u32 hash;
+
+    *call = NULL;
+    if (!redisCommandInList(cmd,len,f->commands)) return NULL;
+    hash = jhash(cmd,len,0);
+
+    spin_lock(&f->lock);
+    fc = redisFlightFind(f,cmd,len,hash);
+    if (fc) atomic_inc(&fc->refs);
+    spin_unlock(&f->lock);
+
+    if (fc == NULL) {
+        /* Allocate without the lock, then check again */
+        if ((new = kzalloc(sizeof(*new), gfp)) == NULL) return NULL;
+        if ((new->key = sdsnewlenGfp(cmd,len,gfp)) == NULL) {
+            kfree(new);
+            return NULL;
+        }
+        new->hash = hash;
+        atomic_set(&new->refs,1);
+        init_completion(&new->done);
+
+        spin_lock(&f->lock);
+        fc = redisFlightFind(f,cmd,len,hash);
+        if (fc) {
+            atomic_inc(&fc->refs);
+        } else {
+            hlist_add_head(&new->node,
+                &f->buckets[hash%REDIS_FLIGHT_BUCKETS]);
+        }
+        spin_unlock(&f->lock);
+
+        if (fc == NULL) {
+            *call = new;
+            return NULL;
+        }
+        sdsfree(new->key);
+        kfree(new);
+    }
+
+    wait_for_completion(&fc->done);
+    if (fc->reply) {
+        r = redisReplyGet(fc->reply);
+        atomic_long_inc(&f->shared);
+    }
+    redisFlightPut(fc);
+    return r;
+}
+
+/* Hand 'r', the reply to the command of 'call', to the callers waiting for
+ * it, or NULL if the command failed (they then send it themselves). The
+ * caller keeps 'r'. */
+void redisFlightDone(redisFlight *f, redisFlightCall *call,
+        const redisReply *r, gfp_t gfp) {
+    size_t size;
+
+    spin_lock(&f->lock);
+    hlist_del(&call->node);
+    spin_unlock(&f->lock);
+
+    /* Nobody joins any more: only copy the reply if somebody waits */
+    if (atomic_read(&call->refs) > 1 && r &&
+        !redisIsOOMReply((redisReply*)r))
+        call->reply = redisReplyCopy(r,gfp,&size);
+    complete_all(&call->done);
+    redisFlightPut(call);
+}
+
+/* How many callers got the reply to a command sent by another one */
+unsigned long redisFlightShared(redisFlight *f) {
+    return atomic_long_read(&f->shared);
+}
+
+/* Free 'f'. No context may use it any more. */
+void redisFlightFree(redisFlight *f) {
+    redisCommandListFree(f->commands);
+    kfree(f);
+}
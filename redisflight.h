@@ -0,0 +1,43 @@
+/*
+   Coalescing of identical concurrent commands (single-flight) for the
+   kernel redis client.
+ */
+
+#ifndef __REDISFLIGHT_H
+#define __REDISFLIGHT_H
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <asm/atomic.h>
+
+#include "redisclient.h"
+
+#define REDIS_FLIGHT_BUCKETS 64
+
+/* A command on its way to the server, that other callers wait for */
+typedef struct redisFlightCall {
+    struct hlist_node node;  /* In a bucket, until the reply arrives */
+    sds key;                 /* The command as sent on the wire */
+    u32 hash;
+    atomic_t refs;           /* The caller sending it and the waiters */
+    struct completion done;
+    redisReply *reply;       /* Shared copy, NULL if there is none */
+} redisFlightCall;
+
+typedef struct redisFlight {
+    spinlock_t lock;         /* Protects buckets */
+    struct hlist_head buckets[REDIS_FLIGHT_BUCKETS];
+    sds *commands;           /* NULL terminated, never changed */
+    atomic_long_t shared;    /* Replies received from another's command */
+} redisFlight;
+
+redisFlight *redisFlightCreate(const char * const *commands);
+redisReply *redisFlightJoin(redisFlight *f, const char *cmd, size_t len,
+        gfp_t gfp, redisFlightCall **call);
+void redisFlightDone(redisFlight *f, redisFlightCall *call,
+        const redisReply *r, gfp_t gfp);
+unsigned long redisFlightShared(redisFlight *f);
+void redisFlightFree(redisFlight *f);
+
+#endif /* __REDISFLIGHT_H */
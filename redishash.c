@@ -0,0 +1,151 @@
+/*
+   Key hashing.
+
+   redisKeySlot() places a key on one of the 16384 slots of a Redis
+   Cluster like the servers do: CRC16 (XMODEM) of the key, or of its hash
+   tag, the part between the first '{' and the next '}' when it is not
+   empty, so that "{user1}.name" and "{user1}.mail" share a slot. The
+   CRC is computed 8 bytes at a time (slicing-by-8).
+
+   redisHash64() is XXH64, for local tables: much faster than a CRC on
+   long keys, with a seed to keep tables from being attacked with chosen
+   collisions. It is not compatible with anything on the server side.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <asm/byteorder.h>
+#include <asm/unaligned.h>
+
+#include "redishash.h"
+
+/* redisCrc16Table[k][b]: CRC of byte b followed by k zero bytes. Built
+ * on first use; concurrent first users compute the same values. */
+static u16 redisCrc16Table[8][256];
+static int redisCrc16Ready;
+
+static void redisCrc16Init(void) {
+    unsigned int crc;
+    int i, j, k;
+
+    for (i = 0; i < 256; i++) {
+        crc = i << 8;
+        for (j = 0; j < 8; j++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        redisCrc16Table[0][i] = crc;
+    }
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            crc = redisCrc16Table[k-1][i];
+            redisCrc16Table[k][i] = (crc << 8) ^
+                redisCrc16Table[0][crc >> 8];
+        }
+    }
+    smp_wmb();
+    redisCrc16Ready = 1;
+}
+
+/* CRC16 (XMODEM: polynomial 0x1021, initial value 0), as used by Redis
+ * Cluster */
+u16 redisCrc16(const char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    u16 (*t)[256] = redisCrc16Table;
+    unsigned int crc = 0;
+
+    if (!ACCESS_ONCE(redisCrc16Ready)) redisCrc16Init();
+    smp_rmb();
+    for (; len >= 8; len -= 8, p += 8) {
+        crc = t[7][p[0] ^ (crc >> 8)] ^ t[6][p[1] ^ (crc & 0xff)] ^
+              t[5][p[2]] ^ t[4][p[3]] ^ t[3][p[4]] ^ t[2][p[5]] ^
+              t[1][p[6]] ^ t[0][p[7]];
+    }
+    while (len--)
+        crc = ((crc << 8) ^ t[0][(crc >> 8) ^ *p++]) & 0xffff;
+    return crc;
+}
+
+/* Slot of 'key' in a Redis Cluster */
+unsigned int redisKeySlot(const char *key, size_t keylen) {
+    const char *open = memchr(key,'{',keylen), *close;
+
+    if (open) {
+        close = memchr(open+1,'}',key+keylen-open-1);
+        if (close && close != open+1) {
+            key = open+1;
+            keylen = close-key;
+        }
+    }
+    return redisCrc16(key,keylen) & (REDIS_CLUSTER_SLOTS-1);
+}
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline u64 redisRotl64(u64 x, int r) {
+    return (x << r) | (x >> (64-r));
+}
+
+static inline u64 redisRead64(const unsigned char *p) {
+    return le64_to_cpu(get_unaligned((const u64 *)p));
+}
+
+static inline u64 redisXXHRound(u64 acc, u64 in) {
+    acc += in*XXH_P2;
+    return redisRotl64(acc,31)*XXH_P1;
+}
+
+static inline u64 redisXXHMerge(u64 acc, u64 v) {
+    acc ^= redisXXHRound(0,v);
+    return acc*XXH_P1+XXH_P4;
+}
+
+/* XXH64 of the 'len' bytes at 'buf' */
+u64 redisHash64(const void *buf, size_t len, u64 seed) {
+    const unsigned char *p = buf, *end = p+len;
+    u64 h, v1, v2, v3, v4;
+
+    if (len >= 32) {
+        v1 = seed+XXH_P1+XXH_P2;
+        v2 = seed+XXH_P2;
+        v3 = seed;
+        v4 = seed-XXH_P1;
+        do {
+            v1 = redisXXHRound(v1,redisRead64(p));
+            v2 = redisXXHRound(v2,redisRead64(p+8));
+            v3 = redisXXHRound(v3,redisRead64(p+16));
+            v4 = redisXXHRound(v4,redisRead64(p+24));
+            p += 32;
+        } while (p+32 <= end);
+        h = redisRotl64(v1,1)+redisRotl64(v2,7)+redisRotl64(v3,12)+
+            redisRotl64(v4,18);
+        h = redisXXHMerge(h,v1);
+        h = redisXXHMerge(h,v2);
+        h = redisXXHMerge(h,v3);
+        h = redisXXHMerge(h,v4);
+    } else {
+        h = seed+XXH_P5;
+    }
+    h += len;
+    for (; p+8 <= end; p += 8) {
+        h ^= redisXXHRound(0,redisRead64(p));
+        h = redisRotl64(h,27)*XXH_P1+XXH_P4;
+    }
+    if (p+4 <= end) {
+        h ^= (u64)le32_to_cpu(get_unaligned((const u32 *)p))*XXH_P1;
+        h = redisRotl64(h,23)*XXH_P2+XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p*XXH_P5;
+        h = redisRotl64(h,11)*XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
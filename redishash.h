@@ -0,0 +1,17 @@
+/*
+   Key hashing for the kernel redis client: Redis Cluster hash slots and
+   a fast hash for local tables.
+ */
+
+#ifndef __REDISHASH_H
+#define __REDISHASH_H
+
+#include <linux/types.h>
+
+#define REDIS_CLUSTER_SLOTS 16384
+
+u16 redisCrc16(const char *buf, size_t len);
+unsigned int redisKeySlot(const char *key, size_t keylen);
+u64 redisHash64(const void *buf, size_t len, u64 seed);
+
+#endif /* __REDISHASH_H */
@@ -0,0 +1,184 @@
+/*
+   Bulk loading of key/value pairs, like redis-cli --pipe.
+
+   The pairs are sent as SETs in one continuous pipeline and the replies
+   are read by a second thread while more commands are sent, so the load
+   never waits for a round trip. The commands are encoded into a chain of
+   pages (see redischain.h) and sent in batches, each recorded in a small
+   ring until its replies were read: the bytes of the batches in the ring
+   are those sent and not answered yet, which the sender keeps under the
+   window so that neither side's buffers grow without bound.
+
+   Replies other than errors are only counted, and errors are counted and
+   the first few printed.
+ */
+
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+
+#include "networking_utils.h"
+#include "redischain.h"
+#include "redisload.h"
+
+#ifndef SHUT_RDWR
+#define SHUT_RDWR 2
+#endif
+
+/* Batches that may be waiting for their replies, and in how many
+ * batches the window is sent */
+#define REDIS_LOAD_RING 16
+#define REDIS_LOAD_BATCHES 4
+
+typedef struct redisLoadBatch {
+    int commands;
+    size_t bytes;
+} redisLoadBatch;
+
+typedef struct redisLoad {
+    redisContext *c;
+    spinlock_t lock;       /* Protects the ring and outstanding */
+    redisLoadBatch ring[REDIS_LOAD_RING];
+    int head;              /* Oldest batch in the ring */
+    int count;             /* Batches in the ring */
+    size_t outstanding;    /* Bytes of the batches in the ring */
+    int done;              /* Nothing more will be sent */
+    int failed;            /* The reader lost the connection */
+    wait_queue_head_t wq;  /* Woken up on every change of the above */
+    struct completion finished;
+    unsigned long replies;
+    unsigned long errors;
+} redisLoad;
+
+/* Read the replies of the batches in the ring, oldest first, until the
+ * sender is done and every reply was read */
+static int redisLoadThread(void *data) {
+    redisLoad *l = data;
+    redisLoadBatch b;
+    redisReply *r;
+    int j;
+
+    while (1) {
+        wait_event(l->wq,l->count || l->done);
+        spin_lock(&l->lock);
+        if (l->count == 0) {
+            spin_unlock(&l->lock);
+            break;
+        }
+        b = l->ring[l->head];
+        spin_unlock(&l->lock);
+
+        for (j = 0; j < b.commands; j++) {
+            r = redisReadReply(l->c);
+            if (r == NULL || l->c->err) {
+                if (r) freeReplyObject(r);
+                l->failed = 1;
+                wake_up(&l->wq);
+                goto out;
+            }
+            if (r->type == REDIS_REPLY_ERROR &&
+                ++l->errors <= REDIS_LOAD_REPORT)
+                printk(KERN_WARNING "redis bulk load: %s\n", r->reply);
+            l->replies++;
+            freeReplyObject(r);
+        }
+
+        spin_lock(&l->lock);
+        l->head = (l->head+1)%REDIS_LOAD_RING;
+        l->count--;
+        l->outstanding -= b.bytes;
+        spin_unlock(&l->lock);
+        wake_up(&l->wq);
+    }
+out:
+    /* l is on the sender's stack: not to be touched after this, and the
+     * module may be gone as soon as the sender returns */
+    complete_and_exit(&l->finished,0);
+}
+
+/* Wait until 'len' more bytes fit in the window, or nothing is
+ * outstanding. Returns -1 if the reader failed. */
+static int redisLoadWait(redisLoad *l, size_t len, size_t window) {
+    wait_event(l->wq,l->failed || (l->count < REDIS_LOAD_RING &&
+               (l->outstanding+len <= window || l->outstanding == 0)));
+    return l->failed ? -1 : 0;
+}
+
+/* SET every pair returned by 'next' on 'c', keeping at most about
+ * 'window' bytes sent and not answered yet; a single pair larger than the
+ * window is sent on its own. The counts are stored in 'stats'.
+ *
+ * Returns 0 once every command was sent and answered, error replies
+ * included: see stats->errors. Returns -1 if 'next' aborted the load, if
+ * out of memory or on I/O error, after reading the replies to what was
+ * sent (unless the connection failed). */
+int redisBulkLoad(redisContext *c, redisLoadNext *next, void *privdata,
+        size_t window, redisLoadStats *stats) {
+    const char *argv[3] = { "SET", NULL, NULL };
+    size_t argvlen[3] = { 3, 0, 0 };
+    size_t batch = max_t(size_t, window/REDIS_LOAD_BATCHES, 1);
+    struct task_struct *thread;
+    redisChain *ch;
+    redisLoad l;
+    int rc = 0, more = 1;
+
+    memset(stats,0,sizeof(*stats));
+    if (c->err || (ch = redisChainCreate(c->gfp)) == NULL) return -1;
+    memset(&l,0,sizeof(l));
+    l.c = c;
+    spin_lock_init(&l.lock);
+    init_waitqueue_head(&l.wq);
+    init_completion(&l.finished);
+    thread = kthread_run(redisLoadThread, &l, "redisload");
+    if (IS_ERR(thread)) {
+        redisChainFree(ch);
+        return -1;
+    }
+
+    while (more) {
+        more = next(privdata,&argv[1],&argvlen[1],&argv[2],&argvlen[2]);
+        if (more < 0) {
+            rc = -1;
+            break;
+        }
+        if (more && redisChainAppendCommandArgv(ch,3,argv,argvlen) == -1) {
+            rc = -1;
+            break;
+        }
+        if (ch->commands == 0 || (more && ch->len < batch)) continue;
+
+        if (redisLoadWait(&l,ch->len,window) == -1) {
+            rc = -1;
+            break;
+        }
+        if (redisChainSend(c,ch) == -1) {
+            /* the server may wait for the rest of a command forever: wake
+             * the reader up */
+            c->sock->ops->shutdown(c->sock,SHUT_RDWR);
+            rc = -1;
+            break;
+        }
+        spin_lock(&l.lock);
+        l.ring[(l.head+l.count)%REDIS_LOAD_RING].commands = ch->commands;
+        l.ring[(l.head+l.count)%REDIS_LOAD_RING].bytes = ch->len;
+        l.count++;
+        l.outstanding += ch->len;
+        spin_unlock(&l.lock);
+        wake_up(&l.wq);
+        stats->commands += ch->commands;
+        stats->bytes += ch->len;
+        redisChainReset(ch);
+    }
+
+    spin_lock(&l.lock);
+    l.done = 1;
+    spin_unlock(&l.lock);
+    wake_up(&l.wq);
+    wait_for_completion(&l.finished);
+    redisChainFree(ch);
+
+    stats->replies = l.replies;
+    stats->errors = l.errors;
+    if (l.failed) rc = -1;
+    return rc;
+}
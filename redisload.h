@@ -0,0 +1,30 @@
+/*
+   Bulk loading of key/value pairs, for the kernel redis client.
+ */
+
+#ifndef __REDISLOAD_H
+#define __REDISLOAD_H
+
+#include "redisclient.h"
+
+/* Number of error replies printed by a load, the others are only
+ * counted */
+#define REDIS_LOAD_REPORT 10
+
+/* Store the next pair in *key and *val, which only need to stay valid
+ * until the next call, and return 1; return 0 once there are no more
+ * pairs, or a negative value to abort the load. */
+typedef int redisLoadNext(void *privdata, const char **key, size_t *keylen,
+        const char **val, size_t *vallen);
+
+typedef struct redisLoadStats {
+    unsigned long commands; /* SETs sent */
+    unsigned long replies;  /* Replies read */
+    unsigned long errors;   /* Error replies among them */
+    u64 bytes;              /* Bytes sent */
+} redisLoadStats;
+
+int redisBulkLoad(redisContext *c, redisLoadNext *next, void *privdata,
+        size_t window, redisLoadStats *stats);
+
+#endif /* __REDISLOAD_H */
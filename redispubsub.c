@@ -0,0 +1,296 @@
+/*
+   Pub/Sub subscriber for the kernel redis client.
+
+   A redisSubscriber owns a connection in subscribed mode and a kernel
+   thread that blocks on it. Messages are parsed out of the context input
+   buffer, so every wakeup of the thread dispatches all the messages that
+   arrived with it before going back to the socket.
+ */
+
+#include <linux/jhash.h>
+#include <linux/kthread.h>
+
+#include "redispubsub.h"
+
+#ifndef SHUT_RDWR
+#define SHUT_RDWR 2
+#endif
+
+/* A handler registered for a channel or a pattern */
+struct redisSubHandler {
+    struct hlist_node node;
+    sds name;
+    int pattern;
+    redisMessageFn *fn;
+    void *privdata;
+};
+
+static struct hlist_head *subBucket(redisSubscriber *s, const char *name,
+        size_t len) {
+    return &s->table[jhash(name,len,0) & (REDIS_SUB_HASH_SIZE-1)];
+}
+
+/* Find the handler of a channel (or pattern). Called with s->lock held. */
+static struct redisSubHandler *subLookup(redisSubscriber *s,
+        const char *name, size_t len, int pattern) {
+    struct redisSubHandler *h;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry(h, pos, subBucket(s,name,len), node) {
+        if (h->pattern == pattern && sdslen(h->name) == len &&
+            memcmp(h->name,name,len) == 0)
+            return h;
+    }
+    return NULL;
+}
+
+static void subFreeHandler(struct redisSubHandler *h) {
+    sdsfree(h->name);
+    kfree(h);
+}
+
+/* Hand a "message" or "pmessage" push to its handler, and count the
+ * subscription confirmations for redisSubscriberSync(). Anything else is
+ * ignored. The handler is called without s->lock held, so it may take as
+ * long as it needs, but with s->dispatch held so that an unsubscribe can
+ * wait for it to return. */
+static void redisDispatchMessage(redisSubscriber *s, redisReply *r) {
+    redisReply *name, *channel, *payload;
+    struct redisSubHandler *h;
+    redisMessageFn *fn = NULL;
+    void *privdata = NULL;
+    int pattern;
+    size_t j;
+
+    if (r->type != REDIS_REPLY_ARRAY || r->elements < 3 ||
+        r->element[0]->type != REDIS_REPLY_STRING)
+        return;
+    /* ["subscribe", channel, count], the count being an integer */
+    if (strcmp(r->element[0]->reply,"subscribe") == 0 ||
+        strcmp(r->element[0]->reply,"psubscribe") == 0) {
+        if (atomic_dec_return(&s->pending) == 0) wake_up(&s->wq);
+        return;
+    }
+    for (j = 1; j < r->elements; j++)
+        if (r->element[j]->type != REDIS_REPLY_STRING) return;
+
+    if (r->elements == 3 && strcmp(r->element[0]->reply,"message") == 0) {
+        pattern = 0;
+        name = channel = r->element[1];
+        payload = r->element[2];
+    } else if (r->elements == 4 &&
+               strcmp(r->element[0]->reply,"pmessage") == 0) {
+        pattern = 1;
+        name = r->element[1];
+        channel = r->element[2];
+        payload = r->element[3];
+    } else {
+        return;
+    }
+
+    mutex_lock(&s->dispatch);
+    mutex_lock(&s->lock);
+    h = subLookup(s,name->reply,sdslen(name->reply),pattern);
+    if (h) {
+        fn = h->fn;
+        privdata = h->privdata;
+    }
+    mutex_unlock(&s->lock);
+
+    if (fn) {
+        fn(privdata,channel->reply,sdslen(channel->reply),
+           payload->reply,sdslen(payload->reply));
+        s->messages++;
+    } else {
+        s->dropped++;
+    }
+    mutex_unlock(&s->dispatch);
+}
+
+static int redisSubscriberThread(void *data) {
+    redisSubscriber *s = data;
+    redisReply *r;
+
+    while (!kthread_should_stop()) {
+        r = redisReadReply(s->c);
+        if (r == NULL || s->c->err) {
+            /* connection lost, or shut down by redisSubscriberFree() */
+            if (r) freeReplyObject(r);
+            printk(KERN_INFO "redis subscriber: connection closed\n");
+            s->closed = 1;
+            wake_up(&s->wq);
+            break;
+        }
+        redisDispatchMessage(s,r);
+        freeReplyObject(r);
+    }
+
+    /* kthread_stop() expects the thread to be around until it is called */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/* Connect to the server and start the thread receiving the messages.
+ * Returns NULL on error. */
+redisSubscriber *redisSubscriberCreate(const char *ip, int port) {
+    redisSubscriber *s;
+    redisReply *r;
+    int j;
+
+    if ((s = kmalloc(sizeof(*s), GFP_KERNEL)) == NULL) return NULL;
+    if ((r = redisConnect(&s->c,ip,port)) != NULL) {
+        printk(KERN_ERR "redis subscriber: %s\n", r->reply);
+        freeReplyObject(r);
+        kfree(s);
+        return NULL;
+    }
+    mutex_init(&s->lock);
+    mutex_init(&s->dispatch);
+    atomic_set(&s->pending,0);
+    s->closed = 0;
+    init_waitqueue_head(&s->wq);
+    for (j = 0; j < REDIS_SUB_HASH_SIZE; j++)
+        INIT_HLIST_HEAD(&s->table[j]);
+    s->messages = 0;
+    s->dropped = 0;
+
+    s->thread = kthread_run(redisSubscriberThread, s, "redissub");
+    if (IS_ERR(s->thread)) {
+        redisFree(s->c);
+        kfree(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* Stop the thread, close the connection and free all the handlers. */
+void redisSubscriberFree(redisSubscriber *s) {
+    struct redisSubHandler *h;
+    struct hlist_node *pos, *n;
+    int j;
+
+    /* wake the thread up from recvmsg() */
+    s->c->sock->ops->shutdown(s->c->sock, SHUT_RDWR);
+    kthread_stop(s->thread);
+
+    for (j = 0; j < REDIS_SUB_HASH_SIZE; j++) {
+        hlist_for_each_entry_safe(h, pos, n, &s->table[j], node) {
+            hlist_del(&h->node);
+            subFreeHandler(h);
+        }
+    }
+    redisFree(s->c);
+    kfree(s);
+}
+
+/* Send a (P)(UN)SUBSCRIBE. The context belongs to the thread reading the
+ * pushes: the command is encoded here and written straight to the socket,
+ * so that no field of the context is touched from two threads. Called with
+ * s->lock held, which serialises the writes. */
+static int subSend(redisSubscriber *s, const char *cmdname,
+        const char *name) {
+    const char *argv[2] = { cmdname, name };
+    sds cmd = redisCatCommandArgv(sdsempty(),2,argv,NULL,GFP_KERNEL);
+    int err;
+
+    if (cmd == NULL) return -1;
+    err = kernel_sockWrite(s->c->sock,cmd,sdslen(cmd)) == (int)sdslen(cmd) ?
+        0 : -1;
+    sdsfree(cmd);
+    return err;
+}
+
+static int redisSubscribeGeneric(redisSubscriber *s, const char *cmdname,
+        const char *name, int pattern, redisMessageFn *fn, void *privdata) {
+    size_t len = strlen(name);
+    struct redisSubHandler *h;
+    int err = -1;
+
+    if ((h = kmalloc(sizeof(*h), GFP_KERNEL)) == NULL) return -1;
+    if ((h->name = sdsnewlen(name,len)) == NULL) {
+        kfree(h);
+        return -1;
+    }
+    h->pattern = pattern;
+    h->fn = fn;
+    h->privdata = privdata;
+
+    mutex_lock(&s->lock);
+    if (subLookup(s,name,len,pattern) == NULL) {
+        hlist_add_head(&h->node,subBucket(s,name,len));
+        /* the confirmation is pushed back like a message */
+        atomic_inc(&s->pending);
+        err = subSend(s,cmdname,name);
+        if (err) {
+            hlist_del(&h->node);
+            atomic_dec(&s->pending);
+        }
+    }
+    mutex_unlock(&s->lock);
+
+    if (err) subFreeHandler(h);
+    return err;
+}
+
+static int redisUnsubscribeGeneric(redisSubscriber *s, const char *cmdname,
+        const char *name, int pattern) {
+    struct redisSubHandler *h;
+    int err = -1, found;
+
+    mutex_lock(&s->lock);
+    h = subLookup(s,name,strlen(name),pattern);
+    if ((found = (h != NULL))) {
+        hlist_del(&h->node);
+        subFreeHandler(h);
+        err = subSend(s,cmdname,name);
+    }
+    mutex_unlock(&s->lock);
+
+    /* wait for a message of this handler being dispatched, unless called
+     * from a handler (in which case nothing else is being dispatched) */
+    if (found && current != s->thread) {
+        mutex_lock(&s->dispatch);
+        mutex_unlock(&s->dispatch);
+    }
+    return err;
+}
+
+/* Subscribe to 'channel', calling 'fn' with 'privdata' for every message
+ * published to it. Returns 0 on success, -1 on error or if the channel
+ * already has a handler. */
+int redisSubscribe(redisSubscriber *s, const char *channel,
+        redisMessageFn *fn, void *privdata) {
+    return redisSubscribeGeneric(s,"SUBSCRIBE",channel,0,fn,privdata);
+}
+
+/* Like redisSubscribe() for all the channels matching 'pattern'. */
+int redisPSubscribe(redisSubscriber *s, const char *pattern,
+        redisMessageFn *fn, void *privdata) {
+    return redisSubscribeGeneric(s,"PSUBSCRIBE",pattern,1,fn,privdata);
+}
+
+/* Stop delivering the messages of 'channel'. Once this returns the handler
+ * is not running and will not be called again, so its privdata can be
+ * freed. Returns 0 on success, -1 on error or if there was no handler. */
+int redisUnsubscribe(redisSubscriber *s, const char *channel) {
+    return redisUnsubscribeGeneric(s,"UNSUBSCRIBE",channel,0);
+}
+
+int redisPUnsubscribe(redisSubscriber *s, const char *pattern) {
+    return redisUnsubscribeGeneric(s,"PUNSUBSCRIBE",pattern,1);
+}
+
+/* Wait until the server confirmed all the subscriptions made so far, that
+ * is until messages published to them are sure to be delivered. Waits at
+ * most 'timeout' jiffies. Returns 0 on success and -1 on timeout or if the
+ * connection was lost. Must not be called from a handler. */
+int redisSubscriberSync(redisSubscriber *s, long timeout) {
+    wait_event_timeout(s->wq, atomic_read(&s->pending) == 0 || s->closed,
+            timeout);
+    return (atomic_read(&s->pending) == 0 && !s->closed) ? 0 : -1;
+}
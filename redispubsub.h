@@ -0,0 +1,51 @@
+/*
+   Pub/Sub subscriber for the kernel redis client.
+ */
+
+#ifndef __REDISPUBSUB_H
+#define __REDISPUBSUB_H
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <asm/atomic.h>
+
+#include "redisclient.h"
+
+/* Number of buckets of the channel -> handler table (power of two) */
+#define REDIS_SUB_HASH_SIZE 64
+
+/* Called from the subscriber thread for every message published to a
+ * channel (or matching a pattern) the handler was registered for. The
+ * buffers are only valid for the duration of the call. */
+typedef void redisMessageFn(void *privdata, const char *channel,
+        size_t channellen, const char *msg, size_t msglen);
+
+/* A connection in subscribed mode. A dedicated kernel thread reads the
+ * pushed messages and dispatches them to the handlers in 'table'; it is
+ * the only user of 'c', the other threads only write to its socket. */
+typedef struct redisSubscriber {
+    redisContext *c;
+    struct task_struct *thread;
+    struct mutex lock;      /* Protects table and writes to the socket */
+    struct mutex dispatch;  /* Held by the thread while calling a handler */
+    struct hlist_head table[REDIS_SUB_HASH_SIZE];
+    atomic_t pending;       /* Subscriptions not confirmed yet */
+    int closed;             /* The thread lost the connection */
+    wait_queue_head_t wq;   /* Woken up by confirmations and on close */
+    unsigned long messages; /* Messages dispatched to a handler */
+    unsigned long dropped;  /* Messages with no handler registered */
+} redisSubscriber;
+
+redisSubscriber *redisSubscriberCreate(const char *ip, int port);
+void redisSubscriberFree(redisSubscriber *s);
+int redisSubscribe(redisSubscriber *s, const char *channel,
+        redisMessageFn *fn, void *privdata);
+int redisPSubscribe(redisSubscriber *s, const char *pattern,
+        redisMessageFn *fn, void *privdata);
+int redisUnsubscribe(redisSubscriber *s, const char *channel);
+int redisPUnsubscribe(redisSubscriber *s, const char *pattern);
+int redisSubscriberSync(redisSubscriber *s, long timeout);
+
+#endif /* __REDISPUBSUB_H */
@@ -0,0 +1,175 @@
+/*
+   Cursor based iteration for the kernel redis client.
+
+   Each page is a [cursor, [items]] reply. As soon as a page is read the
+   request for the next one is sent, so the server works on it while the
+   caller consumes the current page and the round trip is mostly hidden.
+   The flip side is that the connection is busy until the iteration ends
+   or the iterator is freed: no other command may be sent meanwhile.
+ */
+
+#include "redisscan.h"
+
+static const char *redisScanCommands[] = { "SCAN", "HSCAN", "SSCAN", "ZSCAN" };
+
+/* Create an iterator over the keyspace of the selected database
+ * (REDIS_SCAN_KEYS) or over the key 'key' of length 'keylen'. MATCH, COUNT
+ * and TYPE can be set before the first call to redisScanNext(). Returns
+ * NULL if out of memory. */
+redisScanIter *redisScanCreate(redisContext *c, int type, const char *key,
+        size_t keylen) {
+    redisScanIter *it = kzalloc(sizeof(*it), GFP_KERNEL);
+
+    if (it == NULL) return NULL;
+    it->c = c;
+    it->type = type;
+    if ((type != REDIS_SCAN_KEYS &&
+         (it->key = sdsnewlen(key,keylen)) == NULL) ||
+        (it->cursor = sdsnew("0")) == NULL) {
+        if (it->key) sdsfree(it->key);
+        kfree(it);
+        return NULL;
+    }
+    return it;
+}
+
+/* Only return the items matching the glob-style 'pattern'. Returns -1 if
+ * out of memory, the previous pattern (if any) being kept. */
+int redisScanSetMatch(redisScanIter *it, const char *pattern) {
+    sds match = sdsnew(pattern);
+
+    if (match == NULL) return -1;
+    if (it->match) sdsfree(it->match);
+    it->match = match;
+    return 0;
+}
+
+/* Ask for about 'count' items per page: larger pages mean fewer round
+ * trips, at the price of more memory and a longer time on the server. */
+void redisScanSetCount(redisScanIter *it, long count) {
+    it->count = count;
+}
+
+/* Only return keys of the given type (SCAN only, Redis 6 or later).
+ * Returns -1 if out of memory, like redisScanSetMatch(). */
+int redisScanSetType(redisScanIter *it, const char *type) {
+    sds filter = sdsnew(type);
+
+    if (filter == NULL) return -1;
+    if (it->filter) sdsfree(it->filter);
+    it->filter = filter;
+    return 0;
+}
+
+/* Request the page at it->cursor */
+static int redisScanSend(redisScanIter *it) {
+    const char *argv[9];
+    size_t argvlen[9];
+    char countbuf[SDS_LLSTR_SIZE];
+    int argc = 0;
+
+    argv[argc] = redisScanCommands[it->type];
+    argvlen[argc++] = strlen(argv[0]);
+    if (it->key) {
+        argv[argc] = it->key;
+        argvlen[argc++] = sdslen(it->key);
+    }
+    argv[argc] = it->cursor;
+    argvlen[argc++] = sdslen(it->cursor);
+    if (it->match) {
+        argv[argc] = "MATCH";
+        argvlen[argc++] = 5;
+        argv[argc] = it->match;
+        argvlen[argc++] = sdslen(it->match);
+    }
+    if (it->count > 0) {
+        argv[argc] = "COUNT";
+        argvlen[argc++] = 5;
+        argv[argc] = countbuf;
+        argvlen[argc++] = snprintf(countbuf,sizeof(countbuf),"%ld",it->count);
+    }
+    if (it->filter && it->type == REDIS_SCAN_KEYS) {
+        argv[argc] = "TYPE";
+        argvlen[argc++] = 4;
+        argv[argc] = it->filter;
+        argvlen[argc++] = sdslen(it->filter);
+    }
+    if (redisSendCommandArgv(it->c,argc,argv,argvlen) == -1) return -1;
+    it->inflight = 1;
+    return 0;
+}
+
+/* Read the requested page and make it the current one. Returns -1 on
+ * error reply or connection failure, or if out of memory: the cursor is
+ * then left as it was, so that the page is requested again by the next
+ * call to redisScanNext(). */
+static int redisScanRecv(redisScanIter *it) {
+    redisReply *r = redisReadReply(it->c);
+    sds cursor;
+
+    it->inflight = 0;
+    if (r == NULL) return -1;
+    if (it->c->err || r->type != REDIS_REPLY_ARRAY || r->elements != 2 ||
+        r->element[0]->type != REDIS_REPLY_STRING ||
+        r->element[1]->type != REDIS_REPLY_ARRAY ||
+        (cursor = sdsdup(r->element[0]->reply)) == NULL) {
+        freeReplyObject(r);
+        return -1;
+    }
+    sdsfree(it->cursor);
+    it->cursor = cursor;
+    it->done = !strcmp(it->cursor,"0");
+    if (it->page) freeReplyObject(it->page);
+    it->page = r;
+    it->pos = 0;
+    return 0;
+}
+
+/* Return the next item of the iteration in *item. For HSCAN and ZSCAN the
+ * value (or score) that goes with it is stored in *val, which is set to
+ * NULL otherwise. Both stay valid until the next call or redisScanFree().
+ *
+ * As with SCAN itself, an item may be returned more than once if the
+ * keyspace changes during the iteration.
+ *
+ * Returns 1 if an item was returned, 0 at the end of the iteration and -1
+ * on error (the iteration can not go on, unless the error was a failed
+ * allocation while the connection is fine: calling again then retries). */
+int redisScanNext(redisScanIter *it, redisReply **item, redisReply **val) {
+    int pairs = (it->type == REDIS_SCAN_HASH || it->type == REDIS_SCAN_ZSET);
+    redisReply *items;
+
+    while (1) {
+        if (it->page) {
+            items = it->page->element[1];
+            if (it->pos+pairs < items->elements) {
+                *item = items->element[it->pos++];
+                *val = pairs ? items->element[it->pos++] : NULL;
+                return 1;
+            }
+        }
+        if (!it->inflight) {
+            /* either the end, or the very first page */
+            if (it->done) return 0;
+            if (redisScanSend(it) == -1) return -1;
+        }
+        if (redisScanRecv(it) == -1) return -1;
+        /* prefetch the next page */
+        if (!it->done && redisScanSend(it) == -1) return -1;
+    }
+}
+
+/* Free the iterator. A page still in flight is read and dropped, so the
+ * connection can be used again afterwards. */
+void redisScanFree(redisScanIter *it) {
+    redisReply *r;
+
+    if (it->inflight && (r = redisReadReply(it->c)) != NULL)
+        freeReplyObject(r);
+    if (it->page) freeReplyObject(it->page);
+    if (it->key) sdsfree(it->key);
+    if (it->match) sdsfree(it->match);
+    if (it->filter) sdsfree(it->filter);
+    sdsfree(it->cursor);
+    kfree(it);
+}
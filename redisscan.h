@@ -0,0 +1,42 @@
+/*
+   Cursor based iteration (SCAN, HSCAN, SSCAN, ZSCAN) for the kernel redis
+   client.
+ */
+
+#ifndef __REDISSCAN_H
+#define __REDISSCAN_H
+
+#include "redisclient.h"
+
+/* What a redisScanIter walks over */
+#define REDIS_SCAN_KEYS 0 /* SCAN: the keys of the database */
+#define REDIS_SCAN_HASH 1 /* HSCAN: field/value pairs of a hash */
+#define REDIS_SCAN_SET 2  /* SSCAN: members of a set */
+#define REDIS_SCAN_ZSET 3 /* ZSCAN: member/score pairs of a sorted set */
+
+/* An iteration in progress. Items are returned one at a time out of the
+ * current page, while the request for the next page is already on its
+ * way: only one page is held at a time, however large the keyspace. */
+typedef struct redisScanIter {
+    redisContext *c;
+    int type;          /* REDIS_SCAN_* */
+    sds key;           /* Key walked by HSCAN/SSCAN/ZSCAN */
+    sds match;         /* MATCH pattern, or NULL */
+    sds filter;        /* TYPE filter (SCAN only), or NULL */
+    long count;        /* COUNT hint, or 0 for the server default */
+    sds cursor;        /* Cursor of the next page */
+    int inflight;      /* The next page was requested and not read yet */
+    int done;          /* The server returned cursor 0 */
+    redisReply *page;  /* Current page */
+    size_t pos;        /* Next item of the page */
+} redisScanIter;
+
+redisScanIter *redisScanCreate(redisContext *c, int type, const char *key,
+        size_t keylen);
+int redisScanSetMatch(redisScanIter *it, const char *pattern);
+void redisScanSetCount(redisScanIter *it, long count);
+int redisScanSetType(redisScanIter *it, const char *type);
+int redisScanNext(redisScanIter *it, redisReply **item, redisReply **val);
+void redisScanFree(redisScanIter *it);
+
+#endif /* __REDISSCAN_H */
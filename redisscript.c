@@ -0,0 +1,165 @@
+/*
+   Lua scripts for the kernel redis client.
+
+   A script is registered once and its SHA1 computed with the kernel crypto
+   API. It is then run with EVALSHA, which costs a single round trip and
+   does not send the body. If the server answers NOSCRIPT (it restarted,
+   the cache was flushed, or this is another server) the same call is
+   retried with EVAL, which also caches the script on the server.
+ */
+
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/scatterlist.h>
+
+#include "redisscript.h"
+
+/* Store the hex SHA1 digest of 'len' bytes at 'buf' in 'hex'. 'buf' must
+ * be kmalloc()ed, as the crypto API gets it through a scatterlist. */
+static int redisScriptSha1(const char *buf, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    struct hash_desc desc;
+    struct scatterlist sg;
+    u8 digest[REDIS_SCRIPT_SHA_LEN/2];
+    int j, err;
+
+    desc.tfm = crypto_alloc_hash("sha1", 0, CRYPTO_ALG_ASYNC);
+    if (IS_ERR(desc.tfm)) return PTR_ERR(desc.tfm);
+    desc.flags = 0;
+    sg_init_one(&sg,buf,len);
+    err = crypto_hash_digest(&desc,&sg,len,digest);
+    crypto_free_hash(desc.tfm);
+    if (err) return err;
+
+    for (j = 0; j < REDIS_SCRIPT_SHA_LEN/2; j++) {
+        hex[j*2] = digits[digest[j] >> 4];
+        hex[j*2+1] = digits[digest[j] & 0xf];
+    }
+    hex[REDIS_SCRIPT_SHA_LEN] = '\0';
+    return 0;
+}
+
+void redisScriptRegistryInit(redisScriptRegistry *reg) {
+    mutex_init(&reg->lock);
+    INIT_LIST_HEAD(&reg->scripts);
+}
+
+/* Free all the scripts of 'reg' */
+void redisScriptRegistryFree(redisScriptRegistry *reg) {
+    redisScript *s, *next;
+
+    list_for_each_entry_safe(s, next, &reg->scripts, node) {
+        list_del(&s->node);
+        sdsfree(s->body);
+        kfree(s);
+    }
+}
+
+/* Register the script 'body' of 'len' bytes, or return the script already
+ * registered with the same body. The script stays valid until
+ * redisScriptRegistryFree(). Returns NULL on error. */
+redisScript *redisScriptRegister(redisScriptRegistry *reg, const char *body,
+        size_t len) {
+    redisScript *s, *old;
+
+    if ((s = kmalloc(sizeof(*s), GFP_KERNEL)) == NULL) return NULL;
+    if ((s->body = sdsnewlen(body,len)) == NULL) {
+        kfree(s);
+        return NULL;
+    }
+    if (redisScriptSha1(s->body,len,s->sha) != 0) {
+        printk(KERN_ERR "redis script: sha1 not available\n");
+        sdsfree(s->body);
+        kfree(s);
+        return NULL;
+    }
+
+    mutex_lock(&reg->lock);
+    list_for_each_entry(old, &reg->scripts, node) {
+        if (!strcmp(old->sha,s->sha)) {
+            mutex_unlock(&reg->lock);
+            sdsfree(s->body);
+            kfree(s);
+            return old;
+        }
+    }
+    list_add_tail(&s->node,&reg->scripts);
+    mutex_unlock(&reg->lock);
+    return s;
+}
+
+/* Load all the scripts of 'reg' into the server with SCRIPT LOAD, in a
+ * single round trip. Meant to be called after (re)connecting, so that the
+ * first calls do not each pay for a NOSCRIPT reply and a retry. Returns 0
+ * on success and -1 if any script failed to load. */
+int redisScriptLoadAll(redisContext *c, redisScriptRegistry *reg) {
+    const char *argv[3] = { "SCRIPT", "LOAD", NULL };
+    size_t argvlen[3] = { 6, 4, 0 };
+    redisScript *s;
+    redisReply *r;
+    int sent = 0, err = 0;
+
+    mutex_lock(&reg->lock);
+    list_for_each_entry(s, &reg->scripts, node) {
+        argv[2] = s->body;
+        argvlen[2] = sdslen(s->body);
+        if (redisSendCommandArgv(c,3,argv,argvlen) == -1) break;
+        sent++;
+    }
+    /* the replies come back in the same order */
+    list_for_each_entry(s, &reg->scripts, node) {
+        if (sent-- == 0) break;
+        r = redisReadReply(c);
+        if (r == NULL || r->type != REDIS_REPLY_STRING ||
+            strcmp(r->reply,s->sha) != 0)
+            err = -1;
+        if (r) freeReplyObject(r);
+    }
+    mutex_unlock(&reg->lock);
+    return (err || c->err) ? -1 : 0;
+}
+
+static int redisIsNoScript(redisReply *r) {
+    return r && r->type == REDIS_REPLY_ERROR && !strncmp(r->reply,"NOSCRIPT",8);
+}
+
+/* Run the script 's' with the 'argc' arguments in 'argv' (of lengths
+ * 'argvlen', or nul terminated if NULL), the first 'numkeys' of which are
+ * key names. This is EVALSHA, falling back to EVAL if the server does not
+ * know the script. Returns the reply of the script, or the reply of
+ * redisIsOOMReply() if out of memory. */
+redisReply *redisEvalScript(redisContext *c, redisScript *s, int numkeys,
+        int argc, const char **argv, const size_t *argvlen) {
+    char numbuf[SDS_LLSTR_SIZE];
+    const char **av;
+    size_t *avlen;
+    redisReply *r;
+    int j;
+
+    av = kmalloc((argc+3)*(sizeof(*av)+sizeof(*avlen)), c->gfp|__GFP_NOWARN);
+    if (av == NULL) return redisOOMReplyFor(c);
+    avlen = (size_t *)(av+argc+3);
+
+    av[0] = "EVALSHA";
+    avlen[0] = 7;
+    av[1] = s->sha;
+    avlen[1] = REDIS_SCRIPT_SHA_LEN;
+    av[2] = numbuf;
+    avlen[2] = snprintf(numbuf,sizeof(numbuf),"%d",numkeys);
+    for (j = 0; j < argc; j++) {
+        av[j+3] = argv[j];
+        avlen[j+3] = argvlen ? argvlen[j] : strlen(argv[j]);
+    }
+
+    r = redisCommandArgv(c,argc+3,av,avlen);
+    if (redisIsNoScript(r)) {
+        freeReplyObject(r);
+        av[0] = "EVAL";
+        avlen[0] = 4;
+        av[1] = s->body;
+        avlen[1] = sdslen(s->body);
+        r = redisCommandArgv(c,argc+3,av,avlen);
+    }
+    kfree(av);
+    return r;
+}
@@ -0,0 +1,38 @@
+/*
+   Lua scripts for the kernel redis client, run by digest with EVALSHA.
+ */
+
+#ifndef __REDISSCRIPT_H
+#define __REDISSCRIPT_H
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#include "redisclient.h"
+
+/* Length of the hex SHA1 digest naming a script */
+#define REDIS_SCRIPT_SHA_LEN 40
+
+/* A registered script. 'sha' is what the server knows it by. */
+typedef struct redisScript {
+    struct list_head node;
+    sds body;
+    char sha[REDIS_SCRIPT_SHA_LEN+1];
+} redisScript;
+
+/* The scripts used by a module. Scripts are run by digest, so their body
+ * only goes over the wire when a server does not have it cached. */
+typedef struct redisScriptRegistry {
+    struct mutex lock;          /* Protects scripts */
+    struct list_head scripts;
+} redisScriptRegistry;
+
+void redisScriptRegistryInit(redisScriptRegistry *reg);
+void redisScriptRegistryFree(redisScriptRegistry *reg);
+redisScript *redisScriptRegister(redisScriptRegistry *reg, const char *body,
+        size_t len);
+int redisScriptLoadAll(redisContext *c, redisScriptRegistry *reg);
+redisReply *redisEvalScript(redisContext *c, redisScript *s, int numkeys,
+        int argc, const char **argv, const size_t *argvlen);
+
+#endif /* __REDISSCRIPT_H */
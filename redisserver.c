@@ -0,0 +1,762 @@
+/*
+   A small in-kernel server speaking the Redis protocol.
+
+   There is one worker thread per online CPU, bound to it. A worker owns
+   the connections it accepted and never blocks on any of them: socket
+   callbacks put the connections that can make progress on the 'ready'
+   list of their worker and wake it up. With SO_REUSEPORT every worker has
+   its own listening socket and the kernel spreads the connections;
+   otherwise a single listener hands every new connection to the worker
+   with the fewest.
+
+   Requests come from untrusted peers, so rather than with the client's
+   recursive redisReadReply() they are parsed by redisRequestParse(),
+   which only accepts a flat multi bulk of bulk strings within the
+   REDIS_SERVER_MAX_* limits. Replies to pipelined requests are collected
+   and sent together once the input buffer has been drained; what the
+   socket does not take is kept until it has room again, and no more
+   requests are read from that connection in the meantime.
+ */
+
+#include <linux/jhash.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <net/sock.h>
+
+#include "redisserver.h"
+
+/* An entry of the key space */
+struct redisStoreEntry {
+    struct hlist_node node;
+    sds key;
+    sds val;
+};
+
+/* Longest "*<count>\r\n" or "$<len>\r\n" line accepted */
+#define REDIS_REQUEST_MAX_LINE 32
+
+/* A request being received: the arguments parsed so far, and where the
+ * parser stands. The parser resumes from this state when more input
+ * arrives, so arguments are never parsed twice. */
+typedef struct redisRequest {
+    int argc;          /* Complete arguments in argv */
+    int argcap;        /* Slots allocated in argv */
+    sds *argv;
+    long multibulklen; /* Arguments announced, 0 before the '*' line */
+    long bulklen;      /* Length of argv[argc], -1 before its '$' line */
+    size_t size;       /* Memory taken by the request so far */
+} redisRequest;
+
+/* Reads done on a connection before giving the other ones a turn */
+#define REDIS_SERVER_READS_PER_PASS 16
+
+/* Replies buffered before they are sent even if more requests are in */
+#define REDIS_SERVER_OUTBUF_FLUSH REDIS_IOBUF_LEN
+
+/* A connection, owned by a worker */
+struct redisServerConn {
+    struct list_head node;  /* In worker->conns */
+    struct list_head ready; /* In worker->ready when queued is set */
+    int queued;
+    redisServerWorker *worker;
+    redisContext *c;
+    redisRequest req;
+    sds out;                /* Replies not sent yet */
+    size_t opos;            /* Bytes of out already sent */
+    void (*saved_data_ready)(struct sock *sk, int bytes);
+    void (*saved_write_space)(struct sock *sk);
+    void (*saved_state_change)(struct sock *sk);
+};
+
+/* Free the arguments of 'req' and get it ready for the next request */
+static void redisRequestReset(redisRequest *req) {
+    int j;
+
+    /* a partially received argument sits past argc */
+    for (j = 0; j < req->argc+(req->bulklen != -1); j++)
+        sdsfree(req->argv[j]);
+    kfree(req->argv);
+    req->argc = req->argcap = 0;
+    req->argv = NULL;
+    req->multibulklen = 0;
+    req->bulklen = -1;
+    req->size = 0;
+}
+
+/* Consume the "<type><number>\r\n" line at the start of the unparsed
+ * input, storing the number in *value. Returns 1 on success, 0 if the line
+ * is not complete yet and -1 on error, setting *err. */
+static int redisRequestLine(redisContext *c, char type, long long *value,
+        const char **err) {
+    char *p = c->ibuf+c->ipos, *nl;
+    size_t avail = sdslen(c->ibuf)-c->ipos;
+
+    nl = memchr(p,'\n',min_t(size_t,avail,REDIS_REQUEST_MAX_LINE));
+    if (nl == NULL) {
+        if (avail < REDIS_REQUEST_MAX_LINE) return 0;
+        *err = "too big count string";
+        return -1;
+    }
+    if (*p != type) {
+        *err = (type == '*') ? "expected '*'" : "expected '$'";
+        return -1;
+    }
+    if (nl-p < 2 || nl[-1] != '\r' ||
+        redisParseLongLong(p+1,nl-p-2,value) == -1) {
+        *err = (type == '*') ? "invalid multibulk length" :
+                               "invalid bulk length";
+        return -1;
+    }
+    c->ipos += nl-p+1;
+    return 1;
+}
+
+/* Parse as much of a request as the input buffer of 'c' holds into 'req'.
+ * The input is consumed as it is parsed: argument payloads are copied out
+ * of the buffer even when incomplete, so it never holds more than a
+ * read's worth of data. Returns 1 once req->argc arguments are complete,
+ * 0 if more input is needed and -1 on a protocol error, pointing *err to
+ * its description. */
+static int redisRequestParse(redisRequest *req, redisContext *c,
+        const char **err) {
+    long long value;
+    size_t avail, n;
+    sds arg;
+    int ret;
+
+    while (req->multibulklen == 0) {
+        ret = redisRequestLine(c,'*',&value,err);
+        if (ret != 1) return ret;
+        /* "*0" and "*-1" are empty requests, skipped like Redis does */
+        if (value > REDIS_SERVER_MAX_ARGS) {
+            *err = "invalid multibulk length";
+            return -1;
+        }
+        if (value > 0) req->multibulklen = value;
+    }
+
+    while (req->argc < req->multibulklen) {
+        if (req->bulklen == -1) {
+            ret = redisRequestLine(c,'$',&value,err);
+            if (ret != 1) return ret;
+            if (value < 0 || value > REDIS_SERVER_MAX_BULK) {
+                *err = "invalid bulk length";
+                return -1;
+            }
+            req->size += sizeof(struct sdshdr)+value+1+sizeof(sds);
+            if (req->size > REDIS_SERVER_MAX_QUERYBUF) {
+                *err = "request too large";
+                return -1;
+            }
+            if (req->argc == req->argcap) {
+                int cap = min_t(long,req->multibulklen,
+                                req->argcap ? req->argcap*2 : 16);
+                sds *argv = krealloc(req->argv,sizeof(sds)*cap,GFP_KERNEL);
+
+                if (argv == NULL) {
+                    *err = "out of memory";
+                    return -1;
+                }
+                req->argv = argv;
+                req->argcap = cap;
+            }
+            /* allocated in full now so that appending never reallocates */
+            if ((arg = sdsnewlen(NULL,value)) == NULL) {
+                *err = "out of memory";
+                return -1;
+            }
+            sdsIncrLen(arg,-(long)value);
+            req->argv[req->argc] = arg;
+            req->bulklen = value;
+        }
+
+        arg = req->argv[req->argc];
+        avail = sdslen(c->ibuf)-c->ipos;
+        n = min_t(size_t,avail,req->bulklen-sdslen(arg));
+        req->argv[req->argc] = arg = sdscatlen(arg,c->ibuf+c->ipos,n);
+        c->ipos += n;
+        if ((long)sdslen(arg) < req->bulklen || avail-n < 2) return 0;
+        if (c->ibuf[c->ipos] != '\r' || c->ibuf[c->ipos+1] != '\n') {
+            *err = "expected CRLF after the bulk";
+            return -1;
+        }
+        c->ipos += 2;
+        req->argc++;
+        req->bulklen = -1;
+    }
+    return 1;
+}
+
+static redisStore *redisStoreCreate(void) {
+    redisStore *st;
+    int j;
+
+    if ((st = kmalloc(sizeof(*st), GFP_KERNEL)) == NULL) return NULL;
+    for (j = 0; j < REDIS_STORE_BUCKETS; j++)
+        INIT_HLIST_HEAD(&st->buckets[j]);
+    for (j = 0; j < REDIS_STORE_LOCKS; j++)
+        mutex_init(&st->locks[j]);
+    return st;
+}
+
+static void redisStoreFreeEntry(struct redisStoreEntry *e) {
+    sdsfree(e->key);
+    sdsfree(e->val);
+    kfree(e);
+}
+
+static void redisStoreFree(redisStore *st) {
+    struct redisStoreEntry *e;
+    struct hlist_node *pos, *n;
+    int j;
+
+    for (j = 0; j < REDIS_STORE_BUCKETS; j++) {
+        hlist_for_each_entry_safe(e, pos, n, &st->buckets[j], node) {
+            hlist_del(&e->node);
+            redisStoreFreeEntry(e);
+        }
+    }
+    kfree(st);
+}
+
+static u32 redisStoreHash(sds key) {
+    return jhash(key,sdslen(key),0) & (REDIS_STORE_BUCKETS-1);
+}
+
+static struct mutex *redisStoreLock(redisStore *st, u32 hash) {
+    return &st->locks[hash & (REDIS_STORE_LOCKS-1)];
+}
+
+/* Find 'key' in its bucket. Called with the lock of the bucket held. */
+static struct redisStoreEntry *redisStoreLookup(redisStore *st, u32 hash,
+        sds key) {
+    struct redisStoreEntry *e;
+    struct hlist_node *pos;
+
+    hlist_for_each_entry(e, pos, &st->buckets[hash], node)
+        if (sdscmp(e->key,key) == 0) return e;
+    return NULL;
+}
+
+/* Make room for 'len' more bytes of replies in 'out', so that appending
+ * them can not fail. Returns NULL, with 'out' freed, if out of memory: the
+ * connection is then closed. */
+static sds redisServerRoom(sds out, size_t len) {
+    sds n;
+
+    if ((n = sdsMakeRoomFor(out,len)) == NULL) sdsfree(out);
+    return n;
+}
+
+/* Append the bulk reply to GET 'key' to 'out'. Returns NULL, with 'out'
+ * freed, if out of memory. */
+static sds redisStoreGet(redisStore *st, sds key, sds out) {
+    u32 hash = redisStoreHash(key);
+    struct redisStoreEntry *e;
+
+    mutex_lock(redisStoreLock(st,hash));
+    e = redisStoreLookup(st,hash,key);
+    /* the appends below can not fail once there is room for them */
+    if ((out = redisServerRoom(out,e ? sdslen(e->val)+32 : 5)) != NULL &&
+        e) {
+        out = sdscatlen(out,"$",1);
+        out = sdscatlonglong(out,sdslen(e->val));
+        out = sdscatlen(out,"\r\n",2);
+        out = sdscatlen(out,e->val,sdslen(e->val));
+        out = sdscatlen(out,"\r\n",2);
+    } else if (out) {
+        out = sdscatlen(out,"$-1\r\n",5);
+    }
+    mutex_unlock(redisStoreLock(st,hash));
+    return out;
+}
+
+/* Set 'key' to 'val'. Both strings are owned by the store afterwards.
+ * Returns 0 on success and -1 if out of memory. */
+static int redisStoreSet(redisStore *st, sds key, sds val) {
+    u32 hash = redisStoreHash(key);
+    struct redisStoreEntry *e, *ne;
+
+    /* allocated up front to keep the critical section short */
+    if ((ne = kmalloc(sizeof(*ne), GFP_KERNEL)) != NULL) {
+        ne->key = key;
+        ne->val = val;
+    }
+
+    mutex_lock(redisStoreLock(st,hash));
+    e = redisStoreLookup(st,hash,key);
+    if (e) {
+        sdsfree(e->val);
+        e->val = val;
+        val = NULL;
+    } else if (ne) {
+        hlist_add_head(&ne->node,&st->buckets[hash]);
+        ne = NULL;
+        key = val = NULL;
+    }
+    mutex_unlock(redisStoreLock(st,hash));
+
+    kfree(ne);
+    sdsfree(key);
+    if (val == NULL) return 0;
+    sdsfree(val);
+    return -1;
+}
+
+/* Remove 'key', returning 1 if it existed */
+static int redisStoreDel(redisStore *st, sds key) {
+    u32 hash = redisStoreHash(key);
+    struct redisStoreEntry *e;
+
+    mutex_lock(redisStoreLock(st,hash));
+    e = redisStoreLookup(st,hash,key);
+    if (e) hlist_del(&e->node);
+    mutex_unlock(redisStoreLock(st,hash));
+
+    if (e == NULL) return 0;
+    redisStoreFreeEntry(e);
+    return 1;
+}
+
+/* Longest command name echoed back by the unknown command error */
+#define REDIS_SERVER_ECHO_MAX 128
+
+/* Execute the request 'req' and append its reply to 'out'. Returns NULL,
+ * with 'out' freed, if out of memory. */
+static sds redisServerExec(redisServerWorker *w, redisRequest *req,
+        sds out) {
+    redisServer *srv = w->srv;
+    sds *argv = req->argv;
+    int argc = req->argc, j, n;
+    char name[REDIS_SERVER_ECHO_MAX+1];
+
+    w->commands++;
+    if (!strcasecmp(argv[0],"ping") && argc == 1) {
+        if ((out = redisServerRoom(out,7)) == NULL) return NULL;
+        out = sdscatlen(out,"+PONG\r\n",7);
+    } else if (!strcasecmp(argv[0],"get") && argc == 2) {
+        out = redisStoreGet(srv->store,argv[1],out);
+    } else if (!strcasecmp(argv[0],"set") && argc == 3) {
+        /* steal the strings from the request instead of copying them */
+        n = redisStoreSet(srv->store,argv[1],argv[2]);
+        argv[1] = argv[2] = NULL;
+        if ((out = redisServerRoom(out,32)) == NULL) return NULL;
+        out = n ? sdscat(out,"-ERR out of memory\r\n") :
+                  sdscatlen(out,"+OK\r\n",5);
+    } else if (!strcasecmp(argv[0],"del") && argc >= 2) {
+        for (n = 0, j = 1; j < argc; j++)
+            n += redisStoreDel(srv->store,argv[j]);
+        if ((out = redisServerRoom(out,32)) == NULL) return NULL;
+        out = sdscatlen(out,":",1);
+        out = sdscatlonglong(out,n);
+        out = sdscatlen(out,"\r\n",2);
+    } else {
+        /* the name comes from the peer: a CR or LF would let it forge
+         * replies */
+        n = min_t(size_t,sdslen(argv[0]),REDIS_SERVER_ECHO_MAX);
+        for (j = 0; j < n; j++)
+            name[j] = (argv[0][j] == '\r' || argv[0][j] == '\n') ?
+                ' ' : argv[0][j];
+        name[n] = '\0';
+        if ((out = redisServerRoom(out,n+80)) == NULL) return NULL;
+        out = sdscatprintf(out,
+                "-ERR unknown command or wrong number of arguments for '%s'\r\n",
+                name);
+    }
+    return out;
+}
+
+/* Put 'conn' on the ready list of its worker and wake the worker up. Called
+ * from the socket callbacks, in softirq context. */
+static void redisServerQueue(struct redisServerConn *conn) {
+    redisServerWorker *w = conn->worker;
+
+    spin_lock(&w->lock);
+    if (!conn->queued) {
+        conn->queued = 1;
+        list_add_tail(&conn->ready,&w->ready);
+    }
+    spin_unlock(&w->lock);
+    wake_up_process(w->thread);
+}
+
+static void redisServerDataReady(struct sock *sk, int bytes) {
+    read_lock(&sk->sk_callback_lock);
+    if (sk->sk_user_data) redisServerQueue(sk->sk_user_data);
+    read_unlock(&sk->sk_callback_lock);
+}
+
+/* Room in the send buffer for the replies left in conn->out */
+static void redisServerWriteSpace(struct sock *sk) {
+    read_lock(&sk->sk_callback_lock);
+    if (sk->sk_user_data && sk_stream_wspace(sk) >= sk_stream_min_wspace(sk)) {
+        clear_bit(SOCK_NOSPACE,&sk->sk_socket->flags);
+        redisServerQueue(sk->sk_user_data);
+    }
+    read_unlock(&sk->sk_callback_lock);
+}
+
+/* The peer closed the connection: let the worker find out with a read */
+static void redisServerStateChange(struct sock *sk) {
+    read_lock(&sk->sk_callback_lock);
+    if (sk->sk_user_data) redisServerQueue(sk->sk_user_data);
+    read_unlock(&sk->sk_callback_lock);
+}
+
+/* Have the worker with the fewest connections accept the next one from
+ * the shared listener. */
+static void redisServerHandOff(redisServer *srv) {
+    redisServerWorker *w = &srv->workers[0];
+    int j;
+
+    /* the chosen worker may be another one already stopped */
+    read_lock(&srv->handoff_lock);
+    if (!srv->stopping) {
+        for (j = 1; j < srv->nworkers; j++)
+            if (atomic_read(&srv->workers[j].nconns) <
+                atomic_read(&w->nconns))
+                w = &srv->workers[j];
+        atomic_set(&w->accept_pending,1);
+        wake_up_process(w->thread);
+    }
+    read_unlock(&srv->handoff_lock);
+}
+
+/* New connections are pending on the listener of a worker (SO_REUSEPORT) */
+static void redisServerListenReady(struct sock *sk, int bytes) {
+    redisServerWorker *w;
+
+    read_lock(&sk->sk_callback_lock);
+    if ((w = sk->sk_user_data) != NULL) {
+        atomic_set(&w->accept_pending,1);
+        wake_up_process(w->thread);
+    }
+    read_unlock(&sk->sk_callback_lock);
+}
+
+/* New connections are pending on the shared listener */
+static void redisServerSharedListenReady(struct sock *sk, int bytes) {
+    read_lock(&sk->sk_callback_lock);
+    if (sk->sk_user_data) redisServerHandOff(sk->sk_user_data);
+    read_unlock(&sk->sk_callback_lock);
+}
+
+/* Point the callbacks of a listener at 'data', or detach them if NULL */
+static void redisServerSetListener(struct socket *sock, void *data,
+        void (*data_ready)(struct sock *sk, int bytes)) {
+    write_lock_bh(&sock->sk->sk_callback_lock);
+    sock->sk->sk_user_data = data;
+    if (data) sock->sk->sk_data_ready = data_ready;
+    write_unlock_bh(&sock->sk->sk_callback_lock);
+}
+
+static void redisServerCloseConn(struct redisServerConn *conn) {
+    redisServerWorker *w = conn->worker;
+    struct sock *sk = conn->c->sock->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    sk->sk_user_data = NULL;
+    sk->sk_data_ready = conn->saved_data_ready;
+    sk->sk_write_space = conn->saved_write_space;
+    sk->sk_state_change = conn->saved_state_change;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    spin_lock_bh(&w->lock);
+    if (conn->queued) list_del(&conn->ready);
+    spin_unlock_bh(&w->lock);
+
+    list_del(&conn->node);
+    atomic_dec(&w->nconns);
+    atomic_dec(&w->srv->nclients);
+    redisRequestReset(&conn->req);
+    redisFree(conn->c);
+    sdsfree(conn->out);
+    kfree(conn);
+}
+
+/* Accept a connection from the worker's listener. Returns 0 if one was
+ * accepted (or refused), -1 if none is pending. */
+static int redisServerAccept(redisServerWorker *w) {
+    struct redisServerConn *conn;
+    struct socket *sock;
+    struct sock *sk;
+
+    if (kernel_accept(w->listener,&sock,O_NONBLOCK) < 0) return -1;
+    if (atomic_inc_return(&w->srv->nclients) > REDIS_SERVER_MAX_CLIENTS ||
+        (conn = kmalloc(sizeof(*conn), GFP_KERNEL)) == NULL) {
+        kernel_sockSend(sock,"-ERR max number of clients reached\r\n",36,
+                MSG_DONTWAIT);
+        atomic_dec(&w->srv->nclients);
+        sock_release(sock);
+        return 0;
+    }
+    if ((conn->c = redisContextCreate(sock)) == NULL) {
+        kfree(conn);
+        atomic_dec(&w->srv->nclients);
+        sock_release(sock);
+        return 0;
+    }
+    kernel_tcpnodelay(sock);
+    conn->worker = w;
+    conn->queued = 0;
+    memset(&conn->req,0,sizeof(conn->req));
+    conn->req.bulklen = -1;
+    if ((conn->out = sdsempty()) == NULL) {
+        redisFree(conn->c);
+        kfree(conn);
+        atomic_dec(&w->srv->nclients);
+        return 0;
+    }
+    conn->opos = 0;
+    list_add(&conn->node,&w->conns);
+    atomic_inc(&w->nconns);
+
+    sk = sock->sk;
+    write_lock_bh(&sk->sk_callback_lock);
+    conn->saved_data_ready = sk->sk_data_ready;
+    conn->saved_write_space = sk->sk_write_space;
+    conn->saved_state_change = sk->sk_state_change;
+    sk->sk_user_data = conn;
+    sk->sk_data_ready = redisServerDataReady;
+    sk->sk_write_space = redisServerWriteSpace;
+    sk->sk_state_change = redisServerStateChange;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    /* data may have arrived before the callbacks were installed */
+    spin_lock_bh(&w->lock);
+    conn->queued = 1;
+    list_add_tail(&conn->ready,&w->ready);
+    spin_unlock_bh(&w->lock);
+    return 0;
+}
+
+/* Send what the socket takes of conn->out without blocking. Returns 1 once
+ * everything is sent, 0 if the send buffer is full (redisServerWriteSpace()
+ * queues the connection again when it drains) and -1 on error. */
+static int redisServerFlush(struct redisServerConn *conn) {
+    struct socket *sock = conn->c->sock;
+    int n;
+
+    while (conn->opos < sdslen(conn->out)) {
+        /* set before trying, so that no write space event is missed */
+        set_bit(SOCK_NOSPACE,&sock->flags);
+        n = kernel_sockSend(sock,conn->out+conn->opos,
+                sdslen(conn->out)-conn->opos,MSG_DONTWAIT);
+        if (n == -EAGAIN) return 0;
+        if (n <= 0) return -1;
+        conn->opos += n;
+    }
+    clear_bit(SOCK_NOSPACE,&sock->flags);
+    sdsclear(conn->out);
+    conn->opos = 0;
+    return 1;
+}
+
+/* Serve what is available on 'conn' without blocking. Returns 1 if the
+ * connection must be looked at again, 0 if it waits for input or for room
+ * to send and -1 if it must be closed. */
+static int redisServerServe(struct redisServerConn *conn) {
+    redisContext *c = conn->c;
+    const char *err;
+    int j, ret = 0;
+
+    for (j = 0; j < REDIS_SERVER_READS_PER_PASS; j++) {
+        /* do not take more requests while replies are stuck */
+        if (sdslen(conn->out) && (ret = redisServerFlush(conn)) != 1)
+            return ret;
+
+        while (sdslen(conn->out) < REDIS_SERVER_OUTBUF_FLUSH &&
+               (ret = redisRequestParse(&conn->req,c,&err)) == 1) {
+            conn->out = redisServerExec(conn->worker,&conn->req,conn->out);
+            redisRequestReset(&conn->req);
+            /* out of memory for the replies: drop the connection */
+            if (conn->out == NULL) return -1;
+        }
+        if (ret == -1) {
+            /* answer what came before, then give up on the connection */
+            conn->out = redisServerRoom(conn->out,strlen(err)+32);
+            if (conn->out == NULL) return -1;
+            conn->out = sdscatprintf(conn->out,"-ERR Protocol error: %s\r\n",
+                    err);
+            redisServerFlush(conn);
+            return -1;
+        }
+        if (sdslen(conn->out)) {
+            if ((ret = redisServerFlush(conn)) != 1) return ret;
+            /* more requests may be buffered already */
+            if (c->ipos < sdslen(c->ibuf)) continue;
+        }
+
+        ret = redisBufferReadNonBlock(c);
+        if (ret == -1) return -1;
+        if (ret == 0) return 0;
+    }
+    return 1;
+}
+
+static int redisServerWorkerThread(void *data) {
+    redisServerWorker *w = data;
+    redisServer *srv = w->srv;
+    struct redisServerConn *conn, *next;
+    LIST_HEAD(batch);
+    int ret;
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!atomic_read(&w->accept_pending) && list_empty(&w->ready) &&
+            !kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+
+        if (atomic_xchg(&w->accept_pending,0)) {
+            if (srv->reuseport) {
+                while (redisServerAccept(w) == 0);
+            } else if (redisServerAccept(w) == 0) {
+                /* one at a time, so that a burst is spread out */
+                redisServerHandOff(srv);
+            }
+        }
+
+        spin_lock_bh(&w->lock);
+        list_splice_init(&w->ready,&batch);
+        list_for_each_entry(conn, &batch, ready)
+            conn->queued = 0;
+        spin_unlock_bh(&w->lock);
+
+        list_for_each_entry_safe(conn, next, &batch, ready) {
+            list_del_init(&conn->ready);
+            ret = redisServerServe(conn);
+            if (ret == -1) {
+                redisServerCloseConn(conn);
+            } else if (ret == 1) {
+                spin_lock_bh(&w->lock);
+                if (!conn->queued) {
+                    conn->queued = 1;
+                    list_add_tail(&conn->ready,&w->ready);
+                }
+                spin_unlock_bh(&w->lock);
+            }
+        }
+        cond_resched();
+    }
+
+    list_for_each_entry_safe(conn, next, &w->conns, node)
+        redisServerCloseConn(conn);
+    return 0;
+}
+
+/* Start serving on 'port' with a worker per online CPU. Returns NULL on
+ * error. */
+redisServer *redisServerStart(int port, int backlog) {
+    redisServer *srv;
+    redisServerWorker *w;
+    int cpu, j = 0;
+
+    if ((srv = kzalloc(sizeof(*srv), GFP_KERNEL)) == NULL) return NULL;
+    atomic_set(&srv->nclients,0);
+    rwlock_init(&srv->handoff_lock);
+    if ((srv->store = redisStoreCreate()) == NULL) goto err;
+    srv->nworkers = num_online_cpus();
+    srv->workers = kzalloc(sizeof(*w)*srv->nworkers, GFP_KERNEL);
+    if (srv->workers == NULL) goto err;
+
+    /* one listener per worker if SO_REUSEPORT works, else a shared one */
+    srv->reuseport = 1;
+    for (j = 0; j < srv->nworkers; j++) {
+        w = &srv->workers[j];
+        w->listener = set_up_listen_socket(port,backlog,1);
+        if (w->listener == NULL) break;
+    }
+    if (j < srv->nworkers) {
+        while (j--) {
+            sock_release(srv->workers[j].listener);
+            srv->workers[j].listener = NULL;
+        }
+        srv->reuseport = 0;
+        srv->listener = set_up_listen_socket(port,backlog,0);
+        if (srv->listener == NULL) goto err;
+    }
+
+    j = 0;
+    for_each_online_cpu(cpu) {
+        if (j == srv->nworkers) break;
+        w = &srv->workers[j++];
+        w->srv = srv;
+        w->cpu = cpu;
+        if (!srv->reuseport) w->listener = srv->listener;
+        spin_lock_init(&w->lock);
+        INIT_LIST_HEAD(&w->ready);
+        INIT_LIST_HEAD(&w->conns);
+        atomic_set(&w->nconns,0);
+        /* accept what was queued before the callbacks were installed */
+        atomic_set(&w->accept_pending,1);
+        w->thread = kthread_create(redisServerWorkerThread, w,
+                "redisd/%d", cpu);
+        if (IS_ERR(w->thread)) {
+            w->thread = NULL;
+            goto err;
+        }
+        kthread_bind(w->thread,cpu);
+    }
+    srv->nworkers = j;
+
+    /* the callbacks wake the workers up, so they all exist by now */
+    if (srv->reuseport) {
+        for (j = 0; j < srv->nworkers; j++)
+            redisServerSetListener(srv->workers[j].listener,&srv->workers[j],
+                    redisServerListenReady);
+    } else {
+        redisServerSetListener(srv->listener,srv,
+                redisServerSharedListenReady);
+    }
+    for (j = 0; j < srv->nworkers; j++)
+        wake_up_process(srv->workers[j].thread);
+    return srv;
+
+err:
+    redisServerStop(srv);
+    return NULL;
+}
+
+/* Stop the workers, which close their connections, then release the
+ * listeners and free the key space. Also used to undo a partial
+ * redisServerStart(). */
+void redisServerStop(redisServer *srv) {
+    redisServerWorker *w;
+    int j;
+
+    /* no more wakeups from the listeners... */
+    if (srv->listener) redisServerSetListener(srv->listener,NULL,NULL);
+    for (j = 0; srv->workers && j < srv->nworkers; j++) {
+        w = &srv->workers[j];
+        if (srv->reuseport && w->listener)
+            redisServerSetListener(w->listener,NULL,NULL);
+    }
+    write_lock_bh(&srv->handoff_lock);
+    srv->stopping = 1;
+    write_unlock_bh(&srv->handoff_lock);
+
+    /* ...and none of the workers uses them once stopped. A worker never
+     * blocks on a socket, so it notices the stop request at once. */
+    for (j = 0; srv->workers && j < srv->nworkers; j++)
+        if (srv->workers[j].thread) kthread_stop(srv->workers[j].thread);
+
+    if (srv->listener) sock_release(srv->listener);
+    for (j = 0; srv->workers && j < srv->nworkers; j++) {
+        w = &srv->workers[j];
+        if (srv->reuseport && w->listener) sock_release(w->listener);
+    }
+    kfree(srv->workers);
+    if (srv->store) redisStoreFree(srv->store);
+    kfree(srv);
+}
+
+/* Number of commands processed by all the workers */
+unsigned long redisServerCommands(redisServer *srv) {
+    unsigned long commands = 0;
+    int j;
+
+    for (j = 0; j < srv->nworkers; j++)
+        commands += srv->workers[j].commands;
+    return commands;
+}
@@ -0,0 +1,72 @@
+/*
+   A small in-kernel server speaking the Redis protocol, built on the
+   client's sds strings. It serves PING, GET, SET and DEL from an in-memory
+   hash table, with a worker thread per CPU.
+ */
+
+#ifndef __REDISSERVER_H
+#define __REDISSERVER_H
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <asm/atomic.h>
+
+#include "redisclient.h"
+
+/* Buckets of the key space and number of locks striped across them (both
+ * powers of two) */
+#define REDIS_STORE_BUCKETS 1024
+#define REDIS_STORE_LOCKS 64
+
+/* Key space of the server */
+typedef struct redisStore {
+    struct hlist_head buckets[REDIS_STORE_BUCKETS];
+    struct mutex locks[REDIS_STORE_LOCKS];
+} redisStore;
+
+/* Limits on what a client can make the server hold. A request is parsed
+ * into an argv of sds strings, each argument allocated in one piece once
+ * its length is known; argv is a single kmalloc() too, which 2.6 kernels
+ * serve up to 128K. */
+#define REDIS_SERVER_MAX_CLIENTS 1024
+#define REDIS_SERVER_MAX_ARGS (16*1024)
+#define REDIS_SERVER_MAX_BULK (64*1024)
+#define REDIS_SERVER_MAX_QUERYBUF (4*1024*1024) /* Whole request */
+
+/* Default listen backlog, as in redis.conf */
+#define REDIS_SERVER_BACKLOG 511
+
+/* A thread bound to one CPU, serving the connections it accepted. It
+ * sleeps until a socket callback puts a connection on its 'ready' list or
+ * flags a pending connection on its listener. */
+typedef struct redisServerWorker {
+    struct redisServer *srv;
+    struct task_struct *thread;
+    int cpu;
+    struct socket *listener;  /* Own listener, or the shared one */
+    spinlock_t lock;          /* Protects ready, taken from softirq */
+    struct list_head ready;   /* Connections with work to do */
+    struct list_head conns;   /* Connections of this worker */
+    atomic_t nconns;
+    atomic_t accept_pending;
+    unsigned long commands;   /* Commands processed */
+} redisServerWorker;
+
+typedef struct redisServer {
+    int nworkers;
+    redisServerWorker *workers;
+    int reuseport;            /* One listener per worker */
+    struct socket *listener;  /* Shared listener when !reuseport */
+    atomic_t nclients;        /* Connections of all the workers */
+    rwlock_t handoff_lock;    /* Write locked to set 'stopping' */
+    int stopping;             /* No more hand-offs between workers */
+    redisStore *store;
+} redisServer;
+
+redisServer *redisServerStart(int port, int backlog);
+void redisServerStop(redisServer *srv);
+unsigned long redisServerCommands(redisServer *srv);
+
+#endif /* __REDISSERVER_H */
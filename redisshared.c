@@ -0,0 +1,186 @@
+/*
+   A connection shared by concurrent callers.
+
+   Each redisCommand() costs a write, so many threads sending small
+   commands on their own connections turn into as many small segments.
+   Here the callers push their commands on a lock-free stack and sleep;
+   a single thread takes everything pushed, encodes it into one buffer
+   and sends it in one write, then reads the replies and wakes the
+   callers in order. Commands pushed while a batch is on its way form
+   the next batch, so the busier the connection, the larger the writes.
+
+   When the thread finds fewer than 'maxbytes' bytes to send it spins for
+   up to 'budget' waiting for more, which trades that much latency for
+   fewer writes, like Nagle's algorithm: 0 sends right away.
+ */
+
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <asm/processor.h>
+
+#include "redisshared.h"
+
+/* Move the commands submitted so far to the end of the queue, oldest
+ * first. */
+static void redisSharedTake(redisShared *s) {
+    redisSharedReq *req = xchg(&s->pending,NULL), *last = req, *first = NULL;
+    redisSharedReq *next;
+
+    if (req == NULL) return;
+    while (req) {
+        next = req->next;
+        req->next = first;
+        first = req;
+        req = next;
+    }
+    *s->tail = first;
+    s->tail = &last->next;
+    if (s->unfmt == NULL) s->unfmt = first;
+}
+
+/* Encode queued commands into the next write until it holds 'maxbytes'.
+ * Returns -1 if out of memory. */
+static int redisSharedFill(redisShared *s) {
+    redisSharedReq *req;
+
+    if (s->unfmt == NULL) return 0;
+    if (s->out == NULL && (s->out = sdsempty()) == NULL) return -1;
+    while ((req = s->unfmt) != NULL && sdslen(s->out) < s->maxbytes) {
+        s->out = redisCatCommandArgv(s->out,req->argc,req->argv,
+                req->argvlen,s->c->gfp|__GFP_NOWARN);
+        if (s->out == NULL) return -1;
+        s->unfmt = req->next;
+        s->nfmt++;
+    }
+    return 0;
+}
+
+/* Hand their replies to the first 'count' queued callers. Unless 'alone',
+ * the commands were sent and the replies are read in order; otherwise, or
+ * once the connection failed, each command is sent on its own, which
+ * reports the failure to the caller. */
+static void redisSharedComplete(redisShared *s, int count, int alone) {
+    redisSharedReq *req;
+
+    while (count--) {
+        req = s->queue;
+        if ((s->queue = req->next) == NULL) s->tail = &s->queue;
+        if (alone || s->c->err)
+            req->reply = redisCommandArgv(s->c,req->argc,req->argv,
+                    req->argvlen);
+        else
+            req->reply = redisReadReply(s->c);
+        /* req is on the caller's stack: not to be touched after this */
+        complete(&req->done);
+    }
+}
+
+/* Out of memory while encoding: send the commands encoded so far and the
+ * one that failed one at a time, so each caller gets its own reply. */
+static void redisSharedAlone(redisShared *s) {
+    int count = s->nfmt+1;
+
+    s->unfmt = s->unfmt->next;
+    s->nfmt = 0;
+    redisSharedComplete(s,count,1);
+}
+
+static void redisSharedFlush(redisShared *s) {
+    int count = s->nfmt;
+
+    redisSendFormatted(s->c,s->out,sdslen(s->out));
+    s->writes++;
+    s->commands += count;
+    s->nfmt = 0;
+    sdsclear(s->out);
+    redisSharedComplete(s,count,0);
+}
+
+static int redisSharedThread(void *data) {
+    redisShared *s = data;
+    ktime_t start;
+    int err;
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (ACCESS_ONCE(s->pending) == NULL && s->queue == NULL &&
+            !kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+
+        redisSharedTake(s);
+        err = redisSharedFill(s);
+        /* give the other callers a chance to join this write */
+        start = ktime_get();
+        while (!err && s->budget && sdslen(s->out) < s->maxbytes &&
+               ktime_to_ns(ktime_sub(ktime_get(),start)) < s->budget) {
+            if (ACCESS_ONCE(s->pending) == NULL) {
+                cpu_relax();
+                continue;
+            }
+            redisSharedTake(s);
+            err = redisSharedFill(s);
+        }
+        if (err)
+            redisSharedAlone(s);
+        else if (s->nfmt)
+            redisSharedFlush(s);
+    }
+    return 0;
+}
+
+/* Share 'c' between concurrent callers, waiting up to 'budget_us'
+ * microseconds for more commands before a write of less than 'maxbytes'
+ * bytes. The connection then belongs to the returned object, and must
+ * only be used through redisSharedCommandArgv(). Returns NULL (and 'c' is
+ * left to the caller) if out of memory or if the thread could not be
+ * started. */
+redisShared *redisSharedCreate(redisContext *c, unsigned int budget_us,
+        size_t maxbytes) {
+    redisShared *s = kzalloc(sizeof(*s), GFP_KERNEL);
+
+    if (s == NULL) return NULL;
+    s->c = c;
+    s->tail = &s->queue;
+    s->budget = budget_us*NSEC_PER_USEC;
+    s->maxbytes = maxbytes;
+    if ((s->out = sdsempty()) == NULL) goto err;
+    s->thread = kthread_run(redisSharedThread, s, "redisshared");
+    if (IS_ERR(s->thread)) goto err;
+    return s;
+
+err:
+    if (s->out) sdsfree(s->out);
+    kfree(s);
+    return NULL;
+}
+
+/* Like redisCommandArgv(), from any number of threads at once. The
+ * arguments are only read by the thread sending the command, so they
+ * must stay valid until this returns. */
+redisReply *redisSharedCommandArgv(redisShared *s, int argc,
+        const char **argv, const size_t *argvlen) {
+    redisSharedReq req, *head;
+
+    req.argc = argc;
+    req.argv = argv;
+    req.argvlen = argvlen;
+    req.reply = NULL;
+    init_completion(&req.done);
+    do {
+        head = ACCESS_ONCE(s->pending);
+        req.next = head;
+    } while (cmpxchg(&s->pending,head,&req) != head);
+    /* the thread only goes to sleep with nothing pending */
+    if (head == NULL) wake_up_process(s->thread);
+    wait_for_completion(&req.done);
+    return req.reply;
+}
+
+/* Stop the thread and close the connection. No caller may be waiting. */
+void redisSharedFree(redisShared *s) {
+    kthread_stop(s->thread);
+    redisFree(s->c);
+    if (s->out) sdsfree(s->out);
+    kfree(s);
+}
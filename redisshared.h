@@ -0,0 +1,50 @@
+/*
+   A connection shared by concurrent callers, whose commands are batched
+   into few writes, for the kernel redis client.
+ */
+
+#ifndef __REDISSHARED_H
+#define __REDISSHARED_H
+
+#include <linux/sched.h>
+#include <linux/completion.h>
+
+#include "redisclient.h"
+
+/* A command of a caller, living on its stack until the reply arrives */
+typedef struct redisSharedReq {
+    struct redisSharedReq *next; /* Submitted, then queued after it */
+    int argc;
+    const char **argv;
+    const size_t *argvlen;
+    redisReply *reply;
+    struct completion done;
+} redisSharedReq;
+
+/* The connection and the thread flushing the commands submitted to it.
+ * Callers push their commands on 'pending' without a lock; the thread
+ * takes them all at once, and sends as many as fit in 'maxbytes' in a
+ * single write, waiting up to 'budget' for more to arrive first. The
+ * replies come back in the same order. */
+typedef struct redisShared {
+    redisContext *c;           /* Only used by the thread */
+    struct task_struct *thread;
+    redisSharedReq *pending;   /* Submitted, newest first */
+    redisSharedReq *queue;     /* Taken by the thread, oldest first */
+    redisSharedReq **tail;     /* Next pointer of the last queued */
+    redisSharedReq *unfmt;     /* First queued command not in out */
+    int nfmt;                  /* Queued commands in out */
+    sds out;                   /* The next write */
+    s64 budget;                /* ns */
+    size_t maxbytes;
+    unsigned long writes;      /* Writes of the thread */
+    unsigned long commands;    /* Commands sent by the thread */
+} redisShared;
+
+redisShared *redisSharedCreate(redisContext *c, unsigned int budget_us,
+        size_t maxbytes);
+redisReply *redisSharedCommandArgv(redisShared *s, int argc,
+        const char **argv, const size_t *argvlen);
+void redisSharedFree(redisShared *s);
+
+#endif /* __REDISSHARED_H */
@@ -28,27 +28,22 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#define SDS_ABORT_ON_OOM
+/* There is no aborting in the kernel: every function that allocates
+ * returns NULL when out of memory and the caller has to cope with it. */
 
 #include "sds.h"
 
 #define tolower(c)  ((c) >= 65 && (c) <= 90) ? ((c) + 33) : (c)
 #define toupper(c)  ((c) >= 97 && (c) <= 122) ? ((c) - 33) : (c)
 
-static void sdsOomAbort(void) {
-  printk(KERN_ERR "SDS: Out Of Memory (SDS_ABORT_ON_OOM defined)\n");
-  return;
-}
-
-sds sdsnewlen(const void *init, size_t initlen) {
+/* Like sdsnewlen(), allocating with the given GFP flags. Callers that can
+ * not sleep or must not recurse into the filesystem or block I/O pass
+ * GFP_ATOMIC, GFP_NOFS or GFP_NOIO. Returns NULL if out of memory. */
+sds sdsnewlenGfp(const void *init, size_t initlen, gfp_t gfp) {
     struct sdshdr *sh;
 
-    sh = kmalloc(sizeof(struct sdshdr)+initlen+1, GFP_KERNEL);
-#ifdef SDS_ABORT_ON_OOM
-    if (sh == NULL) sdsOomAbort();
-#else
+    sh = kmalloc(sizeof(struct sdshdr)+initlen+1, gfp);
     if (sh == NULL) return NULL;
-#endif
     sh->len = initlen;
     sh->free = 0;
     if (initlen) {
@@ -59,6 +54,10 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return (char*)sh->buf;
 }
 
+sds sdsnewlen(const void *init, size_t initlen) {
+    return sdsnewlenGfp(init,initlen,GFP_KERNEL);
+}
+
 sds sdsempty(void) {
     return sdsnewlen("",0);
 }
@@ -94,7 +93,32 @@ void sdsupdatelen(sds s) {
     sh->len = reallen;
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen) {
+/* Make 's' an empty string without releasing its buffer, so that it can
+ * be filled again without reallocating. */
+void sdsclear(sds s) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    sh->free += sh->len;
+    sh->len = 0;
+    sh->buf[0] = '\0';
+}
+
+/* Adjust the length of 's' by 'incr' after the caller wrote directly into
+ * the free space obtained with sdsMakeRoomFor() (or truncated the string).
+ * The string is nul terminated again at its new end. */
+void sdsIncrLen(sds s, long incr) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
+
+/* Make sure there are at least 'addlen' bytes of free space at the end of
+ * 's', reallocating with the GFP flags 'gfp' if needed. The length of the
+ * string is not changed. Returns NULL if out of memory, in which case 's'
+ * is left untouched. */
+sds sdsMakeRoomForGfp(sds s, size_t addlen, gfp_t gfp) {
     struct sdshdr *sh, *newsh;
     size_t free = sdsavail(s);
     size_t len, newlen;
@@ -103,17 +127,22 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     len = sdslen(s);
     sh = (void*) (s-(sizeof(struct sdshdr)));
     newlen = (len+addlen)*2;
-    newsh = krealloc(sh, sizeof(struct sdshdr)+newlen+1, GFP_KERNEL);
-#ifdef SDS_ABORT_ON_OOM
-    if (newsh == NULL) sdsOomAbort();
-#else
+    newsh = krealloc(sh, sizeof(struct sdshdr)+newlen+1, gfp);
     if (newsh == NULL) return NULL;
-#endif
 
     newsh->free = newlen - len;
     return newsh->buf;
 }
 
+sds sdsMakeRoomFor(sds s, size_t addlen) {
+    return sdsMakeRoomForGfp(s,addlen,GFP_KERNEL);
+}
+
+/* Size of the allocation backing 's' */
+size_t sdsAllocSize(sds s) {
+    return sizeof(struct sdshdr)+sdslen(s)+sdsavail(s)+1;
+}
+
 sds sdscatlen(sds s, const void *t, size_t len) {
     struct sdshdr *sh;
     size_t curlen = sdslen(s);
@@ -153,31 +182,46 @@ sds sdscpy(sds s, char *t) {
     return sdscpylen(s, t, strlen(t));
 }
 
+/* Like sdscatprintf() but gets a va_list instead of being variadic.
+ *
+ * The output is formatted straight into the spare capacity of 's'. Only
+ * when it does not fit the string is grown to the exact size reported by
+ * vsnprintf() and the format is run a second time, so no temporary buffer
+ * is ever allocated. */
+sds sdscatvprintf(sds s, const char *fmt, va_list ap) {
+    struct sdshdr *sh;
+    va_list cpy;
+    size_t curlen = sdslen(s);
+    size_t avail = sdsavail(s);
+    int len;
+
+    va_copy(cpy, ap);
+    len = vsnprintf(s+curlen, avail+1, fmt, cpy);
+    va_end(cpy);
+    if (len < 0) {
+        s[curlen] = '\0';
+        return s;
+    }
+    if ((size_t)len > avail) {
+        s = sdsMakeRoomFor(s, len);
+        if (s == NULL) return NULL;
+        va_copy(cpy, ap);
+        vsnprintf(s+curlen, len+1, fmt, cpy);
+        va_end(cpy);
+    }
+    sh = (void*) (s-(sizeof(struct sdshdr)));
+    sh->len = curlen+len;
+    sh->free = sh->free-len;
+    return s;
+}
+
 sds sdscatprintf(sds s, const char *fmt, ...) {
     va_list ap;
-    char *buf, *t;
-    size_t buflen = 16;
-
-    while(1) {
-        buf = kmalloc(buflen, GFP_KERNEL);
-#ifdef SDS_ABORT_ON_OOM
-        if (buf == NULL) sdsOomAbort();
-#else
-        if (buf == NULL) return NULL;
-#endif
-        buf[buflen-2] = '\0';
-        va_start(ap, fmt);
-        vsnprintf(buf, buflen, fmt, ap);
-        va_end(ap);
-        if (buf[buflen-2] != '\0') {
-            kfree(buf);
-            buflen *= 2;
-            continue;
-        }
-        break;
-    }
-    t = sdscat(s, buf);
-    kfree(buf);
+    sds t;
+
+    va_start(ap, fmt);
+    t = sdscatvprintf(s, fmt, ap);
+    va_end(ap);
     return t;
 }
 
@@ -270,15 +314,15 @@ sds *sdssplitlen(char *s, int len, char *sep, int seplen, int *count) {
     int elements = 0, slots = 5, start = 0, j;
 
     sds *tokens = kmalloc(sizeof(sds)*slots, GFP_KERNEL);
-#ifdef SDS_ABORT_ON_OOM
-    if (tokens == NULL) sdsOomAbort();
-#endif
     if (seplen < 1 || len < 0 || tokens == NULL) return NULL;
     if (len == 0) {
         *count = 0;
         return tokens;
     }
-    for (j = 0; j < (len-(seplen-1)); j++) {
+    j = 0;
+    while (j < (len-(seplen-1))) {
+        char *p;
+
         /* make sure there is room for the next element and the final one */
         if (slots < elements+2) {
             sds *newtokens;
@@ -286,43 +330,37 @@ sds *sdssplitlen(char *s, int len, char *sep, int seplen, int *count) {
             slots *= 2;
             newtokens = krealloc(tokens,sizeof(sds)*slots, GFP_KERNEL);
             if (newtokens == NULL) {
-#ifdef SDS_ABORT_ON_OOM
-                sdsOomAbort();
-#else
                 goto cleanup;
-#endif
             }
             tokens = newtokens;
         }
-        /* search the separator */
-        if ((seplen == 1 && *(s+j) == sep[0]) || (memcmp(s+j,sep,seplen) == 0)) {
+        /* jump to the next occurrence of the first separator byte with
+         * memchr(), which scans a word at a time, and only then compare
+         * the rest of the separator */
+        p = memchr(s+j,sep[0],(len-(seplen-1))-j);
+        if (p == NULL) break;
+        j = p-s;
+        if (seplen == 1 || memcmp(s+j,sep,seplen) == 0) {
             tokens[elements] = sdsnewlen(s+start,j-start);
             if (tokens[elements] == NULL) {
-#ifdef SDS_ABORT_ON_OOM
-                sdsOomAbort();
-#else
                 goto cleanup;
-#endif
             }
             elements++;
             start = j+seplen;
-            j = j+seplen-1; /* skip the separator */
+            j = j+seplen; /* skip the separator */
+        } else {
+            j++;
         }
     }
     /* Add the final element. We are sure there is room in the tokens array. */
     tokens[elements] = sdsnewlen(s+start,len-start);
     if (tokens[elements] == NULL) {
-#ifdef SDS_ABORT_ON_OOM
-                sdsOomAbort();
-#else
                 goto cleanup;
-#endif
     }
     elements++;
     *count = elements;
     return tokens;
 
-#ifndef SDS_ABORT_ON_OOM
 cleanup:
     {
         int i;
@@ -330,7 +368,6 @@ cleanup:
         kfree(tokens);
         return NULL;
     }
-#endif
 }
 
 void sdsfreesplitres(sds *tokens, int count) {
@@ -340,13 +377,16 @@ void sdsfreesplitres(sds *tokens, int count) {
     kfree(tokens);
 }
 
-sds sdsfromlonglong(long long value) {
-    char buf[32], *p;
+/* Write the decimal representation of 'value' backwards so that it ends
+ * right before 'end', returning a pointer to its first character. The
+ * caller must provide at least SDS_LLSTR_SIZE bytes before 'end'. */
+static char *sdsll2str(char *end, long long value) {
+    char *p = end;
     unsigned long long v;
     unsigned long long remainder;
 
-    v = (value < 0) ? -value : value;
-    p = buf+31; /* point to the last character */
+    /* negate in unsigned space so that LLONG_MIN does not overflow */
+    v = (value < 0) ? ((unsigned long long)-(value+1))+1 : value;
     do {
       /* avr: fix for kernel "__udivdi3 undefined" bug for 
          64-bit division. do_div replaces v with v/10. Old
@@ -355,9 +395,24 @@ sds sdsfromlonglong(long long value) {
              v /= 10;
       */
         remainder = do_div(v, 10);
-        *p-- = '0'+ remainder;
+        *--p = '0'+ remainder;
     } while(v);
-    if (value < 0) *p-- = '-';
-    p++;
-    return sdsnewlen(p,32-(p-buf));
+    if (value < 0) *--p = '-';
+    return p;
+}
+
+sds sdsfromlonglong(long long value) {
+    char buf[SDS_LLSTR_SIZE], *p;
+
+    p = sdsll2str(buf+sizeof(buf), value);
+    return sdsnewlen(p,(buf+sizeof(buf))-p);
+}
+
+/* Append the decimal representation of 'value' to 's'. This is what
+ * sdscatprintf(s,"%lld",value) does, without going through vsnprintf(). */
+sds sdscatlonglong(sds s, long long value) {
+    char buf[SDS_LLSTR_SIZE], *p;
+
+    p = sdsll2str(buf+sizeof(buf), value);
+    return sdscatlen(s,p,(buf+sizeof(buf))-p);
 }
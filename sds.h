@@ -40,6 +40,9 @@
 
 typedef char *sds;
 
+/* Room needed to hold the decimal representation of a long long */
+#define SDS_LLSTR_SIZE 21
+
 struct sdshdr {
     long len;
     long free;
@@ -47,17 +50,22 @@ struct sdshdr {
 };
 
 sds sdsnewlen(const void *init, size_t initlen);
+sds sdsnewlenGfp(const void *init, size_t initlen, gfp_t gfp);
 sds sdsnew(const char *init);
 sds sdsempty(void);
 size_t sdslen(const sds s);
 sds sdsdup(const sds s);
 void sdsfree(sds s);
 size_t sdsavail(sds s);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+sds sdsMakeRoomForGfp(sds s, size_t addlen, gfp_t gfp);
+size_t sdsAllocSize(sds s);
 sds sdscatlen(sds s, const void *t, size_t len);
 sds sdscat(sds s, const char *t);
 sds sdscpylen(sds s, char *t, size_t len);
 sds sdscpy(sds s, char *t);
 
+sds sdscatvprintf(sds s, const char *fmt, va_list ap);
 #ifdef __GNUC__
 sds sdscatprintf(sds s, const char *fmt, ...)
     __attribute__((format(printf, 2, 3)));
@@ -68,11 +76,14 @@ sds sdscatprintf(sds s, const char *fmt, ...);
 sds sdstrim(sds s, const char *cset);
 sds sdsrange(sds s, long start, long end);
 void sdsupdatelen(sds s);
+void sdsIncrLen(sds s, long incr);
+void sdsclear(sds s);
 int sdscmp(sds s1, sds s2);
 sds *sdssplitlen(char *s, int len, char *sep, int seplen, int *count);
 void sdsfreesplitres(sds *tokens, int count);
 void sdstolower(sds s);
 void sdstoupper(sds s);
 sds sdsfromlonglong(long long value);
+sds sdscatlonglong(sds s, long long value);
 
 #endif
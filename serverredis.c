@@ -0,0 +1,46 @@
+/* Loads the in-kernel Redis protocol server (see redisserver.c) */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+
+#include "redisserver.h"
+
+static int port = 6380;
+module_param(port, int, 0444);
+MODULE_PARM_DESC(port, "TCP port to listen on");
+
+static int backlog = REDIS_SERVER_BACKLOG;
+module_param(backlog, int, 0444);
+MODULE_PARM_DESC(backlog, "listen backlog of each listening socket");
+
+static redisServer *srv;
+
+static int __init serverredis_init(void)
+{
+        srv = redisServerStart(port, backlog);
+        if (srv == NULL) {
+                printk(KERN_ERR "serverredis: cannot listen on port %d\n",
+                       port);
+                return -EIO;
+        }
+        printk(KERN_INFO "serverredis: listening on port %d, %d workers%s\n",
+               port, srv->nworkers,
+               srv->reuseport ? " (SO_REUSEPORT)" : "");
+        return 0;
+}
+
+void __exit serverredis_exit(void)
+{
+        printk(KERN_INFO "serverredis: %lu commands processed\n",
+               redisServerCommands(srv));
+        redisServerStop(srv);
+}
+
+module_init(serverredis_init);
+module_exit(serverredis_exit);
+
+MODULE_AUTHOR("avr");
+MODULE_DESCRIPTION("serverredis");
+MODULE_VERSION("0.01");
+MODULE_LICENSE("GPL");
@@ -10,7 +10,19 @@
 #include <linux/file.h>
 #include <asm/uaccess.h>
 
+#include <linux/completion.h>
+
 #include "redisclient.h"
+#include "redispubsub.h"
+#include "redisscan.h"
+#include "redisscript.h"
+#include "rediscache.h"
+#include "redisflight.h"
+#include "redisshared.h"
+#include "rediscodec.h"
+#include "redishash.h"
+#include "redischain.h"
+#include "redisload.h"
 
 #define SERVER_IP "172.16.174.1"
 #define SERVER_PORT 6379
@@ -18,15 +30,76 @@
 /* The following line is our testing "framework" :) */
 #define test_cond(_c) if(_c) printk(KERN_INFO "PASSED\n"); else {printk(KERN_INFO "FAILED\n"); fails++;}
 
+/* Producer and consumer for the streaming test: the value is a run of
+ * 'x' bytes, and the consumer counts the bytes it checked. */
+static int stream_fill(void *privdata, char *buf, size_t len)
+{
+        memset(buf, 'x', len);
+        return 0;
+}
+
+static int stream_check(void *privdata, char *buf, size_t len)
+{
+        size_t j;
+
+        for (j = 0; j < len; j++)
+                if (buf[j] != 'x')
+                        return 1;
+        *(long long *)privdata += len;
+        return 0;
+}
+
+/* Handler for the Pub/Sub test: remembers the last message received */
+struct pubsub_msg {
+        char msg[16];
+        struct completion done;
+};
+
+/* Queues an INCR of the key it is given, for the transaction test */
+static int tx_fill(redisContext *c, redisTransaction *t, void *privdata)
+{
+        const char *argv[2] = { "INCR", privdata };
+
+        return redisTransactionAppend(t, 2, argv, NULL);
+}
+
+/* 1000 pairs load:0 .. load:999, the value being the key */
+static int load_next(void *privdata, const char **key, size_t *keylen,
+                     const char **val, size_t *vallen)
+{
+        static char buf[16];
+        int *next = privdata;
+
+        if (*next == 1000)
+                return 0;
+        *keylen = *vallen = snprintf(buf, sizeof(buf), "load:%d", (*next)++);
+        *key = *val = buf;
+        return 1;
+}
+
+static void pubsub_handler(void *privdata, const char *channel,
+                           size_t channellen, const char *msg, size_t msglen)
+{
+        struct pubsub_msg *m = privdata;
+
+        if (msglen < sizeof(m->msg)) {
+                memcpy(m->msg, msg, msglen);
+                m->msg[msglen] = '\0';
+        }
+        complete(&m->done);
+}
+
 static int __init testredis_init(void)
 {
-        int fd;
-        int fails = 0;
+        /* DB 9 is used for testing, selected while connecting */
+        redisHandshake hs = { .db = 9, .name = "testredis" };
+        redisContext *c;
+        int fails = 0, j;
         redisReply *reply;
 
         printk(KERN_INFO "testredis_init() called\n");
 
-        reply = redisConnect(&fd, SERVER_IP, SERVER_PORT);
+        reply = redisConnectHandshake(&c, SERVER_IP, SERVER_PORT, &hs);
         if (reply != NULL) {
                 printk(KERN_INFO "Connection error: %s", reply->reply);
                 return 1;
@@ -34,15 +107,12 @@ static int __init testredis_init(void)
 
         /* test 1 */
         printk(KERN_INFO "\n#1 Is able to deliver commands: ");
-        reply = redisCommand(fd, "PING");
+        reply = redisCommand(c, "PING");
         test_cond(reply->type == REDIS_REPLY_STRING &&
                   strcasecmp(reply->reply, "pong") == 0)
-            /* Switch to DB 9 for testing, now that we know we can chat. */
-        reply = redisCommand(fd, "SELECT 9");
-        freeReplyObject(reply);
 
         /* Make sure the DB is emtpy */
-        reply = redisCommand(fd, "DBSIZE");
+        reply = redisCommand(c, "DBSIZE");
         if (reply->type != REDIS_REPLY_INTEGER || reply->integer != 0) {
                 printk(KERN_INFO
                        "Sorry DB 9 is not empty, test can not continue\n");
@@ -54,24 +124,24 @@ static int __init testredis_init(void)
 
         /* test 2 */
         printk(KERN_INFO "#2 Is a able to send commands verbatim: ");
-        reply = redisCommand(fd, "SET foo bar");
+        reply = redisCommand(c, "SET foo bar");
         test_cond(reply->type == REDIS_REPLY_STRING &&
                   strcasecmp(reply->reply, "ok") == 0) freeReplyObject(reply);
 
         /* test 3 */
         printk(KERN_INFO "#3 %%s String interpolation works: ");
-        reply = redisCommand(fd, "SET %s %s", "foo", "hello world");
+        reply = redisCommand(c, "SET %s %s", "foo", "hello world");
         freeReplyObject(reply);
-        reply = redisCommand(fd, "GET foo");
+        reply = redisCommand(c, "GET foo");
         test_cond(reply->type == REDIS_REPLY_STRING &&
                   strcmp(reply->reply, "hello world") == 0);
         freeReplyObject(reply);
 
         /* test 4 & 5 */
         printk(KERN_INFO "#4 %%b String interpolation works: ");
-        reply = redisCommand(fd, "SET %b %b", "foo", 3, "hello\x00world", 11);
+        reply = redisCommand(c, "SET %b %b", "foo", 3, "hello\x00world", 11);
         freeReplyObject(reply);
-        reply = redisCommand(fd, "GET foo");
+        reply = redisCommand(c, "GET foo");
         test_cond(reply->type == REDIS_REPLY_STRING &&
                   memcmp(reply->reply, "hello\x00world", 11) == 0)
             printk(KERN_INFO "#5 binary reply length is correct: ");
@@ -79,31 +149,485 @@ static int __init testredis_init(void)
 
         /* test 6 */
         printk(KERN_INFO "#6 can parse nil replies: ");
-        reply = redisCommand(fd,"GET nokey");
+        reply = redisCommand(c,"GET nokey");
         printk(KERN_INFO "Received %c %d\n", reply->type, reply->type);
         test_cond(reply->type == REDIS_REPLY_NIL) freeReplyObject(reply);
 
         /* test 7 */
         printk(KERN_INFO "#7 can parse integer replies: ");
-        reply = redisCommand(fd, "INCR mycounter");
+        reply = redisCommand(c, "INCR mycounter");
         test_cond(reply->type == REDIS_REPLY_INTEGER
                   && reply->integer == 1) freeReplyObject(reply);
 
         /* test 8 */
         printk(KERN_INFO "#8 can parse multi bulk replies: ");
-        freeReplyObject(redisCommand(fd, "LPUSH mylist foo"));
-        freeReplyObject(redisCommand(fd, "LPUSH mylist bar"));
-        reply = redisCommand(fd, "LRANGE mylist 0 -1");
+        freeReplyObject(redisCommand(c, "LPUSH mylist foo"));
+        freeReplyObject(redisCommand(c, "LPUSH mylist bar"));
+        reply = redisCommand(c, "LRANGE mylist 0 -1");
         test_cond(reply->type == REDIS_REPLY_ARRAY &&
                   reply->elements == 2 &&
                   !memcmp(reply->element[0]->reply, "bar", 3) &&
                   !memcmp(reply->element[1]->reply, "foo", 3))
             freeReplyObject(reply);
 
+        /* test 9 */
+        printk(KERN_INFO "#9 can parse replies spanning many reads: ");
+        for (j = 0; j < 2000; j++)
+                freeReplyObject(redisCommand(c, "RPUSH biglist %s",
+                                             "element"));
+        reply = redisCommand(c, "LRANGE biglist 0 -1");
+        test_cond(reply->type == REDIS_REPLY_ARRAY &&
+                  reply->elements == 2000 &&
+                  !memcmp(reply->element[1999]->reply, "element", 7))
+            freeReplyObject(reply);
+
+        /* test 10 */
+        printk(KERN_INFO "#10 can set and get keys in batches: ");
+        {
+                const char *keys[] = { "bk1", "bk2", "bk3" };
+                const char *vals[] = { "one", "a longer value" };
+                size_t vallens[] = { 3, 14 };
+                char bufs[3][8];
+                redisBatchResult res[3];
+
+                for (j = 0; j < 3; j++) {
+                        res[j].buf = bufs[j];
+                        res[j].buflen = sizeof(bufs[j]);
+                }
+                test_cond(redisSetBatch(c, 2, keys, NULL, vals, vallens,
+                                        res) == 0 &&
+                          res[0].status == REDIS_BATCH_OK &&
+                          res[1].status == REDIS_BATCH_OK &&
+                          redisGetBatch(c, 3, keys, NULL, res) == 0 &&
+                          res[0].status == REDIS_BATCH_OK &&
+                          res[0].len == 3 && !memcmp(bufs[0], "one", 3) &&
+                          res[1].status == REDIS_BATCH_TRUNC &&
+                          res[1].len == 14 &&
+                          res[2].status == REDIS_BATCH_NIL)
+        }
+
+        /* test 11 */
+        printk(KERN_INFO "#11 can stream values larger than a page: ");
+        {
+                long long len, seen = 0;
+
+                test_cond(redisSetStream(c, "bigval", 6, 3 * PAGE_SIZE + 7,
+                                         stream_fill, NULL) == 0 &&
+                          redisGetStream(c, "bigval", 6, stream_check,
+                                         &seen, &len) == 1 &&
+                          len == 3 * PAGE_SIZE + 7 && seen == len)
+        }
+
+        /* test 12 */
+        printk(KERN_INFO "#12 can receive Pub/Sub messages: ");
+        {
+                redisSubscriber *sub = redisSubscriberCreate(SERVER_IP,
+                                                             SERVER_PORT);
+                struct pubsub_msg m = { "" };
+
+                init_completion(&m.done);
+                if (sub && redisSubscribe(sub, "testchan", pubsub_handler,
+                                          &m) == 0 &&
+                    redisSubscriberSync(sub, HZ) == 0) {
+                        freeReplyObject(redisCommand(c,
+                                                     "PUBLISH testchan hi"));
+                        wait_for_completion_timeout(&m.done, HZ);
+                }
+                test_cond(sub && sub->messages == 1 && !strcmp(m.msg, "hi"))
+                if (sub)
+                        redisSubscriberFree(sub);
+        }
+
+        /* test 13 */
+        printk(KERN_INFO "#13 can batch more keys than a single MGET takes: ");
+        {
+                int n = 2 * REDIS_BATCH_MAX_ARGS + 10, ok = 0;
+                const char **keys = kmalloc(n * sizeof(*keys), GFP_KERNEL);
+                redisBatchResult *res = kmalloc(n * sizeof(*res), GFP_KERNEL);
+                char buf[8];
+
+                if (keys && res) {
+                        /* bk1 was set to "one" by test 10 */
+                        for (j = 0; j < n; j++) {
+                                keys[j] = (j % 2) ? "bk1" : "nokey";
+                                res[j].buf = buf;
+                                res[j].buflen = sizeof(buf);
+                        }
+                        ok = redisGetBatch(c, n, keys, NULL, res) == 0;
+                        for (j = 0; j < n; j++)
+                                if (res[j].status != ((j % 2) ?
+                                    REDIS_BATCH_OK : REDIS_BATCH_NIL))
+                                        ok = 0;
+                }
+                test_cond(ok)
+                kfree(keys);
+                kfree(res);
+        }
+
+        /* test 14 */
+        printk(KERN_INFO "#14 can run a script the server does not have: ");
+        {
+                static const char incr[] =
+                        "return redis.call('INCR', KEYS[1])";
+                const char *key = "scriptkey";
+                redisScriptRegistry reg;
+                redisScript *s;
+                long long first = 0, second = 0;
+
+                redisScriptRegistryInit(&reg);
+                s = redisScriptRegister(&reg, incr, sizeof(incr) - 1);
+                if (s) {
+                        reply = redisCommand(c, "SCRIPT FLUSH");
+                        freeReplyObject(reply);
+                        /* NOSCRIPT then EVAL, then EVALSHA */
+                        reply = redisEvalScript(c, s, 1, 1, &key, NULL);
+                        if (reply && reply->type == REDIS_REPLY_INTEGER)
+                                first = reply->integer;
+                        if (reply)
+                                freeReplyObject(reply);
+                        reply = redisEvalScript(c, s, 1, 1, &key, NULL);
+                        if (reply && reply->type == REDIS_REPLY_INTEGER)
+                                second = reply->integer;
+                        if (reply)
+                                freeReplyObject(reply);
+                }
+                test_cond(first == 1 && second == 2)
+                redisScriptRegistryFree(&reg);
+        }
+
+        /* test 15 */
+        printk(KERN_INFO "#15 can pipeline a MULTI/EXEC transaction: ");
+        {
+                const char *set[3] = { "SET", "txkey", "10" };
+                const char *incr[2] = { "INCR", "txkey" };
+                redisTransaction *t = redisTransactionCreate(GFP_KERNEL);
+                int ok = 0;
+
+                if (t) {
+                        redisTransactionAppend(t, 3, set, NULL);
+                        redisTransactionAppend(t, 2, incr, NULL);
+                        reply = redisTransactionExec(c, t);
+                        ok = reply->type == REDIS_REPLY_ARRAY &&
+                            reply->elements == 2 &&
+                            reply->element[1]->type == REDIS_REPLY_INTEGER &&
+                            reply->element[1]->integer == 11;
+                        freeReplyObject(reply);
+                        redisTransactionFree(t);
+                }
+                /* the same under WATCH */
+                reply = redisTransactionRun(c, 1, &incr[1], NULL, tx_fill,
+                                            "txkey", 3);
+                test_cond(ok && reply && reply->type == REDIS_REPLY_ARRAY &&
+                          reply->elements == 1 &&
+                          reply->element[0]->integer == 12)
+                if (reply)
+                        freeReplyObject(reply);
+        }
+
+        /* test 16 */
+        printk(KERN_INFO "#16 can iterate over keys with SCAN: ");
+        {
+                redisScanIter *it;
+                redisReply *item, *val;
+                char key[16];
+                int n = 0, rc = -1;
+
+                for (j = 0; j < 25; j++) {
+                        sprintf(key, "scan:%d", j);
+                        reply = redisCommand(c, "SET %s x", key);
+                        freeReplyObject(reply);
+                }
+                /* small pages, so that several are prefetched */
+                it = redisScanCreate(c, REDIS_SCAN_KEYS, NULL, 0);
+                if (it) {
+                        redisScanSetMatch(it, "scan:*");
+                        redisScanSetCount(it, 5);
+                        while ((rc = redisScanNext(it, &item, &val)) == 1)
+                                n++;
+                        redisScanFree(it);
+                }
+                /* SCAN may return a key twice, never miss one */
+                test_cond(rc == 0 && n >= 25)
+        }
+
+        /* test 17 */
+        printk(KERN_INFO "#17 skips a value over the memory budget: ");
+        {
+                int ok;
+
+                /* bigval is 3 pages long, see test 11 */
+                redisSetMemoryBudget(c, redisMemoryUsed(c) + PAGE_SIZE);
+                reply = redisCommand(c, "GET bigval");
+                ok = redisIsOOMReply(reply) && !c->err;
+                freeReplyObject(reply);
+                redisSetMemoryBudget(c, 0);
+                reply = redisCommand(c, "PING");
+                test_cond(ok && reply->type == REDIS_REPLY_STRING &&
+                          !strcmp(reply->reply, "PONG"))
+                freeReplyObject(reply);
+        }
+
+        /* test 18 */
+        printk(KERN_INFO "#18 does not allocate for SET/GET with a pool: ");
+        {
+                const char *set[3] = { "SET", "poolkey", "value" };
+                const char *get[2] = { "GET", "poolkey" };
+                unsigned long allocs = 0;
+                int ok = redisContextSetPool(c, 4, 4) == 0;
+
+                for (j = 0; ok && j < 10; j++) {
+                        /* the buffers settle during the first round */
+                        if (j == 1)
+                                allocs = redisAllocCount(c);
+                        reply = redisCommandArgv(c, 3, set, NULL);
+                        freeReplyObject(reply);
+                        reply = redisCommandArgv(c, 2, get, NULL);
+                        ok = reply->type == REDIS_REPLY_STRING &&
+                            !strcmp(reply->reply, "value");
+                        freeReplyObject(reply);
+                }
+                test_cond(ok && redisAllocCount(c) == allocs)
+        }
+
+        /* test 19 */
+        printk(KERN_INFO "#19 parses unix, IPv4 and IPv6 addresses: ");
+        {
+                redisAddress a;
+
+                test_cond(!redisParseAddress(&a, "unix:/tmp/redis.sock", 0) &&
+                          a.family == AF_UNIX &&
+                          !redisParseAddress(&a, "127.0.0.1", 6379) &&
+                          a.family == AF_INET &&
+                          !redisParseAddress(&a, "[::1]", 6379) &&
+                          a.family == AF_INET6 &&
+                          !redisParseAddress(&a, "::1", 6379) &&
+                          a.u.in6.sin6_addr.s6_addr[15] == 1 &&
+                          redisParseAddress(&a, "127.0.0", 6379) == -1 &&
+                          redisParseAddress(&a, "unix:", 0) == -1)
+        }
+
+        /* test 20 */
+        printk(KERN_INFO "#20 connects with socket options: ");
+        {
+                redisSocketOptions opts = {
+                        .sndbuf = 256 * 1024,
+                        .rcvbuf = 256 * 1024,
+                        .keepalive = 1,
+                        .keepidle = 60,
+                        .keepintvl = 10,
+                        .keepcnt = 3,
+                        .quickack = 1,
+                        .cork = 1,
+                };
+                const char *set[3] = { "SET", "optkey", "value" };
+                redisContext *o = NULL;
+                redisAddress a;
+                int ok;
+
+                redisParseAddress(&a, SERVER_IP, SERVER_PORT);
+                reply = redisConnectAddress(&o, &a, &opts);
+                if (reply == NULL && (reply = redisRunHandshake(o, &hs)))
+                        redisFree(o);
+                ok = reply == NULL;
+                if (reply)
+                        freeReplyObject(reply);
+                /* every command is corked and must still go out */
+                if (ok) {
+                        reply = redisCommandArgv(o, 3, set, NULL);
+                        ok = reply->type == REDIS_REPLY_STRING &&
+                            !strcmp(reply->reply, "OK");
+                        freeReplyObject(reply);
+                        redisFree(o);
+                }
+                test_cond(ok)
+        }
+
+        /* test 21 */
+        printk(KERN_INFO "#21 serves a cached GET without the server: ");
+        {
+                static const char *const cached[] = { "GET", NULL };
+                redisCache *cache = redisCacheCreate(60000, 64 * 1024, cached);
+                unsigned long hits = 0, misses = 0;
+                int ok = cache != NULL;
+
+                if (ok) {
+                        redisSetCache(c, cache);
+                        reply = redisCommand(c, "SET cachekey old");
+                        freeReplyObject(reply);
+                        reply = redisCommand(c, "GET cachekey");
+                        freeReplyObject(reply);
+                        /* the cache does not see writes: still "old" */
+                        reply = redisCommand(c, "SET cachekey new");
+                        freeReplyObject(reply);
+                        reply = redisCommand(c, "GET cachekey");
+                        ok = reply->type == REDIS_REPLY_STRING &&
+                            !strcmp(reply->reply, "old");
+                        freeReplyObject(reply);
+                        redisCacheStats(cache, &hits, &misses);
+                        redisSetCache(c, NULL);
+                        redisCacheFree(cache);
+                }
+                test_cond(ok && hits == 1 && misses == 1)
+        }
+
+        /* test 22 */
+        printk(KERN_INFO "#22 sends a coalesced GET alone: ");
+        {
+                static const char *const coalesced[] = { "GET", NULL };
+                redisFlight *f = redisFlightCreate(coalesced);
+                int ok = f != NULL;
+
+                if (ok) {
+                        redisSetFlight(c, f);
+                        reply = redisCommand(c, "GET cachekey");
+                        ok = reply->type == REDIS_REPLY_STRING &&
+                            !strcmp(reply->reply, "new") &&
+                            redisFlightShared(f) == 0;
+                        freeReplyObject(reply);
+                        redisSetFlight(c, NULL);
+                        redisFlightFree(f);
+                }
+                test_cond(ok)
+        }
+
+        /* test 23 */
+        printk(KERN_INFO "#23 sends a command on a shared connection: ");
+        {
+                const char *get[2] = { "GET", "cachekey" };
+                redisContext *o = NULL;
+                redisShared *s = NULL;
+                int ok;
+
+                reply = redisConnectHandshake(&o, SERVER_IP, SERVER_PORT,
+                                              &hs);
+                ok = reply == NULL;
+                if (reply)
+                        freeReplyObject(reply);
+                if (ok && (s = redisSharedCreate(o, 0, 64 * 1024)) == NULL)
+                        redisFree(o);
+                ok = s != NULL;
+                if (ok) {
+                        reply = redisSharedCommandArgv(s, 2, get, NULL);
+                        ok = reply->type == REDIS_REPLY_STRING &&
+                            !strcmp(reply->reply, "new") &&
+                            s->commands == 1 && s->writes == 1;
+                        freeReplyObject(reply);
+                        redisSharedFree(s);
+                }
+                test_cond(ok)
+        }
+
+        /* test 24 */
+        printk(KERN_INFO "#24 compresses a large value: ");
+        {
+                redisCodec *codec = redisCodecCreate(REDIS_CODEC_ZLIB,
+                                                     Z_DEFAULT_COMPRESSION,
+                                                     1024);
+                redisCodecStats st;
+                char *val = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+                char *out = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+                size_t len = 0;
+                int ok = codec && val && out;
+
+                if (ok) {
+                        for (j = 0; j < 2 * PAGE_SIZE; j++)
+                                val[j] = "{\"key\":\"value\"},"[j % 16];
+                        ok = redisCodecSet(c, codec, "zipped", 6, val,
+                                           2 * PAGE_SIZE) == 0 &&
+                            redisCodecGet(c, codec, "zipped", 6, out,
+                                          2 * PAGE_SIZE, &len) == 1 &&
+                            len == 2 * PAGE_SIZE && !memcmp(out, val, len);
+                        /* the server holds the compressed form */
+                        reply = redisCommand(c, "STRLEN zipped");
+                        redisCodecGetStats(codec, &st);
+                        ok = ok && reply->type == REDIS_REPLY_INTEGER &&
+                            reply->integer == st.bytes_out &&
+                            st.bytes_out < st.bytes_in / 4;
+                        freeReplyObject(reply);
+                }
+                if (codec)
+                        redisCodecFree(codec);
+                kfree(val);
+                kfree(out);
+                test_cond(ok)
+        }
+
+        /* test 25 */
+        printk(KERN_INFO "#25 computes cluster slots and hashes: ");
+        test_cond(redisCrc16("123456789", 9) == 0x31C3 &&
+                  redisKeySlot("foo", 3) == 12182 &&
+                  redisKeySlot("{user1000}.following", 20) ==
+                  redisKeySlot("user1000", 8) &&
+                  redisKeySlot("foo{}{bar}", 10) ==
+                  (redisCrc16("foo{}{bar}", 10) & 16383) &&
+                  redisHash64("abc", 3, 0) == 0x44BC2CF5AD770999ULL)
+
+        /* test 26 */
+        printk(KERN_INFO "#26 sends a pipeline from a chain of pages: ");
+        {
+                const char *argv[3] = { "SET", "chained", "small" };
+                size_t argvlen[3] = { 3, 7, 5 };
+                redisChain *ch = redisChainCreate(GFP_KERNEL);
+                struct page *pages[2] = {
+                        alloc_page(GFP_KERNEL), alloc_page(GFP_KERNEL)
+                };
+                int ok = ch && pages[0] && pages[1];
+
+                if (ok) {
+                        memset(page_address(pages[0]), 'a', PAGE_SIZE);
+                        memset(page_address(pages[1]), 'b', PAGE_SIZE);
+                        /* the value spans both pages */
+                        ok = redisChainAppendCommandArgv(ch, 3, argv,
+                                                         argvlen) == 0 &&
+                            redisChainAppendCommandPages(ch, 2, argv,
+                                                         argvlen, pages, 10,
+                                                         PAGE_SIZE) == 0 &&
+                            redisChainSend(c, ch) == 0;
+                        for (j = 0; ok && j < ch->commands; j++) {
+                                reply = redisReadReply(c);
+                                ok = reply->type == REDIS_REPLY_STRING &&
+                                    !strcmp(reply->reply, "OK");
+                                freeReplyObject(reply);
+                        }
+                }
+                if (ok) {
+                        reply = redisCommand(c, "GET chained");
+                        ok = reply->type == REDIS_REPLY_STRING &&
+                            sdslen(reply->reply) == PAGE_SIZE &&
+                            reply->reply[PAGE_SIZE - 11] == 'a' &&
+                            reply->reply[PAGE_SIZE - 10] == 'b';
+                        freeReplyObject(reply);
+                }
+                if (ch)
+                        redisChainFree(ch);
+                if (pages[0])
+                        __free_page(pages[0]);
+                if (pages[1])
+                        __free_page(pages[1]);
+                test_cond(ok)
+        }
+
+        /* test 27 */
+        printk(KERN_INFO "#27 bulk loads pairs through a small window: ");
+        {
+                redisLoadStats st;
+                int next = 0;
+                int ok = redisBulkLoad(c, load_next, &next, 4096, &st) == 0 &&
+                    st.commands == 1000 && st.replies == 1000 &&
+                    st.errors == 0;
+
+                reply = redisCommand(c, "GET load:999");
+                test_cond(ok && reply->type == REDIS_REPLY_STRING &&
+                          !strcmp(reply->reply, "load:999"))
+                freeReplyObject(reply);
+        }
+
         /* Clean DB 9 */
-        reply = redisCommand(fd, "FLUSHDB");
+        reply = redisCommand(c, "FLUSHDB");
         freeReplyObject(reply);
 
+        redisFree(c);
+
         if (fails == 0) {
                 printk(KERN_INFO "ALL TESTS PASSED\n");
         } else {